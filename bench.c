@@ -0,0 +1,313 @@
+// Benchmark of the mp.h front end and evaluation backends over a plot-sized
+// sweep, next to hand-written C as the speed of light
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Counts the allocations made by mp.h
+void *bench_malloc(size_t size);
+void *bench_realloc(void *ptr, size_t size);
+void *bench_aligned_alloc(size_t alignment, size_t size);
+
+#define MP_MALLOC(size) bench_malloc(size)
+#define MP_REALLOC(ptr, size) bench_realloc(ptr, size)
+#define MP_ALIGNED_ALLOC(alignment, size) bench_aligned_alloc(alignment, size)
+
+#define MP_IMPLEMENTATION
+#include "mp.h"
+
+/* Macros */
+
+#define SAMPLE_COUNT (32*1024)
+#define REPEAT_COUNT 50
+#define FRONT_END_REPEAT_COUNT 2000
+#define RANGE_BEGIN -8.0
+#define RANGE_END 8.0
+#define DEEP_DEPTH 64    // Nesting of the synthetic deep expression
+#define WIDE_TERMS 128   // Terms of the synthetic wide expression
+#define EXPR_CAPACITY (8*1024)
+
+/* Declarations */
+
+typedef void (*batch_t)(const double *xs, double *ys, size_t n);
+
+typedef struct {
+    const char *name;
+    const char *expr;
+    batch_t baseline; // Same function in C, NULL if there is none
+} Bench_Case;
+
+typedef struct {
+    double seconds;
+    size_t allocations;
+} Bench_Result;
+
+double now(void);
+Bench_Result bench_tokenize(const char *expr);
+Bench_Result bench_parse(const char *expr);
+Bench_Result bench_compile(const char *expr, MP_Mode mode);
+Bench_Result bench_scalar(MP_Env *env);
+Bench_Result bench_batch(MP_Env *env);
+Bench_Result bench_interval(MP_Env *env);
+Bench_Result bench_dual(MP_Env *env);
+Bench_Result bench_baseline(batch_t f);
+void report(const char *name, Bench_Result result, double count, const char *unit);
+void make_deep(char *buf, size_t size);
+void make_wide(char *buf, size_t size);
+
+// The corpus written in C, with the loop in the same function so that the
+// compiler can vectorize it
+#define BASELINE(name, body)                                \
+    void name(const double *xs, double *ys, size_t n)       \
+    {                                                       \
+        for (size_t i = 0; i < n; ++i) {                    \
+            double x = xs[i];                               \
+            ys[i] = (body);                                 \
+        }                                                   \
+    }
+
+BASELINE(cubic, x*x*x - 3*x*x + 4)
+BASELINE(linear, 2*x - 3)
+BASELINE(sine, sin(x))
+BASELINE(tangent, tan(x))
+BASELINE(asymptote1, (2*x + 1) / (x*x - 4))
+BASELINE(asymptote2, (x*x*x - 2*x + 1) / (x*x - 1))
+BASELINE(asymptote3, (x*x + 1) / ((x*x - 1) * (x - 3)))
+BASELINE(trig, sin(x) * cos(x) + tan(x / 2))
+BASELINE(logs, log(x*x + 1) + sqrt(log10(x*x + 2)))
+
+/* Globals */
+
+char deep_expr[EXPR_CAPACITY];
+char wide_expr[EXPR_CAPACITY];
+
+Bench_Case cases[] = {
+    {"cubic", "x^3 - 3*x^2 + 4", cubic},
+    {"linear", "2*x - 3", linear},
+    {"sine", "sin(x)", sine},
+    {"tangent", "tan(x)", tangent},
+    {"asymptote1", "(2*x + 1) / (x^2 - 4)", asymptote1},
+    {"asymptote2", "(x^3 - 2*x + 1) / (x^2 - 1)", asymptote2},
+    {"asymptote3", "(x^2 + 1) / ((x^2 - 1) * (x - 3))", asymptote3},
+    {"asymptote3_mul", "(x*x + 1) / ((x*x - 1) * (x - 3))", asymptote3},
+    {"trig", "sin(x) * cos(x) + tan(x / 2)", trig},
+    {"logs", "ln(x^2 + 1) + sqrt(log(x^2 + 2))", logs},
+    {"deep", deep_expr, NULL},
+    {"wide", wide_expr, NULL},
+};
+
+double xs[SAMPLE_COUNT];
+double ys[SAMPLE_COUNT];
+size_t allocation_count = 0;
+
+int main(void)
+{
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+        xs[i] = RANGE_BEGIN + (RANGE_END - RANGE_BEGIN) * i / SAMPLE_COUNT;
+    }
+    make_deep(deep_expr, sizeof(deep_expr));
+    make_wide(wide_expr, sizeof(wide_expr));
+
+    printf("SIMD: %s\n", mp_simd_level_to_string(mp_simd_kernels()->level));
+
+    for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+        Bench_Case c = cases[i];
+        if (strlen(c.expr) > 60)
+            printf("%s: %.60s... (%zu chars)\n", c.name, c.expr, strlen(c.expr));
+        else
+            printf("%s: %s\n", c.name, c.expr);
+
+        MP_Env *interpreter = mp_init_mode(c.expr, MP_MODE_INTERPRET);
+        MP_Env *vm = mp_init_mode(c.expr, MP_MODE_COMPILE);
+        MP_Env *jit = mp_init_mode(c.expr, MP_MODE_JIT);
+        if (interpreter == NULL || vm == NULL || jit == NULL) {
+            fprintf(stderr, "ERROR: Could not compile '%s'\n", c.expr);
+            return EXIT_FAILURE;
+        }
+
+        double ops = FRONT_END_REPEAT_COUNT;
+        report("tokenize", bench_tokenize(c.expr), ops, "op");
+        report("parse", bench_parse(c.expr), ops, "op");
+        report("init interpret", bench_compile(c.expr, MP_MODE_INTERPRET), ops, "op");
+        report("init compile", bench_compile(c.expr, MP_MODE_COMPILE), ops, "op");
+        report("init jit", bench_compile(c.expr, MP_MODE_JIT), ops, "op");
+
+        double evals = (double)SAMPLE_COUNT * REPEAT_COUNT;
+        report("interpret", bench_scalar(interpreter), evals, "eval");
+        report("interpret batch", bench_batch(interpreter), evals, "eval");
+        report("vm", bench_scalar(vm), evals, "eval");
+        report("vm batch", bench_batch(vm), evals, "eval");
+        vm->vm.simd = mp_simd_kernels_for(MP_SIMD_NONE);
+        report("vm batch scalar", bench_batch(vm), evals, "eval");
+        report(jit->jit.fn != NULL ? "jit" : "jit (vm fallback)", bench_scalar(jit),
+               evals, "eval");
+        report("vm interval", bench_interval(vm), evals, "eval");
+        report("vm dual", bench_dual(vm), evals, "eval");
+        if (c.baseline != NULL)
+            report("c", bench_baseline(c.baseline), evals, "eval");
+
+        mp_free(interpreter);
+        mp_free(vm);
+        mp_free(jit);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void *bench_malloc(size_t size)
+{
+    allocation_count++;
+    return malloc(size);
+}
+
+void *bench_realloc(void *ptr, size_t size)
+{
+    allocation_count++;
+    return realloc(ptr, size);
+}
+
+void *bench_aligned_alloc(size_t alignment, size_t size)
+{
+    allocation_count++;
+    return aligned_alloc(alignment, size);
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+Bench_Result bench_tokenize(const char *expr)
+{
+    size_t allocations = allocation_count;
+    double start = now();
+    for (size_t r = 0; r < FRONT_END_REPEAT_COUNT; ++r) {
+        MP_Token_List list = {0};
+        mp_tokenize(&list, expr);
+        mp_da_free(&list);
+    }
+    return (Bench_Result){now() - start, allocation_count - allocations};
+}
+
+// Parses into one arena that is reset in between, like repeated parses in an
+// application would
+Bench_Result bench_parse(const char *expr)
+{
+    MP_Arena arena = {0};
+    size_t allocations = allocation_count;
+    double start = now();
+    for (size_t r = 0; r < FRONT_END_REPEAT_COUNT; ++r) {
+        MP_Parse_Tree tree = {0};
+        mp_parse(&arena, &tree, expr);
+        mp_arena_reset(&arena);
+    }
+    Bench_Result result = {now() - start, allocation_count - allocations};
+    mp_arena_free(&arena);
+    return result;
+}
+
+Bench_Result bench_compile(const char *expr, MP_Mode mode)
+{
+    size_t allocations = allocation_count;
+    double start = now();
+    for (size_t r = 0; r < FRONT_END_REPEAT_COUNT; ++r) {
+        mp_free(mp_init_mode(expr, mode));
+    }
+    return (Bench_Result){now() - start, allocation_count - allocations};
+}
+
+Bench_Result bench_scalar(MP_Env *env)
+{
+    size_t allocations = allocation_count;
+    double start = now();
+    for (size_t r = 0; r < REPEAT_COUNT; ++r) {
+        for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+            mp_variable(env, 'x', xs[i]);
+            ys[i] = mp_evaluate(env).value;
+        }
+    }
+    return (Bench_Result){now() - start, allocation_count - allocations};
+}
+
+Bench_Result bench_batch(MP_Env *env)
+{
+    size_t allocations = allocation_count;
+    double start = now();
+    for (size_t r = 0; r < REPEAT_COUNT; ++r) {
+        mp_evaluate_batch(env, 'x', xs, ys, SAMPLE_COUNT);
+    }
+    return (Bench_Result){now() - start, allocation_count - allocations};
+}
+
+// Bounds the function between every two neighbouring samples, like the
+// plotter does to find discontinuities
+Bench_Result bench_interval(MP_Env *env)
+{
+    size_t allocations = allocation_count;
+    double start = now();
+    for (size_t r = 0; r < REPEAT_COUNT; ++r) {
+        for (size_t i = 0; i + 1 < SAMPLE_COUNT; ++i) {
+            MP_Interval y;
+            mp_evaluate_interval(env, 'x', xs[i], xs[i + 1], &y);
+            ys[i] = y.hi;
+        }
+    }
+    return (Bench_Result){now() - start, allocation_count - allocations};
+}
+
+// Value and derivative in one pass
+Bench_Result bench_dual(MP_Env *env)
+{
+    size_t allocations = allocation_count;
+    double start = now();
+    for (size_t r = 0; r < REPEAT_COUNT; ++r) {
+        for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+            MP_Dual y;
+            mp_evaluate_dual(env, 'x', xs[i], &y);
+            ys[i] = y.derivative;
+        }
+    }
+    return (Bench_Result){now() - start, allocation_count - allocations};
+}
+
+Bench_Result bench_baseline(batch_t f)
+{
+    double start = now();
+    for (size_t r = 0; r < REPEAT_COUNT; ++r) {
+        f(xs, ys, SAMPLE_COUNT);
+    }
+    return (Bench_Result){now() - start, 0};
+}
+
+void report(const char *name, Bench_Result result, double count, const char *unit)
+{
+    printf("    %-18s %10.2f ns/%-4s %12.0f %s/sec %8.2f allocs/%s\n",
+           name, result.seconds * 1e9 / count, unit, count / result.seconds,
+           unit, (double)result.allocations / count, unit);
+}
+
+// Horner form nested DEEP_DEPTH levels: ((x + 1)*x + 2)*x + ...
+void make_deep(char *buf, size_t size)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < DEEP_DEPTH; ++i)
+        len += snprintf(buf + len, size - len, "(");
+    len += snprintf(buf + len, size - len, "x");
+    for (size_t i = 0; i < DEEP_DEPTH; ++i)
+        len += snprintf(buf + len, size - len, " + %zu)*x", i + 1);
+}
+
+// WIDE_TERMS alternating terms x^(i%8 + 1)/i after the first x, so the powers
+// cycle through 1 to 8: x - x^3/2 + x^4/3 - ... + x^8/7 - x^1/8 + x^2/9 - ...
+void make_wide(char *buf, size_t size)
+{
+    size_t len = snprintf(buf, size, "x");
+    for (size_t i = 2; i <= WIDE_TERMS; ++i) {
+        len += snprintf(buf + len, size - len, " %c x^%zu/%zu",
+                        i % 2 == 0 ? '-' : '+', i % 8 + 1, i);
+    }
+}
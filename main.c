@@ -6,12 +6,22 @@
 // TODO: Auto grid spacing doesn't scale well
 // TODO: Scaling moves camera towards the origin
 
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <pthread.h>
 #include <raylib.h>
 #include <raymath.h>
+#include <rlgl.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define MP_IMPLEMENTATION
 #include "mp.h"
@@ -32,10 +42,47 @@
 #define TOGGLE_DEBUG_MENU_DEFAULT false
 #define TOGGLE_GRID_DEFAULT true
 #define TOGGLE_INPUT_DEFAULT false
+#define TOGGLE_ADAPTIVE_DEFAULT false
+#define TOGGLE_ANALYSIS_DEFAULT false
+#define TOGGLE_HEATMAP_DEFAULT false
 #define CACHE_CAPACITY (32*1024)
-#define INPUT_CAPACITY 32
+#define POINTS_CAPACITY (2*CACHE_CAPACITY) // Samples plus breaks between them
+#define ADAPTIVE_BUDGET (16*1024)   // Evaluations per adaptive pass
+#define ADAPTIVE_INITIAL_SPACING 4.0 // Pixels between the first samples
+#define ADAPTIVE_MIN_SPACING 0.0625 // Pixels, intervals are not split below this
+#define ADAPTIVE_TOLERANCE 0.5      // Pixels between the curve and its segments
+#define BREAK_MIN_JUMP 1.0          // Pixels, smaller jumps over a hole are not marked
+#define BREAK_BLOCK 64              // Grid samples checked for a discontinuity at once
+#define INPUT_CAPACITY 256
+#define CURVE_CAPACITY 32
+#define ENV_CACHE_CAPACITY (2*CURVE_CAPACITY) // Room for the curves and some history
+#define EVAL_MODE_DEFAULT MP_MODE_COMPILE
+#define WORKER_CAPACITY 64
+#define WORKER_MIN_SAMPLES 1024 // Evaluations, smaller chunks are not worth a thread
+#define BATCH_MIN_ITEMS 64       // Expressions per batch compile thread
+#define EXPORT_GRID_LINES 10     // Roughly, across the width of an export
+#define EXPORT_CHUNK (16*1024)   // Samples evaluated and written at a time
+#define PROFILE_FRAMES 120       // Frames kept for the overlay and the trace
+#define PROFILE_TRACE_PATH "cplot-trace.json"
+#define ANALYSIS_CAPACITY 1024    // Markers found in the visible curves
+#define ANALYSIS_BUDGET 0.002     // Seconds per frame spent finding markers
+#define ANALYSIS_CHECK_EVERY 64   // Points scanned between looks at the clock
+#define ANALYSIS_ITERATIONS 64    // Steps of the solver per marker
+#define ANALYSIS_TOLERANCE 1.0    // Pixels, a root further off the axis is a jump
+#define ANALYSIS_HOVER_DISTANCE 10.0 // Pixels from the mouse to a labelled marker
+#define PARAMETER_VALUE_DEFAULT 1.0
+#define PARAMETER_RANGE_DEFAULT 5.0 // Sliders go from -range to range
+#define PARAMETER_SPEED 0.25        // Slider lengths per second when animated
+#define FIELD_CELL 2.0              // Pixels between the samples of a field
+#define FIELD_TILE_CELLS 64         // Cells along a side of a tile
+#define FIELD_TILE_POINTS (FIELD_TILE_CELLS + 1)
+#define FIELD_TILE_CAPACITY 512     // Tiles kept at least, on screen or not
+#define FIELD_TILE_SPARE 256        // Tiles kept off screen beyond the visible ones
+#define FIELD_HEAT_SCALE 1.0        // |f| that gets half of the heatmap color
 
 // Styling
+#define BACKGROUND_COLOR GetColor(0x181818FF)
+#define FUNCTION_COLOR YELLOW // Color of the first curve
 #define GRID_COLOR DARKGRAY
 #define AXES_COLOR WHITE
 #define NUMBER_COLOR GRAY
@@ -45,12 +92,326 @@
 #define ASYMPTOTE_POINT_COLOR LIGHTGRAY
 #define TEXT_BOX_BACKGROUND LIGHTGRAY
 #define TEXT_BOX_COLOR BLACK
+#define PROFILE_GRAPH_HEIGHT 100 // Pixels for two frames at 60 FPS
+#define PROFILE_BAR_WIDTH 3
+#define PROFILE_IDLE_COLOR GRAY
+#define MARKER_RADIUS 4.0f
+#define MARKER_ROOT_COLOR WHITE
+#define MARKER_EXTREMUM_COLOR RED
+#define MARKER_INTERSECTION_COLOR MAGENTA
+#define SLIDER_WIDTH 200
+#define SLIDER_HEIGHT 6
+#define SLIDER_SPACING 30
+#define SLIDER_MARGIN 20
+#define SLIDER_LABEL_WIDTH 130
+#define SLIDER_KNOB_RADIUS 7.0f
+#define SLIDER_COLOR GRAY
+#define SLIDER_ANIMATED_COLOR GOLD
+#define SLIDER_KNOB_COLOR WHITE
+#define HEAT_NEGATIVE_COLOR BLUE
+#define HEAT_POSITIVE_COLOR RED
+#define HEAT_ALPHA 0.6f
 
 /* Declarations */
 
+// The plotted curve is a list of points where y = NAN marks an undefined
+// sample (a gap) and y = INFINITY a discontinuity (a gap with a marker)
+
+typedef enum {
+    INTERVAL_DONE,
+    INTERVAL_REFINE,
+    INTERVAL_BREAK,
+} Interval_State;
+
+typedef struct {
+    double x;
+    double y;
+    Interval_State state; // State of the interval starting at this point
+    MP_Interval bound;    // Bounds of the curve over that interval
+} Adaptive_Point;
+
 typedef double (*func_t)(double);
 
-void text_box(void);
+// The curve as a single triangle list, two triangles per segment. Vertices
+// are in scaled world space (screen space without the camera and window
+// offset), so panning only changes the transform the mesh is drawn with.
+// The quads are a ring of slots, a pan replaces the ones at the ends and the
+// free slots hold empty quads.
+typedef struct {
+    Mesh mesh;
+    Material material;
+    int capacity;  // Vertices allocated on the GPU
+    size_t head;   // Slot of the quad of the first segment
+    Vector2 scale; // Scale the vertices were computed with
+} Curve_Mesh;
+
+// How the vertices of a curve changed at its ends, the ones in between are
+// kept in order
+typedef struct {
+    size_t front_removed;
+    size_t front_added;
+    size_t back_removed;
+    size_t back_added;
+} Curve_Splice;
+
+typedef struct Pool Pool;
+
+typedef struct {
+    pthread_t thread;
+    Pool *pool;
+    size_t generation; // Last pass seen by this worker
+} Worker;
+
+// Persistent workers, woken up once per sampling pass. The workers and the
+// main thread take chunks of the pass until there are none left. A pass
+// samples strips of curves, a level of the adaptive sampling of curves, or
+// tiles of fields.
+struct Pool {
+    Worker workers[WORKER_CAPACITY];
+    size_t worker_count;
+    size_t pending;     // Workers that have not finished the current pass
+    size_t generation;
+    size_t next_strip;  // Next chunk of the current pass
+    size_t next_pass;
+    size_t next_offset;
+    size_t next_tile;
+    bool quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+};
+
+// Samples are stored on the grid x = k * resolution, so a point computed once
+// stays valid until the expression or the resolution changes. The points live
+// in a ring buffer, panning drops and adds points at either end in place.
+typedef struct {
+    Vector2 items[CACHE_CAPACITY];
+    size_t head;       // Ring index of the first point
+    size_t count;
+    long long first;   // Grid index of the first point
+    double resolution; // Grid spacing the points were sampled with
+} Sample_Cache;
+
+// A slice of a batch compiled by one thread, in its own arena
+typedef struct {
+    pthread_t thread;
+    MP_Batch_Item *items;
+    size_t count;
+    size_t compiled;
+    MP_Arena arena;
+    bool started; // Whether it runs on its own thread
+} Batch_Job;
+
+// A compiled expression with the samples it had when it was last plotted
+typedef struct {
+    char expr[INPUT_CAPACITY + 1];
+    MP_Env *env;
+    MP_Env *clones[WORKER_CAPACITY]; // One per worker, made on first use
+    Sample_Cache *samples;
+    uint32_t reads;   // Variables of the expression, see mp_variables
+    size_t version;   // Changes whenever the values of the expression do
+    size_t last_used; // 0 if the entry is free
+} Env_Entry;
+
+// One plotted expression
+typedef struct {
+    Env_Entry *entry;   // NULL if the expression does not compile
+    Color color;
+    bool stale;         // The expression changed since it was last sampled
+    bool rebuild;       // The vertices changed since the mesh was built
+    bool spliced;       // Only their ends did, as told by splice
+    Curve_Splice splice;
+    size_t point_count;
+    Vector2 *vertices;  // Decimated points that are drawn
+    size_t vertex_count;
+    size_t vertex_capacity;
+    Vector2 scale;      // Scale the vertices were decimated with
+    Curve_Mesh mesh;
+
+    // The grid points the vertices were decimated from, so that a pan only
+    // decimates the columns at the ends
+    const Env_Entry *source; // NULL if they are not from a sample cache
+    size_t source_version;
+    double source_resolution;
+    long long source_first;
+    size_t source_count;
+} Curve;
+
+// The adaptive sampling of one curve. All the curves are refined together,
+// one level at a time, and xs holds the samples of the level being evaluated.
+typedef struct {
+    Env_Entry *entry;
+    size_t curve;           // Index into curves
+    Adaptive_Point *current;
+    Adaptive_Point *next;
+    size_t count;           // Points in current
+    double *xs;
+    double *ys;
+    size_t sample_count;    // Samples in xs
+    size_t evaluations;
+} Adaptive_Pass;
+
+// Grid points [k, k + count) that some curves are missing. The curves share
+// the x values, so they are evaluated together.
+typedef struct {
+    long long k;
+    size_t count;
+    double resolution;
+    size_t curves[CURVE_CAPACITY]; // Indices into curves
+    size_t curve_count;
+} Sample_Strip;
+
+typedef enum {
+    PROFILE_INPUT,
+    PROFILE_GRID,
+    PROFILE_LABELS,
+    PROFILE_SAMPLING,
+    PROFILE_CURVE,
+    PROFILE_ANALYSIS,
+    PROFILE_STAGE_COUNT,
+} Profile_Stage;
+
+// Timings of one frame, relative to its start and in seconds
+typedef struct {
+    double begin;      // GetTime() at the start of the frame
+    double frame_time; // Until the start of the next frame, 0 if not over yet
+    double stage_begin[PROFILE_STAGE_COUNT];
+    double stage_time[PROFILE_STAGE_COUNT];
+    size_t evaluations;  // Samples evaluated
+    size_t cache_hits;   // Samples kept by the sample cache on a pan
+    size_t cache_misses; // Samples the sample cache had to evaluate
+} Frame_Profile;
+
+typedef enum {
+    MARKER_ROOT,
+    MARKER_MINIMUM,
+    MARKER_MAXIMUM,
+    MARKER_INTERSECTION,
+    MARKER_KIND_COUNT,
+} Marker_Kind;
+
+// A point of interest of a curve, or of two curves for an intersection
+typedef struct {
+    Marker_Kind kind;
+    double x;
+    double y;
+    size_t curve;
+    size_t other; // The second curve of an intersection
+} Marker;
+
+// Finds the markers of the plotted curves a little every frame. Every curve
+// and every pair of curves is a task, taken in order. The vertices of a task
+// are scanned for candidates, which are solved for on the expressions before
+// the scan goes on.
+typedef struct {
+    Marker markers[ANALYSIS_CAPACITY];
+    size_t marker_count;
+    bool done;
+    size_t curve;      // The task: roots and extrema of curve if other is
+    size_t other;      // the same, intersections of the two otherwise
+    size_t i;          // Next vertex of curve
+    size_t j;          // Next vertex of other
+    double prev_x;     // Last point of the difference of the two curves
+    double prev_d;
+    size_t task_first; // First marker of the task
+} Analysis;
+
+// A free variable of the expressions other than x and y, set with a slider. Its
+// value is written into the compiled expressions, which are not compiled
+// again when it changes.
+typedef struct {
+    double value;
+    double range;     // The slider goes from -range to range
+    bool animated;    // Sweeps the slider back and forth by itself
+    double direction; // Of the sweep, 1 or -1
+} Parameter;
+
+// A square of a scalar field f(x, y), FIELD_TILE_CELLS cells on a side.
+// Tiles sit on a grid in world space, so a tile stays valid while the view
+// pans and only the tiles that come into view are evaluated.
+typedef struct {
+    Env_Entry *entry;  // NULL if the tile is free
+    size_t version;    // Of the entry when the tile was evaluated
+    double cell_x;     // World size of a cell
+    double cell_y;
+    long long tx;      // Position on the grid of tiles
+    long long ty;
+    size_t next;       // Next tile of the bucket, plus one
+    size_t last_used;  // Pass of plot_fields that last needed the tile
+    float values[FIELD_TILE_POINTS * FIELD_TILE_POINTS]; // Rows from the bottom
+    Vector2 *segments; // Pairs of points of f = 0, in world space
+    size_t segment_count;
+    size_t segment_capacity;
+    Texture2D texture; // Heatmap, loaded when it is first drawn
+    bool has_texture;
+    bool heat_ready;   // Whether the texture shows the current values
+} Field_Tile;
+
+void usage(const char *program);
+int batch_compile(const char *path);
+void *batch_main(void *arg);
+char *read_input(const char *path, size_t *size, bool *mapped);
+void free_input(char *data, size_t size, bool mapped);
+bool export_plot(const char *path);
+bool export_png(const char *path);
+bool export_svg(const char *path);
+void export_grid(double *left, double *right, double *bottom, double *top);
+void export_line(Image *image, Vector2 a, Vector2 b, Color color);
+bool export_samples(MP_Env *parser, double x0, double x1, size_t count,
+                    double step, bool binary, const char *path);
+int screen_width(void);
+int screen_height(void);
+void pool_init(Pool *pool);
+void pool_work(Pool *pool, size_t thread);
+void pool_run(Pool *pool);
+void pool_free(Pool *pool);
+void *worker_main(void *arg);
+void sample_curves(bool all, bool *changed);
+double sample_resolution(double x1, double x2);
+void sample_strips(void);
+void sample_strip(const Sample_Strip *strip, size_t offset, size_t count,
+                  size_t thread);
+void strip_add(long long k, size_t count, double resolution, size_t curve);
+Vector2 sample_cache_at(const Sample_Cache *cache, size_t i);
+bool sample_cache_move(Sample_Cache *cache, long long k1, long long k2,
+                       double resolution, size_t curve);
+bool text_box(void);
+bool curves_set(const char **exprs, size_t count);
+bool curve_is_field(const Curve *curve);
+bool curves_stale(void);
+void curve_update(Curve *curve, const Vector2 *points, size_t count);
+bool curve_pan(Curve *curve);
+void curve_source(Curve *curve);
+void curves_free(void);
+Env_Entry *env_cache_get(const char *expr);
+bool env_cache_in_use(const Env_Entry *entry);
+bool env_entry_clone(Env_Entry *entry);
+void env_entry_free(Env_Entry *entry);
+void env_cache_free(void);
+void env_parameters(MP_Env *env);
+void parameters_init(void);
+void parameter_set(char var, double value);
+size_t parameter_list(char *vars);
+Rectangle parameter_slider(size_t slot);
+bool parameters_input(void);
+void parameters_animate(double dt);
+void parameters_draw(void);
+Frame_Profile *profile_current(void);
+void profile_frame_begin(void);
+void profile_begin(Profile_Stage stage);
+void profile_end(Profile_Stage stage);
+Frame_Profile profile_total(size_t *frame_count);
+void profile_draw(int x, int y);
+bool profile_dump(const char *path);
+void analysis_restart(void);
+void analysis_step(double budget);
+bool analysis_scan_curve(double deadline);
+bool analysis_scan_pair(double deadline);
+void analysis_bracket(Marker_Kind kind, double x1, double x2);
+double analysis_solve(Marker_Kind kind, double a, double b);
+double analysis_eval(Marker_Kind kind, double x, double *slope);
+void analysis_draw(void);
+void analysis_print(void);
 
 Vector2 pjv(double x, double y);
 double pjx(double x);
@@ -59,7 +420,45 @@ Vector2 rpjv(double x, double y);
 double rpjx(double x);
 double rpjy(double y);
 void plot(func_t f, Color color, double resolution);
-size_t plot_parser(MP_Env *parser, Vector2 *buf, size_t buf_size, double resolution);
+void plot_curves(bool all);
+void plot_fields(void);
+bool fields_reserve(size_t count);
+Field_Tile *field_tile_get(Env_Entry *entry, double cell_x, double cell_y,
+                           long long tx, long long ty, bool *fresh);
+size_t field_tile_hash(const Env_Entry *entry, long long tx, long long ty);
+void field_tile_fill(Field_Tile *tile, size_t thread);
+void field_tile_contour(Field_Tile *tile, MP_Env *parser);
+void field_tile_segment(Field_Tile *tile, Vector2 a, Vector2 b);
+void fields_draw(void);
+Color heat_color(double value);
+void fields_free(void);
+size_t plot_cache(MP_Env *parser, const Sample_Cache *cache, size_t from,
+                  size_t to, Vector2 *buf, size_t buf_size);
+void plot_adaptive(bool all);
+bool adaptive_pass_init(Adaptive_Pass *pass);
+size_t adaptive_midpoints(Adaptive_Pass *pass);
+void adaptive_evaluate(void);
+void adaptive_refine(Adaptive_Pass *pass, double min_dx);
+double pixel_column(double x);
+size_t decimate(const Vector2 *points, size_t count, Vector2 *buf, size_t buf_size);
+void curve_mesh_init(Curve_Mesh *curve, size_t point_capacity);
+void curve_mesh_build(Curve_Mesh *curve, const Vector2 *points, size_t count);
+void curve_mesh_splice(Curve_Mesh *curve, const Vector2 *points, size_t count,
+                       Curve_Splice splice);
+void curve_mesh_quad(Curve_Mesh *curve, const Vector2 *points, size_t count,
+                     long long i);
+void curve_mesh_upload(Curve_Mesh *curve, long long first, long long last);
+void curve_mesh_draw(Curve_Mesh *curve, Color color);
+void curve_mesh_free(Curve_Mesh *curve);
+Interval_State adaptive_test(Adaptive_Point a, Adaptive_Point m,
+                             Adaptive_Point b, double min_dx);
+void adaptive_bound(MP_Env *parser, Adaptive_Point *points, size_t first,
+                    size_t last);
+void evaluate(MP_Env *parser, const double *xs, double *ys, size_t n);
+MP_Interval evaluate_interval(MP_Env *parser, double x1, double x2);
+MP_Dual evaluate_dual(MP_Env *parser, double x);
+double interpolate(const Vector2 *points, size_t count, size_t k, double x);
+bool is_break(MP_Env *parser, Vector2 p1, Vector2 p2);
 double max(double a, double b);
 double map(double value, double x1, double x2, double y1, double y2);
 bool is_near(double x, double target);
@@ -82,27 +481,260 @@ bool toggle_continuous = TOGGLE_CONTINUOUS_DEFAULT;
 bool toggle_debug_menu = TOGGLE_DEBUG_MENU_DEFAULT;
 bool toggle_grid = TOGGLE_GRID_DEFAULT;
 bool toggle_input = TOGGLE_INPUT_DEFAULT;
+bool toggle_adaptive = TOGGLE_ADAPTIVE_DEFAULT;
+bool toggle_analysis = TOGGLE_ANALYSIS_DEFAULT;
+bool toggle_heatmap = TOGGLE_HEATMAP_DEFAULT;
+MP_Mode eval_mode = EVAL_MODE_DEFAULT;
+Pool pool = {0};
 
-Vector2 cache[CACHE_CAPACITY];
-size_t cache_count = 0;
+Curve curves[CURVE_CAPACITY];
+size_t curve_count = 0;
+Color curve_colors[] = {
+    FUNCTION_COLOR, SKYBLUE, ORANGE, LIME, PINK, VIOLET, RED, BEIGE,
+    GOLD, BLUE, MAGENTA, GREEN, PURPLE, MAROON,
+};
+Sample_Strip strips[2 * CURVE_CAPACITY]; // Up to two per curve
+size_t strip_count = 0;
+Vector2 points[POINTS_CAPACITY]; // Samples of the curve being decimated
+Adaptive_Pass adaptive_passes[CURVE_CAPACITY]; // Indexed like curves
+Adaptive_Pass *adaptive_batch[CURVE_CAPACITY];  // Passes evaluated by the pass
+size_t adaptive_batch_count = 0;
 Vector2 prev_camera = {1.0f, 1.0f};
 Vector2 prev_scale = {0};
 Vector2 prev_window_size = {0};
 bool has_panned = false;
 bool input_error = false;
 
+// Size of the image when exporting without a window, 0 with a window
+int headless_width = 0;
+int headless_height = 0;
+
+// Recently used expressions, so going back to one does not recompile or
+// resample it
+Env_Entry env_cache[ENV_CACHE_CAPACITY];
+size_t env_tick = 0;
+
+// Ring buffer of the last frames, profile_frame counts every frame
+Frame_Profile profile[PROFILE_FRAMES];
+size_t profile_frame = 0;
+const char *profile_names[PROFILE_STAGE_COUNT] = {
+    "Input", "Grid", "Labels", "Sampling", "Curve", "Analysis"
+};
+Color profile_colors[PROFILE_STAGE_COUNT] = {
+    SKYBLUE, DARKGRAY, PURPLE, ORANGE, YELLOW, PINK
+};
+
+Analysis analysis = {0};
+
+// Indexed by letter, parameter_mask has the ones the curves read
+Parameter parameters[26];
+uint32_t parameter_mask = 0;
+char parameter_drag = '\0'; // Parameter whose slider is being dragged
+
+// World-space tile map of the fields, a hash table chained through
+// Field_Tile.next. The visible tiles are listed with their curve every pass.
+// The map grows with the number of tiles the viewport needs.
+Field_Tile *field_tiles = NULL;
+size_t field_tile_capacity = 0;
+size_t *field_buckets = NULL; // First tile of a bucket, plus one
+size_t field_bucket_count = 0;
+size_t field_tick = 0;
+Field_Tile **field_visible = NULL;
+size_t *field_visible_curves = NULL;
+size_t field_visible_count = 0;
+Field_Tile **tile_jobs = NULL; // Tiles evaluated by the pass
+size_t tile_job_count = 0;
+const char *marker_names[MARKER_KIND_COUNT] = {
+    "Root", "Minimum", "Maximum", "Intersection"
+};
+Color marker_colors[MARKER_KIND_COUNT] = {
+    MARKER_ROOT_COLOR, MARKER_EXTREMUM_COLOR, MARKER_EXTREMUM_COLOR,
+    MARKER_INTERSECTION_COLOR
+};
+
 char input[INPUT_CAPACITY + 1] = "\0";
 
 int main(int argc, char **argv)
 {
     /* Argv */
 
-    const char *expr = NULL;
+    const char *exprs[CURVE_CAPACITY];
+    size_t expr_count = 0;
+    const char *batch_path = NULL;
+    const char *output_path = NULL;
+    double viewport[4] = {-8.0, 8.0, -8.0, 8.0}; // x0, x1, y0, y1
+    int output_width = WINDOW_WIDTH;
+    int output_height = WINDOW_HEIGHT;
+    double sample_range_x[2] = {0};
+    bool has_sample_range = false;
+    size_t sample_count = 0; // 0 to step by the resolution instead
+    bool binary = false;
+
+    parameters_init();
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "interpret") == 0) {
+                eval_mode = MP_MODE_INTERPRET;
+            } else if (strcmp(mode, "compile") == 0) {
+                eval_mode = MP_MODE_COMPILE;
+            } else if (strcmp(mode, "jit") == 0) {
+                eval_mode = MP_MODE_JIT;
+            } else {
+                fprintf(stderr, "ERROR: Unknown evaluation mode '%s'\n", mode);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &output_width, &output_height) != 2
+                    || output_width <= 0 || output_height <= 0) {
+                fprintf(stderr, "ERROR: Invalid size '%s'\n", argv[i]);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%lf,%lf,%lf,%lf", &viewport[0], &viewport[1],
+                       &viewport[2], &viewport[3]) != 4
+                    || !(viewport[0] < viewport[1]) || !(viewport[2] < viewport[3])) {
+                fprintf(stderr, "ERROR: Invalid viewport '%s'\n", argv[i]);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            resolution = atof(argv[++i]);
+            if (!(resolution > 0.0)) {
+                fprintf(stderr, "ERROR: Invalid resolution '%s'\n", argv[i]);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            has_sample_range = sscanf(argv[++i], "%lf,%lf", &sample_range_x[0],
+                                      &sample_range_x[1]) == 2
+                               && sample_range_x[0] <= sample_range_x[1]
+                               && isfinite(sample_range_x[1] - sample_range_x[0]);
+            if (!has_sample_range) {
+                fprintf(stderr, "ERROR: Invalid range '%s'\n", argv[i]);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            // strtoull would take "-5" for a huge count, so only digits pass
+            const char *count = argv[++i];
+            errno = 0;
+            unsigned long long n = strtoull(count, NULL, 10);
+            sample_count = (size_t)n;
+            if (count[strspn(count, "0123456789")] != '\0' || errno == ERANGE
+                    || n == 0 || n > SIZE_MAX) {
+                fprintf(stderr, "ERROR: Invalid sample count '%s'\n", argv[i]);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "csv") == 0) {
+                binary = false;
+            } else if (strcmp(format, "bin") == 0) {
+                binary = true;
+            } else {
+                fprintf(stderr, "ERROR: Unknown sample format '%s'\n", format);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            char var = '\0';
+            double value = 0.0;
+            if (sscanf(argv[++i], "%c=%lf", &var, &value) != 2
+                    || var < 'a' || var > 'z' || var == 'x' || var == 'y'
+                    || !isfinite(value)) {
+                fprintf(stderr, "ERROR: Invalid parameter '%s'\n", argv[i]);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            parameter_set(var, value);
+        } else if (expr_count < CURVE_CAPACITY) {
+            exprs[expr_count++] = argv[i];
+        } else {
+            fprintf(stderr, "ERROR: At most %d expressions can be plotted\n",
+                    CURVE_CAPACITY);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (batch_path != NULL) {
+        return batch_compile(batch_path);
+    }
+
+    // Stream the samples themselves instead of a picture
+    if (has_sample_range) {
+        if (expr_count != 1) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        MP_Env *parser = mp_init_mode(exprs[0], eval_mode);
+        if (parser == NULL) {
+            fprintf(stderr, "ERROR: Invalid expression '%s'\n", exprs[0]);
+            return EXIT_FAILURE;
+        }
+        env_parameters(parser);
+
+        bool ok = export_samples(parser, sample_range_x[0], sample_range_x[1],
+                                 sample_count, resolution, binary, output_path);
+        mp_free(parser);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Render straight to a file, without a window or a frame rate limit
+    if (output_path != NULL) {
+        if (expr_count == 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        if (!curves_set(exprs, expr_count)) {
+            for (size_t i = 0; i < expr_count; ++i) {
+                if (curves[i].entry == NULL)
+                    fprintf(stderr, "ERROR: Invalid expression '%s'\n", exprs[i]);
+            }
+            env_cache_free();
+            return EXIT_FAILURE;
+        }
+
+        // The grid sampling honours -r, the adaptive sampling has no step
+        toggle_adaptive = false;
+        headless_width = output_width;
+        headless_height = output_height;
+        scale.x = output_width / (viewport[1] - viewport[0]);
+        scale.y = output_height / (viewport[3] - viewport[2]);
+        camera.x = (viewport[0] + viewport[1]) / 2.0 * scale.x;
+        camera.y = (viewport[2] + viewport[3]) / 2.0 * scale.y;
+        grid_spacing = exp2(round(log2((viewport[1] - viewport[0]) / EXPORT_GRID_LINES)));
+
+        double step = sample_resolution(viewport[0], viewport[1]);
+        if (step != resolution) {
+            fprintf(stderr, "WARNING: Resolution %g needs more than %d samples "
+                            "for the viewport, using %g\n",
+                    resolution, CACHE_CAPACITY, step);
+        }
+
+        pool_init(&pool);
+        bool ok = export_plot(output_path);
+        pool_free(&pool);
+        fields_free();
+        curves_free();
+        env_cache_free();
 
-    if (argc <= 1) {
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (expr_count == 0) {
         toggle_input = true;
-    } else {
-        expr = argv[1];
     }
 
     /* Initialization */
@@ -112,9 +744,12 @@ int main(int argc, char **argv)
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "cplot");
     SetTargetFPS(60);
 
-    MP_Env *parser = mp_init(expr);
+    pool_init(&pool);
+    curves_set(exprs, expr_count);
 
     while (!WindowShouldClose()) {
+        profile_frame_begin();
+
         int width = GetScreenWidth();
         int height = GetScreenHeight();
         Vector2 window_size = {
@@ -124,10 +759,14 @@ int main(int argc, char **argv)
 
         /* Input */
 
-        // Give priority to the input text box
+        profile_begin(PROFILE_INPUT);
+
+        // Give priority to the input text box, then to the sliders
         if (!toggle_input) {
+            bool on_sliders = parameters_input();
+
             // Mouse drag camera movement
-            if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+            if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) && !on_sliders) {
                 Vector2 delta = GetMouseDelta();
                 delta.x *= -1.0f;
                 camera = Vector2Add(camera, delta);
@@ -143,7 +782,7 @@ int main(int argc, char **argv)
             }
 
             // Zoom
-            if (GetMouseWheelMove() > 0.0f) {
+            if (GetMouseWheelMove() > 0.0f && !on_sliders) {
                 scale.x += ZOOM_FACTOR;
                 scale.y += ZOOM_FACTOR;
 
@@ -151,7 +790,7 @@ int main(int argc, char **argv)
                 if (is_near(fmod(scale.x, 100.0), 0.0))
                     grid_spacing /= 2.0;
             }
-            if (GetMouseWheelMove() < 0.0f) {
+            if (GetMouseWheelMove() < 0.0f && !on_sliders) {
                 scale.x = max(ZOOM_MIN, scale.x - ZOOM_FACTOR);
                 scale.y = max(ZOOM_MIN, scale.y - ZOOM_FACTOR);
 
@@ -193,18 +832,39 @@ int main(int argc, char **argv)
                 toggle_continuous = !toggle_continuous;
             if (IsKeyPressed(KEY_B))
                 toggle_debug_menu = !toggle_debug_menu;
+            if (IsKeyPressed(KEY_T) && toggle_debug_menu)
+                profile_dump(PROFILE_TRACE_PATH);
             if (IsKeyPressed(KEY_G))
                 toggle_grid = !toggle_grid;
+            if (IsKeyPressed(KEY_A)) {
+                toggle_adaptive = !toggle_adaptive;
+                for (size_t i = 0; i < curve_count; ++i) {
+                    if (curves[i].entry != NULL)
+                        curves[i].entry->samples->count = 0;
+                }
+                has_panned = true;
+            }
+            if (IsKeyPressed(KEY_Z)) {
+                toggle_analysis = !toggle_analysis;
+                analysis_restart();
+            }
+            if (IsKeyPressed(KEY_I) && toggle_analysis)
+                analysis_print();
+            if (IsKeyPressed(KEY_H))
+                toggle_heatmap = !toggle_heatmap;
         }
         if (IsKeyPressed(KEY_ENTER)) {
             toggle_input = !toggle_input;
             SetMouseCursor(MOUSE_CURSOR_DEFAULT);
         }
+        parameters_animate(GetFrameTime());
+
+        profile_end(PROFILE_INPUT);
 
         /* Rendering */
 
         BeginDrawing();
-        ClearBackground(GetColor(0x181818FF));
+        ClearBackground(BACKGROUND_COLOR);
 
         // Visible range in cartesian coordinates
         double left = rpjx(0) - (double)width / 2.0;
@@ -218,6 +878,7 @@ int main(int argc, char **argv)
         bottom = floor(bottom / grid_spacing) * grid_spacing;
 
         // Grid
+        profile_begin(PROFILE_GRID);
         if (toggle_grid) {
             // Horizontal lines
             for (double y = bottom; y <= top; y += grid_spacing) {
@@ -235,8 +896,10 @@ int main(int argc, char **argv)
         // Axes
         DrawLine(0, pjy(0.0), width, pjy(0.0), AXES_COLOR); // x axis
         DrawLine(pjx(0.0), 0, pjx(0.0), height, AXES_COLOR); // y axis
+        profile_end(PROFILE_GRID);
 
         // Numbers on x axis
+        profile_begin(PROFILE_LABELS);
         for (double x = left; x <= right; x += grid_spacing) {
             int offset = 20;
             if (x < 0.0)
@@ -261,6 +924,7 @@ int main(int argc, char **argv)
             DrawText(TextFormat("%.1f", y), pjx(0.0) - offset, pjy(y), 14,
                      NUMBER_COLOR);
         }
+        profile_end(PROFILE_LABELS);
 
         // Plot functions
         // plot(linear, GREEN, resolution);
@@ -270,40 +934,89 @@ int main(int argc, char **argv)
         // plot(asymptote1, PURPLE, resolution);
         // plot(asymptote2, WHITE, resolution);
         // plot(asymptote3, YELLOW, resolution);
-        if (has_panned) {
-            cache_count = plot_parser(parser, cache, CACHE_CAPACITY, resolution);
-        }
-        for (int i = 0; i < (int)cache_count - 1; ++i) {
-            double y1 = cache[i].y;
-            double y2 = cache[i + 1].y;
+        profile_begin(PROFILE_SAMPLING);
+        if (has_panned || curves_stale())
+            plot_curves(has_panned);
+        plot_fields();
+        profile_end(PROFILE_SAMPLING);
+
+        // The meshes are drawn at the camera offset, a pan on the grid only
+        // replaces the quads at their ends
+        profile_begin(PROFILE_CURVE);
+        fields_draw();
+        size_t point_count = 0;
+        size_t vertex_count = 0;
+        for (size_t i = 0; i < curve_count; ++i) {
+            Curve *c = &curves[i];
+            if (c->rebuild)
+                curve_mesh_build(&c->mesh, c->vertices, c->vertex_count);
+            else if (c->spliced)
+                curve_mesh_splice(&c->mesh, c->vertices, c->vertex_count, c->splice);
+            c->rebuild = false;
+            c->spliced = false;
+            if (toggle_continuous)
+                curve_mesh_draw(&c->mesh, c->color);
 
-            double dy = y2 - y1;
-            double dx = resolution;
-            double slope = dy / dx;
+            for (size_t j = 0; j < c->vertex_count; ++j) {
+                Vector2 p = c->vertices[j];
 
-            if (slope <= -ASYMPTOTE_TOLERANCE * 1.0 / resolution ||
-                slope >= ASYMPTOTE_TOLERANCE * 1.0 / resolution) {
-                DrawCircleLines(pjx(cache[i].x), pjy(0.0), ASYMPTOTE_POINT_RADIUS,
-                                ASYMPTOTE_POINT_COLOR);
-                continue;
+                if (isinf(p.y)) {
+                    DrawCircleLines(pjx(p.x), pjy(0.0), ASYMPTOTE_POINT_RADIUS,
+                                    ASYMPTOTE_POINT_COLOR);
+                } else if (!toggle_continuous && !isnan(p.y)) {
+                    DrawCircleV(pjv(p.x, p.y), 2.0f, c->color);
+                }
             }
+            point_count += c->point_count;
+            vertex_count += c->vertex_count;
+        }
+        profile_end(PROFILE_CURVE);
 
-            if (toggle_continuous)
-                DrawLineEx(pjv(cache[i].x, y1), pjv(cache[i].x + resolution, y2),
-                           FUNCTION_LINE_THICKNESS, YELLOW);
-            else
-                DrawCircleV(pjv(cache[i].x, y1), 2.0f, YELLOW);
+        // Roots, extrema and intersections, found over the next frames
+        profile_begin(PROFILE_ANALYSIS);
+        if (toggle_analysis) {
+            analysis_step(ANALYSIS_BUDGET);
+            analysis_draw();
         }
+        profile_end(PROFILE_ANALYSIS);
 
+        parameters_draw();
 
-        // Debug menu
+        // Debug menu, with the profiler averaged over the last frames
         if (toggle_debug_menu) {
+            size_t frames = 0;
+            Frame_Profile total = profile_total(&frames);
+            double n = frames > 0 ? (double)frames : 1.0;
+            size_t lookups = total.cache_hits + total.cache_misses;
+
             const char *text = TextFormat(
                 "Camera: x=%f y=%f\nScale: x=%f y=%f\n"
-                "Resolution: %f\nGrid spacing: %f\nContinuous: %d\nGrid: %d",
+                "Resolution: %f\nGrid spacing: %f\nContinuous: %d\nGrid: %d\n"
+                "Adaptive: %d\nCurves: %zu\nPoints: %zu\nVertices: %zu\n"
+                "Markers: %zu%s\nTiles: %zu, %zu new\nFrame: %.2f ms\n"
+                "  Input: %.3f ms\n  Grid: %.3f ms\n  Labels: %.3f ms\n"
+                "  Sampling: %.3f ms\n  Curve: %.3f ms\n  Analysis: %.3f ms\n"
+                "Samples: %.0f/frame, %.3g/s\nCache: %.1f%% hits, %zu misses",
                 camera.x, camera.y, scale.x, scale.y,
-                resolution, grid_spacing, toggle_continuous, toggle_grid);
+                resolution, grid_spacing, toggle_continuous, toggle_grid,
+                toggle_adaptive, curve_count, point_count, vertex_count,
+                analysis.marker_count,
+                toggle_analysis && !analysis.done ? " (searching)" : "",
+                field_visible_count, tile_job_count,
+                total.frame_time * 1e3 / n,
+                total.stage_time[PROFILE_INPUT] * 1e3 / n,
+                total.stage_time[PROFILE_GRID] * 1e3 / n,
+                total.stage_time[PROFILE_LABELS] * 1e3 / n,
+                total.stage_time[PROFILE_SAMPLING] * 1e3 / n,
+                total.stage_time[PROFILE_CURVE] * 1e3 / n,
+                total.stage_time[PROFILE_ANALYSIS] * 1e3 / n,
+                total.evaluations / n,
+                total.stage_time[PROFILE_SAMPLING] > 0.0
+                    ? total.evaluations / total.stage_time[PROFILE_SAMPLING] : 0.0,
+                lookups > 0 ? 100.0 * total.cache_hits / lookups : 0.0,
+                total.cache_misses);
             DrawText(text, 10, 10, 23, DEBUG_TEXT_COLOR);
+            profile_draw(10, height - PROFILE_GRAPH_HEIGHT - 10);
         }
 
         // Mouse coordinates
@@ -312,194 +1025,3213 @@ int main(int argc, char **argv)
                  // 30, height - 30, 20, WHITE);
                  mouse.x - 60.0f, mouse.y + 20.0f, 20, WHITE);
 
-        // Handle the input text screen
-        if (toggle_input) {
-            text_box();
-            MP_Env *new_parser = mp_init(input);
-            if (new_parser == NULL) {
-                input_error = true;
-            } else {
-                input_error = false;
-                mp_free(parser);
-                parser = new_parser;
-                has_panned = true;
+        // Handle the input text screen, recompiling only when the text changed.
+        // Expressions are separated by semicolons.
+        if (toggle_input && text_box()) {
+            char text[INPUT_CAPACITY + 1];
+            const char *list[CURVE_CAPACITY];
+            size_t count = 0;
+
+            strcpy(text, input);
+            input_error = false;
+            for (char *expr = strtok(text, ";"); expr != NULL; expr = strtok(NULL, ";")) {
+                char *end = expr + strlen(expr);
+                while (*expr == ' ')
+                    ++expr;
+                while (end > expr && end[-1] == ' ')
+                    *--end = '\0';
+                if (*expr == '\0')
+                    continue;
+
+                if (count == CURVE_CAPACITY) {
+                    input_error = true;
+                    break;
+                }
+                list[count++] = expr;
             }
+
+            if (!curves_set(list, count))
+                input_error = true;
         }
 
         EndDrawing();
     }
 
-    mp_free(parser);
+    pool_free(&pool);
+    fields_free();
+    curves_free();
+    env_cache_free();
     CloseWindow();
 
     return EXIT_SUCCESS;
 }
 
-Vector2 pjv(double x, double y)
+void usage(const char *program)
 {
-    return (Vector2){pjx(x), pjy(y)};
+    fprintf(stderr, "Usage: %s [-m interpret|compile|jit] [-b file] [-p a=value...]\n"
+                    "             [expression...]\n", program);
+    fprintf(stderr, "       %s [-m interpret|compile|jit] -o file.png|file.svg\n"
+                    "             [-s WIDTHxHEIGHT] [-v x0,x1,y0,y1] [-r resolution]\n"
+                    "             [-p a=value...] expression...\n",
+            program);
+    fprintf(stderr, "       %s [-m interpret|compile|jit] -x x0,x1 [-n count | -r step]\n"
+                    "             [-f csv|bin] [-o file] [-p a=value...] expression\n",
+            program);
 }
 
-// https://www.raylib.com/examples/text/loader.html?name=text_input_box
-void text_box(void)
+// Compiles every line of a file, or of stdin if path is "-", and reports the
+// ones that fail. Lines are compiled in place, without being copied.
+int batch_compile(const char *path)
 {
-    if (!toggle_input)
-        return;
+    size_t size = 0;
+    bool mapped = false;
+    char *data = read_input(path, &size, &mapped);
+    if (data == NULL) {
+        fprintf(stderr, "ERROR: Could not read '%s': %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
 
-    static int letter_count = 0;
-    static bool mouse_on_text = false;
-    static int frames_count = 0;
+    // A number at the very end of the input would make strtod read past it,
+    // so an unterminated last line is compiled from a copy
+    char *last_line = NULL;
 
-    int w = GetScreenWidth();
-    Rectangle text_box = {
-        w/2.0f - w/3.0f, GetScreenHeight()/2.5f,
-        w/1.5f, 50 };
+    size_t line_count = 0;
+    for (const char *c = data; (c = memchr(c, '\n', data + size - c)) != NULL; ++c)
+        ++line_count;
+    if (size > 0 && data[size - 1] != '\n')
+        ++line_count;
 
-    mouse_on_text = CheckCollisionPointRec(GetMousePosition(), text_box);
+    MP_Batch_Item *items = malloc(line_count * sizeof(*items) + 1);
+    size_t *lines = malloc(line_count * sizeof(*lines) + 1);
+    if (items == NULL || lines == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate %zu expressions\n", line_count);
+        free(lines);
+        free(items);
+        free_input(data, size, mapped);
+        return EXIT_FAILURE;
+    }
 
-    if (mouse_on_text) {
-        SetMouseCursor(MOUSE_CURSOR_IBEAM);
-        int key = GetCharPressed();
+    size_t count = 0;
+    size_t line = 0;
+    for (size_t start = 0; start < size; ) {
+        const char *newline = memchr(data + start, '\n', size - start);
+        size_t end = newline != NULL ? (size_t)(newline - data) : size;
+        ++line;
 
-        while (key > 0) {
-            if ((key >= 32) && (key <= 125)
-                    && (letter_count < INPUT_CAPACITY)) {
-                input[letter_count] = (char)key;
-                input[letter_count + 1] = '\0';
-                letter_count++;
-            }
+        const char *expression = data + start;
+        size_t length = end - start;
+        if (length > 0 && expression[length - 1] == '\r')
+            --length;
 
-            key = GetCharPressed();
+        if (newline == NULL && length > 0) {
+            last_line = strndup(expression, length);
+            expression = last_line;
         }
 
-        if (IsKeyPressed(KEY_BACKSPACE)) {
-            letter_count--;
-            if (letter_count < 0) letter_count = 0;
-            input[letter_count] = '\0';
+        // Blank lines separate expressions, they are not empty expressions
+        if (length > 0) {
+            items[count] = (MP_Batch_Item){ .expression = expression, .length = length };
+            lines[count] = line;
+            ++count;
         }
-    } else {
-        SetMouseCursor(MOUSE_CURSOR_DEFAULT);
+
+        start = end + 1;
     }
 
-    if (mouse_on_text)
-        frames_count++;
-    else
-        frames_count = 0;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t job_count = cores < 1 ? 1 : (size_t)cores;
+    if (job_count > WORKER_CAPACITY)
+        job_count = WORKER_CAPACITY;
+    if (job_count > count / BATCH_MIN_ITEMS)
+        job_count = count / BATCH_MIN_ITEMS > 0 ? count / BATCH_MIN_ITEMS : 1;
 
-    // Render input box
-    DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(), GetColor(0x181818AA));
+    Batch_Job jobs[WORKER_CAPACITY] = {0};
+    size_t per_job = (count + job_count - 1) / job_count;
 
-    DrawRectangleRec(text_box, TEXT_BOX_BACKGROUND);
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
 
-    if (input_error) {
-        DrawRectangleLines((int)text_box.x, (int)text_box.y,
-                (int)text_box.width, (int)text_box.height, RED);
-    } else {
-        if (mouse_on_text)
-            DrawRectangleLines((int)text_box.x, (int)text_box.y,
-                    (int)text_box.width, (int)text_box.height, WHITE);
-        else
-            DrawRectangleLines((int)text_box.x, (int)text_box.y,
-                    (int)text_box.width, (int)text_box.height, DARKGRAY);
+    // The first slice is compiled on this thread
+    for (size_t i = 0; i < job_count; ++i) {
+        size_t first = i * per_job;
+        jobs[i].items = items + first;
+        jobs[i].count = first < count ? count - first : 0;
+        if (jobs[i].count > per_job)
+            jobs[i].count = per_job;
+
+        if (i > 0) {
+            jobs[i].started = pthread_create(&jobs[i].thread, NULL, batch_main,
+                                             &jobs[i]) == 0;
+            if (!jobs[i].started)
+                batch_main(&jobs[i]);
+        }
     }
+    batch_main(&jobs[0]);
 
-    DrawText("Input function", (int)text_box.x + 5, (int)text_box.y - 30, 30,
-            TEXT_BOX_BACKGROUND);
-    DrawText(input, (int)text_box.x + 5, (int)text_box.y + 8, 40,
-            TEXT_BOX_COLOR);
+    size_t compiled = jobs[0].compiled;
+    for (size_t i = 1; i < job_count; ++i) {
+        if (jobs[i].started)
+            pthread_join(jobs[i].thread, NULL);
+        compiled += jobs[i].compiled;
+    }
 
-    if (mouse_on_text) {
-        if (letter_count < INPUT_CAPACITY) {
-            // Draw blinking underscore char
-            if (((frames_count / 20) % 2) == 0)
-                DrawText("_", (int)text_box.x + 8 + MeasureText(input, 40),
-                        (int)text_box.y + 12, 40, TEXT_BOX_COLOR);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - begin.tv_sec)
+                   + (double)(end.tv_nsec - begin.tv_nsec) * 1e-9;
+
+    for (size_t i = 0; i < count; ++i) {
+        MP_Batch_Item *item = &items[i];
+        if (item->env != NULL)
+            continue;
+
+        if (item->result.error_type == MP_ERROR_INVALID_NODE) {
+            fprintf(stderr, "%s:%zu: ERROR: %s\n", path, lines[i],
+                    mp_error_to_string(item->result.error_type));
+        } else {
+            fprintf(stderr, "%s:%zu:%zu: ERROR: %s\n", path, lines[i],
+                    item->result.error_position + 1,
+                    mp_error_to_string(item->result.error_type));
         }
     }
+
+    printf("Compiled %zu of %zu expressions in %.3f ms on %zu threads "
+           "(%.0f expressions/sec)\n", compiled, count, seconds * 1e3,
+           job_count, seconds > 0.0 ? (double)count / seconds : 0.0);
+
+    for (size_t i = 0; i < count; ++i)
+        mp_free(items[i].env);
+    for (size_t i = 0; i < job_count; ++i)
+        mp_arena_free(&jobs[i].arena);
+
+    free(last_line);
+    free(lines);
+    free(items);
+    free_input(data, size, mapped);
+
+    return compiled == count ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-double pjx(double x)
+void *batch_main(void *arg)
 {
-    double w = GetScreenWidth();
-    x = w/2.0 + x * scale.x;
-    x -= camera.x;
-    return x;
+    Batch_Job *job = arg;
+    job->compiled = mp_init_batch(job->items, job->count, eval_mode, &job->arena);
+    return NULL;
 }
 
-double pjy(double y)
+// Maps a regular file, or reads anything else such as a pipe into memory.
+// Returns NULL with errno set on failure.
+char *read_input(const char *path, size_t *size, bool *mapped)
 {
-    double h = GetScreenHeight();
-    y = h/2.0 - y * scale.y;
-    y += camera.y;
-    return y;
+    bool is_stdin = strcmp(path, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            if (!is_stdin)
+                close(fd);
+            *size = st.st_size;
+            *mapped = true;
+            return data;
+        }
+    }
+
+    size_t capacity = 64*1024;
+    char *data = malloc(capacity);
+    *size = 0;
+
+    while (data != NULL) {
+        if (*size == capacity) {
+            capacity *= 2;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
+
+        ssize_t n = read(fd, data + *size, capacity - *size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        if (n == 0)
+            break;
+        *size += n;
+    }
+
+    if (!is_stdin)
+        close(fd);
+    *mapped = false;
+    return data;
 }
 
-Vector2 rpjv(double x, double y)
+void free_input(char *data, size_t size, bool mapped)
 {
-    return (Vector2){rpjx(x), rpjy(y)};
+    if (mapped)
+        munmap(data, size);
+    else
+        free(data);
 }
 
-double rpjx(double x)
+// Writes x, y and an asymptote flag for every sample of [x0, x1], either
+// count samples or one every step. The samples are evaluated and written
+// EXPORT_CHUNK at a time, so memory use does not depend on the range. The
+// binary format is three little-endian float64 per sample, the flag being
+// 0.0 or 1.0. A sample is flagged when both it and the next sample are
+// defined but the interval evaluation finds a discontinuity in between.
+bool export_samples(MP_Env *parser, double x0, double x1, size_t count,
+                    double step, bool binary, const char *path)
 {
-    double w = GetScreenWidth();
-    x += camera.x;
-    x += w/2.0 - w;
-    x /= scale.x;
-    return x;
+    if (count == 0) {
+        // Converting a count that does not fit in a size_t is undefined
+        double n = floor((x1 - x0) / step) + 1.0;
+        if (!(n < (double)SIZE_MAX)) {
+            fprintf(stderr, "ERROR: Too many samples in [%g, %g] with a step of %g\n",
+                    x0, x1, step);
+            return false;
+        }
+        count = (size_t)n;
+    } else {
+        step = count > 1 ? (x1 - x0) / (double)(count - 1) : 0.0;
+    }
+
+    FILE *file = path != NULL ? fopen(path, binary ? "wb" : "w") : stdout;
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Could not write '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1024*1024);
+
+    // One sample more than is written, the next chunk starts with it again
+    static double xs[EXPORT_CHUNK + 1];
+    static double ys[EXPORT_CHUNK + 1];
+    static double records[EXPORT_CHUNK][3];
+
+    if (!binary)
+        fprintf(file, "x,y,asymptote\n");
+
+    for (size_t first = 0; first < count; first += EXPORT_CHUNK) {
+        size_t n = count - first;
+        if (n > EXPORT_CHUNK)
+            n = EXPORT_CHUNK;
+        size_t evaluated = first + n < count ? n + 1 : n;
+
+        for (size_t i = 0; i < evaluated; ++i)
+            xs[i] = x0 + (double)(first + i) * step;
+
+        for (size_t offset = 0; offset < evaluated; offset += MP_BATCH_CAPACITY) {
+            size_t m = evaluated - offset;
+            if (m > MP_BATCH_CAPACITY)
+                m = MP_BATCH_CAPACITY;
+            evaluate(parser, xs + offset, ys + offset, m);
+        }
+
+        // Like plot_cache, only the blocks that may not be continuous are
+        // checked pair by pair
+        bool continuous = true;
+        for (size_t i = 0; i < n; ++i) {
+            if (i % BREAK_BLOCK == 0 && i + 1 < evaluated) {
+                size_t last = i + BREAK_BLOCK;
+                if (last >= evaluated)
+                    last = evaluated - 1;
+                continuous = evaluate_interval(parser, xs[i], xs[last]).continuous;
+            }
+
+            bool asymptote = false;
+            if (!continuous && i + 1 < evaluated && !isnan(ys[i]) && !isnan(ys[i + 1]))
+                asymptote = !evaluate_interval(parser, xs[i], xs[i + 1]).continuous;
+
+            if (binary) {
+                records[i][0] = xs[i];
+                records[i][1] = ys[i];
+                records[i][2] = asymptote ? 1.0 : 0.0;
+            } else {
+                fprintf(file, "%.17g,%.17g,%d\n", xs[i], ys[i], asymptote);
+            }
+        }
+
+        if (binary) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j < 3; ++j) {
+                    uint64_t bits;
+                    memcpy(&bits, &records[i][j], sizeof(bits));
+                    bits = __builtin_bswap64(bits);
+                    memcpy(&records[i][j], &bits, sizeof(bits));
+                }
+            }
+#endif
+            fwrite(records, sizeof(records[0]), n, file);
+        }
+
+        if (ferror(file))
+            break;
+    }
+
+    bool ok = !ferror(file);
+    if (file != stdout) {
+        if (fclose(file) != 0)
+            ok = false;
+    } else if (fflush(file) != 0) {
+        ok = false;
+    }
+
+    if (!ok)
+        fprintf(stderr, "ERROR: Could not write '%s'\n", path != NULL ? path : "stdout");
+    return ok;
 }
 
-double rpjy(double y)
+// Samples the visible range and writes the curves to a PNG or SVG file,
+// depending on the extension of path
+bool export_plot(const char *path)
 {
-    double h = GetScreenHeight();
-    y -= camera.y;
-    y += h/2.0 - h;
-    y /= scale.y;
-    return -y;
+    plot_curves(true);
+    plot_fields();
+
+    const char *extension = strrchr(path, '.');
+    if (extension != NULL && strcmp(extension, ".svg") == 0)
+        return export_svg(path);
+    if (extension != NULL && strcmp(extension, ".png") == 0)
+        return export_png(path);
+
+    fprintf(stderr, "ERROR: Unknown image format '%s', use .png or .svg\n", path);
+    return false;
 }
 
+// Grid lines inside the exported image
+void export_grid(double *left, double *right, double *bottom, double *top)
+{
+    *left = ceil(rpjx(0.0) / grid_spacing) * grid_spacing;
+    *right = floor(rpjx(screen_width()) / grid_spacing) * grid_spacing;
+    *bottom = ceil(rpjy(screen_height()) / grid_spacing) * grid_spacing;
+    *top = floor(rpjy(0.0) / grid_spacing) * grid_spacing;
+}
 
-void plot(func_t f, Color color, double resolution)
+// Rasterizes on the CPU with raylib's image functions, which need no window.
+// Text needs the default font, which only exists with a window, so the axes
+// have no numbers.
+bool export_png(const char *path)
 {
-    double x1 = rpjx(0.0);
-    double x2 = rpjx(GetScreenWidth());
+    int width = screen_width();
+    int height = screen_height();
+    Image image = GenImageColor(width, height, BACKGROUND_COLOR);
 
-    for (double x = x1; x <= x2; x += resolution) {
-        double y1 = f(x);
-        double y2 = f(x + resolution);
+    double left, right, bottom, top;
+    export_grid(&left, &right, &bottom, &top);
 
-        double dy = y2 - y1;
-        double dx = resolution;
-        double slope = dy / dx;
+    if (toggle_grid) {
+        for (double y = bottom; y <= top; y += grid_spacing)
+            ImageDrawLine(&image, 0, pjy(y), width, pjy(y), GRID_COLOR);
+        for (double x = left; x <= right; x += grid_spacing)
+            ImageDrawLine(&image, pjx(x), 0, pjx(x), height, GRID_COLOR);
+    }
 
-        if (slope <= -ASYMPTOTE_TOLERANCE * 1.0 / resolution ||
-            slope >= ASYMPTOTE_TOLERANCE * 1.0 / resolution) {
-            DrawCircleLines(pjx(x), pjy(0.0), ASYMPTOTE_POINT_RADIUS,
-                            ASYMPTOTE_POINT_COLOR);
-            continue;
+    ImageDrawLine(&image, 0, pjy(0.0), width, pjy(0.0), AXES_COLOR);
+    ImageDrawLine(&image, pjx(0.0), 0, pjx(0.0), height, AXES_COLOR);
+
+    for (size_t c = 0; c < curve_count; ++c) {
+        const Vector2 *points = curves[c].vertices;
+        size_t count = curves[c].vertex_count;
+
+        for (size_t i = 0; i < count; ++i) {
+            Vector2 p = points[i];
+
+            if (isinf(p.y)) {
+                ImageDrawCircleLines(&image, pjx(p.x), pjy(0.0),
+                                     ASYMPTOTE_POINT_RADIUS, ASYMPTOTE_POINT_COLOR);
+                continue;
+            }
+            if (isnan(p.y) || i + 1 >= count || !isfinite(points[i + 1].y))
+                continue;
+
+            Vector2 a = pjv(p.x, p.y);
+            Vector2 b = pjv(points[i + 1].x, points[i + 1].y);
+
+            // Far off screen coordinates do not fit in an int
+            a.y = fmin(fmax(a.y, -height), 2.0 * height);
+            b.y = fmin(fmax(b.y, -height), 2.0 * height);
+
+            export_line(&image, a, b, curves[c].color);
         }
+    }
 
-        if (toggle_continuous)
-            DrawLineEx(pjv(x, y1), pjv(x + resolution, y2),
-                       FUNCTION_LINE_THICKNESS, color);
-        else
-            DrawCircleV(pjv(x, y1), 2.0f, color);
+    // Contours of the fields, the heatmaps are only drawn in the window
+    for (size_t k = 0; k < field_visible_count; ++k) {
+        const Field_Tile *tile = field_visible[k];
+        Color color = curves[field_visible_curves[k]].color;
+
+        for (size_t i = 0; i + 1 < tile->segment_count; i += 2) {
+            Vector2 a = pjv(tile->segments[i].x, tile->segments[i].y);
+            Vector2 b = pjv(tile->segments[i + 1].x, tile->segments[i + 1].y);
+            export_line(&image, a, b, color);
+        }
     }
+
+    bool ok = ExportImage(image, path);
+    UnloadImage(image);
+
+    if (!ok)
+        fprintf(stderr, "ERROR: Could not write '%s'\n", path);
+    return ok;
 }
 
-size_t plot_parser(MP_Env *parser, Vector2 *buf, size_t buf_size, double resolution)
+// A line of FUNCTION_LINE_THICKNESS pixels, made of one pixel wide lines
+// offset along the normal of the segment like the quads of curve_mesh_build
+void export_line(Image *image, Vector2 a, Vector2 b, Color color)
 {
-    double x1 = rpjx(0.0);
-    double x2 = rpjx(GetScreenWidth());
+    float dx = b.x - a.x;
+    float dy = b.y - a.y;
+    float length = sqrtf(dx*dx + dy*dy);
+    if (!isfinite(length))
+        return;
 
-    size_t point_count = 0;
-    for (double x = x1; x <= x2 && point_count < buf_size; x += resolution) {
-        mp_variable(parser, 'x', x);
-        buf[point_count].x = x;
-        buf[point_count].y = mp_evaluate(parser).value;
-        ++point_count;
+    float nx = 0.0f;
+    float ny = 1.0f;
+    if (length > 0.0f) {
+        nx = -dy / length;
+        ny = dx / length;
     }
 
-    return point_count;
+    int thickness = (int)FUNCTION_LINE_THICKNESS;
+    for (int t = 0; t < thickness; ++t) {
+        float offset = t - (thickness - 1) / 2.0f;
+        ImageDrawLine(image, roundf(a.x + nx * offset), roundf(a.y + ny * offset),
+                      roundf(b.x + nx * offset), roundf(b.y + ny * offset), color);
+    }
+}
+
+bool export_svg(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Could not write '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    int width = screen_width();
+    int height = screen_height();
+    Color background = BACKGROUND_COLOR;
+    Color grid = GRID_COLOR;
+    Color axes = AXES_COLOR;
+    Color number = NUMBER_COLOR;
+    Color asymptote = ASYMPTOTE_POINT_COLOR;
+
+    fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" "
+                  "height=\"%d\" viewBox=\"0 0 %d %d\">\n",
+            width, height, width, height);
+    fprintf(file, "<rect width=\"100%%\" height=\"100%%\" fill=\"#%02x%02x%02x\"/>\n",
+            background.r, background.g, background.b);
+
+    double left, right, bottom, top;
+    export_grid(&left, &right, &bottom, &top);
+
+    if (toggle_grid) {
+        fprintf(file, "<path stroke=\"#%02x%02x%02x\" d=\"", grid.r, grid.g, grid.b);
+        for (double y = bottom; y <= top; y += grid_spacing)
+            fprintf(file, "M0 %.1fH%d", pjy(y), width);
+        for (double x = left; x <= right; x += grid_spacing)
+            fprintf(file, "M%.1f 0V%d", pjx(x), height);
+        fprintf(file, "\"/>\n");
+    }
+
+    fprintf(file, "<path stroke=\"#%02x%02x%02x\" d=\"M0 %.1fH%dM%.1f 0V%d\"/>\n",
+            axes.r, axes.g, axes.b, pjy(0.0), width, pjx(0.0), height);
+
+    fprintf(file, "<g font-family=\"sans-serif\" font-size=\"14\" fill=\"#%02x%02x%02x\">\n",
+            number.r, number.g, number.b);
+    for (double x = left; x <= right; x += grid_spacing) {
+        fprintf(file, "<text x=\"%.1f\" y=\"%.1f\">%.1f</text>\n",
+                pjx(x) - 20.0, pjy(0.0) + 17.0, is_near(x, 0.0) ? 0.0 : x);
+    }
+    for (double y = bottom; y <= top; y += grid_spacing) {
+        if (is_near(y, 0.0))
+            continue;
+        fprintf(file, "<text x=\"%.1f\" y=\"%.1f\">%.1f</text>\n",
+                pjx(0.0) - 30.0, pjy(y) + 12.0, y);
+    }
+    fprintf(file, "</g>\n");
+
+    // One path per curve, with a subpath per defined stretch of it
+    for (size_t c = 0; c < curve_count; ++c) {
+        const Vector2 *points = curves[c].vertices;
+        size_t count = curves[c].vertex_count;
+        Color function = curves[c].color;
+
+        fprintf(file, "<path fill=\"none\" stroke=\"#%02x%02x%02x\" stroke-width=\"%.1f\" d=\"",
+                function.r, function.g, function.b, FUNCTION_LINE_THICKNESS);
+        bool drawing = false;
+        for (size_t i = 0; i < count; ++i) {
+            Vector2 p = points[i];
+            if (!isfinite(p.y)) {
+                drawing = false;
+                continue;
+            }
+
+            double y = fmin(fmax(pjy(p.y), -height), 2.0 * height);
+            fprintf(file, "%c%.2f %.2f", drawing ? 'L' : 'M', pjx(p.x), y);
+            drawing = true;
+        }
+        fprintf(file, "\"/>\n");
+
+        for (size_t i = 0; i < count; ++i) {
+            if (isinf(points[i].y)) {
+                fprintf(file, "<circle cx=\"%.1f\" cy=\"%.1f\" r=\"%.1f\" fill=\"none\" "
+                              "stroke=\"#%02x%02x%02x\"/>\n",
+                        pjx(points[i].x), pjy(0.0), ASYMPTOTE_POINT_RADIUS,
+                        asymptote.r, asymptote.g, asymptote.b);
+            }
+        }
+    }
+
+    // One path per visible tile of a field
+    for (size_t k = 0; k < field_visible_count; ++k) {
+        const Field_Tile *tile = field_visible[k];
+        if (tile->segment_count == 0)
+            continue;
+
+        Color function = curves[field_visible_curves[k]].color;
+        fprintf(file, "<path fill=\"none\" stroke=\"#%02x%02x%02x\" stroke-width=\"%.1f\" d=\"",
+                function.r, function.g, function.b, FUNCTION_LINE_THICKNESS);
+        for (size_t i = 0; i + 1 < tile->segment_count; i += 2) {
+            Vector2 a = tile->segments[i];
+            Vector2 b = tile->segments[i + 1];
+            fprintf(file, "M%.2f %.2fL%.2f %.2f", pjx(a.x), pjy(a.y), pjx(b.x), pjy(b.y));
+        }
+        fprintf(file, "\"/>\n");
+    }
+
+    fprintf(file, "</svg>\n");
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "ERROR: Could not write '%s'\n", path);
+    return ok;
+}
+
+void pool_init(Pool *pool)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        cores = 1;
+    if (cores > WORKER_CAPACITY)
+        cores = WORKER_CAPACITY;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    pool->worker_count = 0;
+    for (long i = 0; i < cores; ++i) {
+        Worker *worker = &pool->workers[pool->worker_count];
+        worker->pool = pool;
+        worker->generation = pool->generation;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+            break;
+        ++pool->worker_count;
+    }
+}
+
+void pool_free(Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->worker_count; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->mutex);
+    pool->worker_count = 0;
+}
+
+void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    Pool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (true) {
+        while (!pool->quit && pool->generation == worker->generation)
+            pthread_cond_wait(&pool->work_ready, &pool->mutex);
+        if (pool->quit)
+            break;
+        worker->generation = pool->generation;
+
+        pool_work(pool, worker - pool->workers);
+
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->work_done);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// Takes chunks of the current pass until there are none left. Called with
+// the mutex held, which is released while sampling. Thread is the index of
+// the worker, or worker_count for the main thread.
+void pool_work(Pool *pool, size_t thread)
+{
+    while (pool->next_strip < strip_count) {
+        const Sample_Strip *strip = &strips[pool->next_strip];
+        size_t offset = pool->next_offset;
+
+        // Each chunk is about WORKER_MIN_SAMPLES evaluations over all curves
+        size_t count = WORKER_MIN_SAMPLES / strip->curve_count;
+        if (count < MP_BATCH_CAPACITY)
+            count = MP_BATCH_CAPACITY;
+        if (count > strip->count - offset)
+            count = strip->count - offset;
+
+        pool->next_offset += count;
+        if (pool->next_offset == strip->count) {
+            ++pool->next_strip;
+            pool->next_offset = 0;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+        sample_strip(strip, offset, count, thread);
+        pthread_mutex_lock(&pool->mutex);
+    }
+
+    while (pool->next_pass < adaptive_batch_count) {
+        const Adaptive_Pass *pass = adaptive_batch[pool->next_pass];
+        size_t offset = pool->next_offset;
+
+        size_t count = WORKER_MIN_SAMPLES;
+        if (count > pass->sample_count - offset)
+            count = pass->sample_count - offset;
+
+        pool->next_offset += count;
+        if (pool->next_offset == pass->sample_count) {
+            ++pool->next_pass;
+            pool->next_offset = 0;
+        }
+
+        Env_Entry *entry = pass->entry;
+        pthread_mutex_unlock(&pool->mutex);
+        evaluate(thread < pool->worker_count ? entry->clones[thread] : entry->env,
+                 pass->xs + offset, pass->ys + offset, count);
+        pthread_mutex_lock(&pool->mutex);
+    }
+
+    while (pool->next_tile < tile_job_count) {
+        Field_Tile *tile = tile_jobs[pool->next_tile++];
+
+        pthread_mutex_unlock(&pool->mutex);
+        field_tile_fill(tile, thread);
+        pthread_mutex_lock(&pool->mutex);
+    }
+}
+
+// Wakes up the workers for the strips, adaptive samples and tiles of the pass and works along
+// with them until the pass is over
+void pool_run(Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->next_strip = 0;
+    pool->next_pass = 0;
+    pool->next_offset = 0;
+    pool->next_tile = 0;
+    pool->pending = pool->worker_count;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->work_ready);
+
+    pool_work(pool, pool->worker_count);
+
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->work_done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Moves the sample caches of the curves to the visible range, or only the
+// caches of the stale curves unless all is set, then evaluates the missing
+// points of all of them in one pass. Sets changed[i] for every curve whose
+// points changed.
+void sample_curves(bool all, bool *changed)
+{
+    double x1 = rpjx(0.0);
+    double x2 = rpjx(screen_width());
+
+    // One extra point on each side so the curve reaches the window edges
+    double step = sample_resolution(x1, x2);
+    long long k1 = 0;
+    long long k2 = 0;
+    if (x1 <= x2) {
+        k1 = (long long)floor(x1 / step);
+        k2 = (long long)ceil(x2 / step);
+    }
+
+    strip_count = 0;
+    for (size_t i = 0; i < curve_count; ++i) {
+        Curve *curve = &curves[i];
+        if (!all && !curve->stale)
+            continue;
+
+        // A curve that switched expressions needs new vertices even when the
+        // samples of the new one are all there
+        changed[i] = curve->stale;
+        curve->stale = false;
+        if (curve->entry == NULL || curve_is_field(curve))
+            continue;
+
+        Sample_Cache *cache = curve->entry->samples;
+        if (!(x1 <= x2)) {
+            changed[i] |= cache->count > 0;
+            cache->count = 0;
+        } else if (sample_cache_move(cache, k1, k2, step, i)) {
+            changed[i] = true;
+        }
+    }
+
+    sample_strips();
+}
+
+// The grid spacing used for [x1, x2]: the resolution, doubled until the range
+// and the extra point on each side fit in a sample cache
+double sample_resolution(double x1, double x2)
+{
+    double step = resolution;
+    while ((x2 - x1) / step + 3.0 > CACHE_CAPACITY)
+        step *= 2.0;
+    return step;
+}
+
+// Evaluates the strips of the pass. Small passes are not worth waking the
+// workers, the others are split between the workers and the main thread.
+void sample_strips(void)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < strip_count; ++i)
+        total += strips[i].count * strips[i].curve_count;
+
+    bool threaded = pool.worker_count > 0 && total >= 2 * WORKER_MIN_SAMPLES;
+    for (size_t i = 0; i < strip_count && threaded; ++i) {
+        for (size_t j = 0; j < strips[i].curve_count && threaded; ++j)
+            threaded = env_entry_clone(curves[strips[i].curves[j]].entry);
+    }
+
+    if (!threaded) {
+        for (size_t i = 0; i < strip_count; ++i)
+            sample_strip(&strips[i], 0, strips[i].count, pool.worker_count);
+        return;
+    }
+
+    adaptive_batch_count = 0;
+    tile_job_count = 0;
+    pool_run(&pool);
+}
+
+// Evaluates count points of a strip, starting offset points in, for each of
+// its curves. The x values of a batch are computed once for all of them.
+void sample_strip(const Sample_Strip *strip, size_t offset, size_t count,
+                  size_t thread)
+{
+    double xs[MP_BATCH_CAPACITY];
+    double ys[MP_BATCH_CAPACITY];
+
+    for (size_t done = 0; done < count; done += MP_BATCH_CAPACITY) {
+        size_t n = count - done;
+        if (n > MP_BATCH_CAPACITY)
+            n = MP_BATCH_CAPACITY;
+
+        long long k = strip->k + (long long)(offset + done);
+        for (size_t i = 0; i < n; ++i)
+            xs[i] = (double)(k + (long long)i) * strip->resolution;
+
+        for (size_t c = 0; c < strip->curve_count; ++c) {
+            Env_Entry *entry = curves[strip->curves[c]].entry;
+            evaluate(thread < pool.worker_count ? entry->clones[thread] : entry->env,
+                     xs, ys, n);
+
+            Sample_Cache *cache = entry->samples;
+            size_t pos = (cache->head + (size_t)(k - cache->first)) % CACHE_CAPACITY;
+            for (size_t i = 0; i < n; ++i) {
+                cache->items[pos] = (Vector2){xs[i], ys[i]};
+                if (++pos == CACHE_CAPACITY)
+                    pos = 0;
+            }
+        }
+    }
+}
+
+// Adds the grid points [k, k + count) of a curve to the pass, in the strip of
+// the curves that miss the same points if there is one
+void strip_add(long long k, size_t count, double resolution, size_t curve)
+{
+    Sample_Strip *strip = NULL;
+    for (size_t i = 0; i < strip_count; ++i) {
+        if (strips[i].k == k && strips[i].count == count
+                && strips[i].resolution == resolution) {
+            strip = &strips[i];
+            break;
+        }
+    }
+
+    if (strip == NULL) {
+        strip = &strips[strip_count++];
+        strip->k = k;
+        strip->count = count;
+        strip->resolution = resolution;
+        strip->curve_count = 0;
+    }
+    strip->curves[strip->curve_count++] = curve;
+}
+
+Vector2 sample_cache_at(const Sample_Cache *cache, size_t i)
+{
+    return cache->items[(cache->head + i) % CACHE_CAPACITY];
+}
+
+Vector2 pjv(double x, double y)
+{
+    return (Vector2){pjx(x), pjy(y)};
+}
+
+// https://www.raylib.com/examples/text/loader.html?name=text_input_box
+// Returns whether the text was edited this frame
+bool text_box(void)
+{
+    if (!toggle_input)
+        return false;
+
+    bool changed = false;
+
+    static int letter_count = 0;
+    static bool mouse_on_text = false;
+    static int frames_count = 0;
+
+    int w = GetScreenWidth();
+    Rectangle text_box = {
+        w/2.0f - w/3.0f, GetScreenHeight()/2.5f,
+        w/1.5f, 50 };
+
+    mouse_on_text = CheckCollisionPointRec(GetMousePosition(), text_box);
+
+    if (mouse_on_text) {
+        SetMouseCursor(MOUSE_CURSOR_IBEAM);
+        int key = GetCharPressed();
+
+        while (key > 0) {
+            if ((key >= 32) && (key <= 125)
+                    && (letter_count < INPUT_CAPACITY)) {
+                input[letter_count] = (char)key;
+                input[letter_count + 1] = '\0';
+                letter_count++;
+                changed = true;
+            }
+
+            key = GetCharPressed();
+        }
+
+        if (IsKeyPressed(KEY_BACKSPACE) && letter_count > 0) {
+            letter_count--;
+            input[letter_count] = '\0';
+            changed = true;
+        }
+    } else {
+        SetMouseCursor(MOUSE_CURSOR_DEFAULT);
+    }
+
+    if (mouse_on_text)
+        frames_count++;
+    else
+        frames_count = 0;
+
+    // Render input box
+    DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(), GetColor(0x181818AA));
+
+    DrawRectangleRec(text_box, TEXT_BOX_BACKGROUND);
+
+    if (input_error) {
+        DrawRectangleLines((int)text_box.x, (int)text_box.y,
+                (int)text_box.width, (int)text_box.height, RED);
+    } else {
+        if (mouse_on_text)
+            DrawRectangleLines((int)text_box.x, (int)text_box.y,
+                    (int)text_box.width, (int)text_box.height, WHITE);
+        else
+            DrawRectangleLines((int)text_box.x, (int)text_box.y,
+                    (int)text_box.width, (int)text_box.height, DARKGRAY);
+    }
+
+    DrawText("Input functions, separated by ;", (int)text_box.x + 5,
+            (int)text_box.y - 30, 30, TEXT_BOX_BACKGROUND);
+
+    // Only the end of a long input fits in the box
+    const char *visible = input;
+    while (*visible != '\0' && MeasureText(visible, 40) > text_box.width - 40)
+        ++visible;
+    DrawText(visible, (int)text_box.x + 5, (int)text_box.y + 8, 40,
+            TEXT_BOX_COLOR);
+
+    if (mouse_on_text) {
+        if (letter_count < INPUT_CAPACITY) {
+            // Draw blinking underscore char
+            if (((frames_count / 20) % 2) == 0)
+                DrawText("_", (int)text_box.x + 8 + MeasureText(visible, 40),
+                        (int)text_box.y + 12, 40, TEXT_BOX_COLOR);
+        }
+    }
+
+    return changed;
+}
+
+// Looks up a compiled expression, compiling it on a miss. The least recently
+// used entry is evicted when the cache is full. Returns NULL if the
+// expression does not compile.
+Env_Entry *env_cache_get(const char *expr)
+{
+    Env_Entry *victim = NULL;
+
+    for (size_t i = 0; i < ENV_CACHE_CAPACITY; ++i) {
+        Env_Entry *entry = &env_cache[i];
+
+        if (entry->last_used != 0 && strcmp(entry->expr, expr) == 0) {
+            entry->last_used = ++env_tick;
+            return entry;
+        }
+
+        if (env_cache_in_use(entry))
+            continue;
+        if (victim == NULL || entry->last_used < victim->last_used)
+            victim = entry;
+    }
+
+    if (strlen(expr) > INPUT_CAPACITY)
+        return NULL;
+
+    MP_Env *env = mp_init_mode(expr, eval_mode);
+    if (env == NULL)
+        return NULL;
+
+    if (victim->samples == NULL) {
+        victim->samples = malloc(sizeof(*victim->samples));
+        if (victim->samples == NULL) {
+            mp_free(env);
+            return NULL;
+        }
+    }
+
+    env_entry_free(victim);
+    strcpy(victim->expr, expr);
+    victim->env = env;
+    victim->reads = mp_variables(env);
+    ++victim->version;
+    env_parameters(env);
+    victim->samples->count = 0;
+    victim->last_used = ++env_tick;
+
+    return victim;
+}
+
+// Whether a curve plots the entry, which must then stay in the cache
+bool env_cache_in_use(const Env_Entry *entry)
+{
+    for (size_t i = 0; i < CURVE_CAPACITY; ++i) {
+        if (curves[i].entry == entry)
+            return true;
+    }
+    return false;
+}
+
+// Gives every worker its own copy of the expression, since evaluation mutates
+// the variables and the VM stack. Returns false if one could not be made.
+bool env_entry_clone(Env_Entry *entry)
+{
+    for (size_t i = 0; i < pool.worker_count; ++i) {
+        if (entry->clones[i] == NULL)
+            entry->clones[i] = mp_clone(entry->env);
+        if (entry->clones[i] == NULL)
+            return false;
+    }
+    return true;
+}
+
+// Frees the expression of an entry, its samples stay allocated for reuse
+void env_entry_free(Env_Entry *entry)
+{
+    for (size_t i = 0; i < WORKER_CAPACITY; ++i) {
+        mp_free(entry->clones[i]);
+        entry->clones[i] = NULL;
+    }
+    mp_free(entry->env);
+    entry->env = NULL;
+}
+
+void env_cache_free(void)
+{
+    for (size_t i = 0; i < ENV_CACHE_CAPACITY; ++i) {
+        env_entry_free(&env_cache[i]);
+        free(env_cache[i].samples);
+        env_cache[i] = (Env_Entry){0};
+    }
+}
+
+// Writes the parameters that an expression reads into it
+void env_parameters(MP_Env *env)
+{
+    uint32_t reads = mp_variables(env);
+    for (char var = 'a'; var <= 'z'; ++var) {
+        if (var != 'x' && var != 'y' && (reads & MP_VARIABLE_BIT(var)))
+            mp_variable(env, var, parameters[var - 'a'].value);
+    }
+}
+
+void parameters_init(void)
+{
+    for (size_t i = 0; i < 26; ++i) {
+        parameters[i] = (Parameter){
+            .value = PARAMETER_VALUE_DEFAULT,
+            .range = PARAMETER_RANGE_DEFAULT,
+            .animated = false,
+            .direction = 1.0,
+        };
+    }
+}
+
+// Writes a new value of a parameter into the expressions that read it and
+// drops their samples. The curves of the other expressions keep theirs.
+void parameter_set(char var, double value)
+{
+    Parameter *parameter = &parameters[var - 'a'];
+    if (!isfinite(value) || parameter->value == value)
+        return;
+
+    parameter->value = value;
+    while (fabs(value) > parameter->range)
+        parameter->range *= 2.0;
+
+    uint32_t bit = MP_VARIABLE_BIT(var);
+    for (size_t i = 0; i < ENV_CACHE_CAPACITY; ++i) {
+        Env_Entry *entry = &env_cache[i];
+        if (entry->env == NULL || !(entry->reads & bit))
+            continue;
+
+        mp_variable(entry->env, var, value);
+        for (size_t j = 0; j < WORKER_CAPACITY; ++j)
+            mp_variable(entry->clones[j], var, value);
+        entry->samples->count = 0;
+        ++entry->version;
+    }
+
+    for (size_t i = 0; i < curve_count; ++i) {
+        if (curves[i].entry != NULL && (curves[i].entry->reads & bit))
+            curves[i].stale = true;
+    }
+}
+
+// The parameters of the curves in alphabetical order, which is the order of
+// their sliders. Returns how many there are.
+size_t parameter_list(char *vars)
+{
+    size_t count = 0;
+    for (char var = 'a'; var <= 'z'; ++var) {
+        if (parameter_mask & MP_VARIABLE_BIT(var))
+            vars[count++] = var;
+    }
+    return count;
+}
+
+// The track of the slot-th slider, in the top right corner
+Rectangle parameter_slider(size_t slot)
+{
+    return (Rectangle){
+        screen_width() - SLIDER_WIDTH - SLIDER_MARGIN,
+        SLIDER_MARGIN + SLIDER_SPACING / 2 + slot * SLIDER_SPACING,
+        SLIDER_WIDTH,
+        SLIDER_HEIGHT,
+    };
+}
+
+// Drags the sliders, starts or stops the animation of a parameter when its
+// label is clicked and narrows or widens a slider with the mouse wheel.
+// Returns whether the mouse is on the sliders, which then do not pan or zoom.
+bool parameters_input(void)
+{
+    Vector2 mouse = GetMousePosition();
+    char vars[26];
+    size_t count = parameter_list(vars);
+
+    for (size_t slot = 0; slot < count && parameter_drag != '\0'; ++slot) {
+        if (vars[slot] != parameter_drag)
+            continue;
+
+        if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+            Parameter *parameter = &parameters[vars[slot] - 'a'];
+            Rectangle track = parameter_slider(slot);
+            double x = Clamp(mouse.x, track.x, track.x + track.width);
+            parameter_set(vars[slot], map(x, track.x, track.x + track.width,
+                                          -parameter->range, parameter->range));
+            return true;
+        }
+    }
+    parameter_drag = '\0';
+
+    for (size_t slot = 0; slot < count; ++slot) {
+        Parameter *parameter = &parameters[vars[slot] - 'a'];
+        Rectangle track = parameter_slider(slot);
+        Rectangle area = {
+            track.x - SLIDER_LABEL_WIDTH,
+            track.y + track.height / 2.0f - SLIDER_SPACING / 2.0f,
+            SLIDER_LABEL_WIDTH + track.width + SLIDER_KNOB_RADIUS,
+            SLIDER_SPACING,
+        };
+        if (!CheckCollisionPointRec(mouse, area))
+            continue;
+
+        if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
+            if (mouse.x < track.x - SLIDER_KNOB_RADIUS) {
+                parameter->animated = !parameter->animated;
+            } else {
+                parameter->animated = false;
+                parameter_drag = vars[slot];
+            }
+        }
+
+        float wheel = GetMouseWheelMove();
+        if (wheel > 0.0f && fabs(parameter->value) <= parameter->range / 2.0)
+            parameter->range /= 2.0;
+        if (wheel < 0.0f)
+            parameter->range *= 2.0;
+
+        return true;
+    }
+
+    return false;
+}
+
+// Moves the animated parameters, bouncing off the ends of their sliders
+void parameters_animate(double dt)
+{
+    char vars[26];
+    size_t count = parameter_list(vars);
+
+    for (size_t i = 0; i < count; ++i) {
+        Parameter *parameter = &parameters[vars[i] - 'a'];
+        if (!parameter->animated)
+            continue;
+
+        double value = parameter->value + parameter->direction *
+                       2.0 * parameter->range * PARAMETER_SPEED * dt;
+        if (value > parameter->range) {
+            value = parameter->range;
+            parameter->direction = -1.0;
+        }
+        if (value < -parameter->range) {
+            value = -parameter->range;
+            parameter->direction = 1.0;
+        }
+        parameter_set(vars[i], value);
+    }
+}
+
+void parameters_draw(void)
+{
+    char vars[26];
+    size_t count = parameter_list(vars);
+
+    for (size_t slot = 0; slot < count; ++slot) {
+        const Parameter *parameter = &parameters[vars[slot] - 'a'];
+        Rectangle track = parameter_slider(slot);
+        Color color = parameter->animated ? SLIDER_ANIMATED_COLOR : SLIDER_COLOR;
+        double knob = map(parameter->value, -parameter->range, parameter->range,
+                          track.x, track.x + track.width);
+
+        DrawRectangleRec(track, color);
+        DrawCircleV((Vector2){knob, track.y + track.height / 2.0f},
+                    SLIDER_KNOB_RADIUS, SLIDER_KNOB_COLOR);
+        DrawText(TextFormat("%c = %.3f", vars[slot], parameter->value),
+                 track.x - SLIDER_LABEL_WIDTH, track.y - 7, 20, color);
+    }
+}
+
+// Plots the expressions, compiling only the ones that are not in the
+// expression cache. A curve that keeps its expression keeps its points, one
+// whose expression does not compile keeps the previous one. Returns false if
+// any of them did not compile.
+bool curves_set(const char **exprs, size_t count)
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < count; ++i) {
+        Curve *curve = &curves[i];
+        curve->color = curve_colors[i % (sizeof(curve_colors)/sizeof(curve_colors[0]))];
+
+        Env_Entry *entry = env_cache_get(exprs[i]);
+        if (entry == NULL) {
+            ok = false;
+            continue;
+        }
+        if (entry != curve->entry) {
+            curve->entry = entry;
+            curve->stale = true;
+        }
+    }
+
+    for (size_t i = count; i < curve_count; ++i) {
+        curves[i].entry = NULL;
+        curves[i].stale = false;
+        curves[i].point_count = 0;
+        curves[i].vertex_count = 0;
+        curves[i].rebuild = true;
+    }
+    if (curve_count != count)
+        analysis_restart();
+    curve_count = count;
+
+    parameter_mask = 0;
+    for (size_t i = 0; i < curve_count; ++i) {
+        if (curves[i].entry != NULL)
+            parameter_mask |= curves[i].entry->reads;
+    }
+    parameter_mask &= ~(MP_VARIABLE_BIT('x') | MP_VARIABLE_BIT('y'));
+
+    return ok;
+}
+
+// Whether some curve has to be sampled even if the view did not change
+bool curves_stale(void)
+{
+    for (size_t i = 0; i < curve_count; ++i) {
+        if (curves[i].stale)
+            return true;
+    }
+    return false;
+}
+
+// Whether the curve is the contour f(x, y) = 0 of a field, which is plotted
+// from tiles rather than from samples along x
+bool curve_is_field(const Curve *curve)
+{
+    return curve->entry != NULL && (curve->entry->reads & MP_VARIABLE_BIT('y'));
+}
+
+// Decimates the points of a curve into its vertices, the mesh is rebuilt
+// from them when it is next drawn
+void curve_update(Curve *curve, const Vector2 *points, size_t count)
+{
+    if (curve->vertex_capacity < count) {
+        Vector2 *vertices = realloc(curve->vertices, count * sizeof(*vertices));
+        if (vertices == NULL) {
+            count = curve->vertex_capacity;
+        } else {
+            curve->vertices = vertices;
+            curve->vertex_capacity = count;
+        }
+    }
+
+    curve->point_count = count;
+    curve->vertex_count = decimate(points, count, curve->vertices, count);
+    curve->scale = scale;
+    curve->source = NULL;
+    curve->rebuild = true;
+    analysis_restart();
+}
+
+// Moves the vertices of a curve along with its sample cache after a pan.
+// The columns that scrolled off are dropped, the ones that scrolled in are
+// decimated, and so is the column at each end that gained or lost points.
+// Returns false if the curve has to be decimated from scratch instead.
+bool curve_pan(Curve *curve)
+{
+    const Sample_Cache *cache = curve->entry->samples;
+    if (curve->source != curve->entry ||
+        curve->source_version != curve->entry->version ||
+        curve->source_resolution != cache->resolution ||
+        !Vector2Equals(curve->scale, scale) || cache->count == 0)
+        return false;
+
+    long long k1 = cache->first;
+    long long k2 = cache->first + (long long)cache->count - 1;
+    long long o1 = curve->source_first;
+    long long o2 = curve->source_first + (long long)curve->source_count - 1;
+    if (k2 < o1 || k1 > o2)
+        return false;
+
+    // The points of the first and of the last column that changed, and the
+    // vertices of all the columns up to them
+    size_t front_end = 0;
+    size_t back_begin = cache->count;
+    size_t front_removed = 0;
+    size_t back_removed = 0;
+
+    if (k1 != o1) {
+        size_t i = (size_t)((k1 > o1 ? k1 : o1) - k1);
+        double column = pixel_column(sample_cache_at(cache, i).x);
+        while (i < cache->count && pixel_column(sample_cache_at(cache, i).x) == column)
+            ++i;
+        front_end = i;
+
+        while (front_removed < curve->vertex_count &&
+               pixel_column(curve->vertices[front_removed].x) <= column)
+            ++front_removed;
+    }
+    if (k2 != o2) {
+        size_t i = (size_t)((k2 < o2 ? k2 : o2) - k1);
+        double column = pixel_column(sample_cache_at(cache, i).x);
+        while (i > 0 && pixel_column(sample_cache_at(cache, i - 1).x) == column)
+            --i;
+        back_begin = i;
+
+        size_t n = curve->vertex_count;
+        while (back_removed < n &&
+               pixel_column(curve->vertices[n - 1 - back_removed].x) >= column)
+            ++back_removed;
+    }
+    if (front_end >= back_begin ||
+        front_removed + back_removed >= curve->vertex_count)
+        return false;
+
+    MP_Env *parser = curve->entry->env;
+    size_t front_count = plot_cache(parser, cache, 0, front_end, points,
+                                    POINTS_CAPACITY);
+    size_t back_count = plot_cache(parser, cache, back_begin, cache->count,
+                                   points + front_count,
+                                   POINTS_CAPACITY - front_count);
+
+    size_t kept = curve->vertex_count - front_removed - back_removed;
+    size_t needed = front_count + kept + back_count;
+    if (curve->vertex_capacity < needed) {
+        Vector2 *vertices = realloc(curve->vertices, needed * sizeof(*vertices));
+        if (vertices == NULL)
+            return false;
+        curve->vertices = vertices;
+        curve->vertex_capacity = needed;
+    }
+
+    // The kept vertices make room for the front before they settle
+    Vector2 *v = curve->vertices;
+    memmove(v + front_count, v + front_removed, kept * sizeof(*v));
+    size_t front_added = decimate(points, front_count, v, front_count);
+    memmove(v + front_added, v + front_count, kept * sizeof(*v));
+    size_t back_added = decimate(points + front_count, back_count,
+                                 v + front_added + kept, back_count);
+    curve->vertex_count = front_added + kept + back_added;
+
+    // A break repeats the x of the point before it, and neither of them is
+    // decimated away
+    curve->point_count = cache->count;
+    for (size_t i = 1; i < curve->vertex_count; ++i) {
+        if (v[i].x == v[i - 1].x)
+            ++curve->point_count;
+    }
+
+    // Splices that pile up before the mesh is built are not merged
+    if (curve->spliced)
+        curve->rebuild = true;
+    curve->spliced = true;
+    curve->splice = (Curve_Splice){front_removed, front_added, back_removed,
+                                   back_added};
+    curve_source(curve);
+    analysis_restart();
+    return true;
+}
+
+// Records that the vertices of a curve come from the points in its sample
+// cache
+void curve_source(Curve *curve)
+{
+    const Sample_Cache *cache = curve->entry->samples;
+    curve->source = curve->entry;
+    curve->source_version = curve->entry->version;
+    curve->source_resolution = cache->resolution;
+    curve->source_first = cache->first;
+    curve->source_count = cache->count;
+}
+
+void curves_free(void)
+{
+    for (size_t i = 0; i < CURVE_CAPACITY; ++i) {
+        curve_mesh_free(&curves[i].mesh);
+        free(curves[i].vertices);
+        curves[i] = (Curve){0};
+        free(adaptive_passes[i].current);
+        free(adaptive_passes[i].next);
+        free(adaptive_passes[i].xs);
+        adaptive_passes[i] = (Adaptive_Pass){0};
+    }
+    curve_count = 0;
+}
+
+Frame_Profile *profile_current(void)
+{
+    return &profile[profile_frame % PROFILE_FRAMES];
+}
+
+// Closes the previous frame and starts recording a new one
+void profile_frame_begin(void)
+{
+    double now = GetTime();
+    Frame_Profile *frame = profile_current();
+    if (frame->begin > 0.0) {
+        frame->frame_time = now - frame->begin;
+        ++profile_frame;
+        frame = profile_current();
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    frame->begin = now;
+}
+
+void profile_begin(Profile_Stage stage)
+{
+    Frame_Profile *frame = profile_current();
+    frame->stage_begin[stage] = GetTime() - frame->begin;
+}
+
+void profile_end(Profile_Stage stage)
+{
+    Frame_Profile *frame = profile_current();
+    frame->stage_time[stage] += GetTime() - frame->begin - frame->stage_begin[stage];
+}
+
+// Sums the frames that are over, the one being recorded is left out
+Frame_Profile profile_total(size_t *frame_count)
+{
+    Frame_Profile total = {0};
+    size_t count = profile_frame < PROFILE_FRAMES ? profile_frame : PROFILE_FRAMES - 1;
+
+    for (size_t i = 1; i <= count; ++i) {
+        const Frame_Profile *frame = &profile[(profile_frame - i) % PROFILE_FRAMES];
+        total.frame_time += frame->frame_time;
+        for (size_t j = 0; j < PROFILE_STAGE_COUNT; ++j)
+            total.stage_time[j] += frame->stage_time[j];
+        total.evaluations += frame->evaluations;
+        total.cache_hits += frame->cache_hits;
+        total.cache_misses += frame->cache_misses;
+    }
+
+    *frame_count = count;
+    return total;
+}
+
+// Frame times as stacked bars, oldest on the left, with a line at 60 FPS
+void profile_draw(int x, int y)
+{
+    double pixels_per_second = PROFILE_GRAPH_HEIGHT * 30.0;
+    int width = (PROFILE_FRAMES - 1) * PROFILE_BAR_WIDTH;
+    size_t count = profile_frame < PROFILE_FRAMES ? profile_frame : PROFILE_FRAMES - 1;
+
+    DrawRectangle(x, y, width, PROFILE_GRAPH_HEIGHT, ColorAlpha(BLACK, 0.5f));
+
+    for (size_t i = 1; i <= count; ++i) {
+        const Frame_Profile *frame = &profile[(profile_frame - i) % PROFILE_FRAMES];
+        int bar_x = x + width - (int)i * PROFILE_BAR_WIDTH;
+        int bottom = y + PROFILE_GRAPH_HEIGHT;
+        double stages = 0.0;
+
+        for (size_t j = 0; j < PROFILE_STAGE_COUNT; ++j) {
+            int top = y + PROFILE_GRAPH_HEIGHT
+                      - (int)fmin((stages + frame->stage_time[j]) * pixels_per_second,
+                                  PROFILE_GRAPH_HEIGHT);
+            DrawRectangle(bar_x, top, PROFILE_BAR_WIDTH - 1, bottom - top,
+                          profile_colors[j]);
+            stages += frame->stage_time[j];
+            bottom = top;
+        }
+
+        int top = y + PROFILE_GRAPH_HEIGHT
+                  - (int)fmin(frame->frame_time * pixels_per_second, PROFILE_GRAPH_HEIGHT);
+        if (top < bottom)
+            DrawRectangle(bar_x, top, PROFILE_BAR_WIDTH - 1, bottom - top,
+                          PROFILE_IDLE_COLOR);
+    }
+
+    int budget = y + PROFILE_GRAPH_HEIGHT / 2;
+    DrawLine(x, budget, x + width, budget, DEBUG_TEXT_COLOR);
+
+    int label_x = x + width + 10;
+    for (size_t j = 0; j < PROFILE_STAGE_COUNT; ++j) {
+        DrawText(profile_names[j], label_x, y + (int)j * 16, 14, profile_colors[j]);
+    }
+    DrawText("Idle", label_x, y + PROFILE_STAGE_COUNT * 16, 14, PROFILE_IDLE_COLOR);
+}
+
+// Writes the recorded frames in the Chrome trace event format, which
+// chrome://tracing and Perfetto can open. Stages are nested in their frame.
+bool profile_dump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Could not open '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    size_t count = profile_frame < PROFILE_FRAMES ? profile_frame : PROFILE_FRAMES - 1;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = count; i >= 1; --i) {
+        size_t index = profile_frame - i;
+        const Frame_Profile *frame = &profile[index % PROFILE_FRAMES];
+        double ts = frame->begin * 1e6;
+
+        fprintf(file, "{\"name\":\"Frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%zu}},\n",
+                ts, frame->frame_time * 1e6, index);
+        for (size_t j = 0; j < PROFILE_STAGE_COUNT; ++j) {
+            if (frame->stage_time[j] <= 0.0)
+                continue;
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                          "\"ts\":%.3f,\"dur\":%.3f},\n",
+                    profile_names[j], ts + frame->stage_begin[j] * 1e6,
+                    frame->stage_time[j] * 1e6);
+        }
+        fprintf(file, "{\"name\":\"Samples\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+                      "\"args\":{\"evaluations\":%zu,\"cache hits\":%zu,"
+                      "\"cache misses\":%zu}}%s\n",
+                ts, frame->evaluations, frame->cache_hits, frame->cache_misses,
+                i > 1 ? "," : "");
+    }
+    fprintf(file, "]}\n");
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0)
+        ok = false;
+
+    if (ok)
+        printf("Wrote %zu frames to %s\n", count, path);
+    else
+        fprintf(stderr, "ERROR: Could not write '%s': %s\n", path, strerror(errno));
+
+    return ok;
+}
+
+// Forgets the markers and starts over, after the curves changed
+void analysis_restart(void)
+{
+    analysis.marker_count = 0;
+    analysis.done = false;
+    analysis.curve = 0;
+    analysis.other = 0;
+    analysis.i = 0;
+    analysis.j = 0;
+    analysis.prev_d = NAN;
+    analysis.task_first = 0;
+}
+
+// Works through the tasks for at most budget seconds, picking up where the
+// previous frame stopped
+void analysis_step(double budget)
+{
+    double deadline = GetTime() + budget;
+
+    while (!analysis.done && GetTime() < deadline) {
+        if (analysis.curve >= curve_count ||
+            analysis.marker_count == ANALYSIS_CAPACITY) {
+            analysis.done = true;
+            break;
+        }
+
+        bool finished = true;
+        if (curves[analysis.curve].entry != NULL &&
+            curves[analysis.other].entry != NULL) {
+            finished = analysis.curve == analysis.other
+                ? analysis_scan_curve(deadline)
+                : analysis_scan_pair(deadline);
+        }
+        if (!finished)
+            continue;
+
+        if (++analysis.other == curve_count) {
+            ++analysis.curve;
+            analysis.other = analysis.curve;
+        }
+        analysis.i = 0;
+        analysis.j = 0;
+        analysis.prev_d = NAN;
+        analysis.task_first = analysis.marker_count;
+    }
+}
+
+// Looks for roots between two neighbouring vertices on either side of the
+// x axis, and for extrema where the curve turns around. Returns whether the
+// scan reached the end of the curve.
+bool analysis_scan_curve(double deadline)
+{
+    const Curve *curve = &curves[analysis.curve];
+    const Vector2 *v = curve->vertices;
+
+    for (size_t k = analysis.i; k < curve->vertex_count; ++k) {
+        if (k % ANALYSIS_CHECK_EVERY == 0 && GetTime() >= deadline) {
+            analysis.i = k;
+            return false;
+        }
+        if (k < 1 || !isfinite(v[k - 1].y) || !isfinite(v[k].y))
+            continue;
+
+        if ((v[k - 1].y < 0.0 && v[k].y >= 0.0) ||
+            (v[k - 1].y > 0.0 && v[k].y <= 0.0))
+            analysis_bracket(MARKER_ROOT, v[k - 1].x, v[k].x);
+
+        if (k < 2 || !isfinite(v[k - 2].y))
+            continue;
+
+        double before = v[k - 1].y - v[k - 2].y;
+        double after = v[k].y - v[k - 1].y;
+        if (before > 0.0 && after < 0.0)
+            analysis_bracket(MARKER_MAXIMUM, v[k - 2].x, v[k].x);
+        else if (before < 0.0 && after > 0.0)
+            analysis_bracket(MARKER_MINIMUM, v[k - 2].x, v[k].x);
+    }
+
+    return true;
+}
+
+// Walks the vertices of both curves in order of x, comparing each vertex
+// with the other curve interpolated at the same x, and looks for the places
+// where they swap sides. Returns whether the walk reached the end.
+bool analysis_scan_pair(double deadline)
+{
+    const Curve *a = &curves[analysis.curve];
+    const Curve *b = &curves[analysis.other];
+
+    for (size_t step = 0; analysis.i < a->vertex_count ||
+                          analysis.j < b->vertex_count; ++step) {
+        if (step % ANALYSIS_CHECK_EVERY == 0 && GetTime() >= deadline)
+            return false;
+
+        bool from_a = analysis.j >= b->vertex_count ||
+                      (analysis.i < a->vertex_count &&
+                       a->vertices[analysis.i].x <= b->vertices[analysis.j].x);
+        double x, ya, yb;
+        if (from_a) {
+            x = a->vertices[analysis.i].x;
+            ya = a->vertices[analysis.i++].y;
+            yb = interpolate(b->vertices, b->vertex_count, analysis.j, x);
+        } else {
+            x = b->vertices[analysis.j].x;
+            ya = interpolate(a->vertices, a->vertex_count, analysis.i, x);
+            yb = b->vertices[analysis.j++].y;
+        }
+
+        double d = isfinite(ya) && isfinite(yb) ? ya - yb : NAN;
+        if (isfinite(analysis.prev_d) &&
+            ((analysis.prev_d < 0.0 && d >= 0.0) ||
+             (analysis.prev_d > 0.0 && d <= 0.0)))
+            analysis_bracket(MARKER_INTERSECTION, analysis.prev_x, x);
+
+        analysis.prev_x = x;
+        analysis.prev_d = d;
+    }
+
+    return true;
+}
+
+// Solves for the marker that the vertices suggest in [x1, x2] and adds it,
+// unless the expressions disagree or it was already found from the
+// neighbouring vertices
+void analysis_bracket(Marker_Kind kind, double x1, double x2)
+{
+    if (analysis.marker_count == ANALYSIS_CAPACITY || !(x1 < x2))
+        return;
+
+    double x = analysis_solve(kind, x1, x2);
+    if (!isfinite(x))
+        return;
+
+    MP_Env *parser = curves[analysis.curve].entry->env;
+    double slope;
+    double y = evaluate_dual(parser, x).value;
+    double residual = analysis_eval(kind, x, &slope);
+    double tolerance = ANALYSIS_TOLERANCE / scale.y;
+    if (!isfinite(y))
+        return;
+
+    // Sign changes that are jumps, not crossings
+    if ((kind == MARKER_ROOT || kind == MARKER_INTERSECTION) &&
+        !(fabs(residual) <= tolerance))
+        return;
+
+    for (size_t i = analysis.task_first; i < analysis.marker_count; ++i) {
+        const Marker *m = &analysis.markers[i];
+        if (m->kind == kind && fabs(pjx(m->x) - pjx(x)) < 0.5 &&
+            fabs(pjy(m->y) - pjy(y)) < 0.5)
+            return;
+    }
+
+    analysis.markers[analysis.marker_count++] = (Marker){
+        .kind = kind,
+        .x = x,
+        .y = kind == MARKER_ROOT ? 0.0 : y,
+        .curve = analysis.curve,
+        .other = analysis.other,
+    };
+}
+
+// Brent's method on the function of the marker, which changes sign in
+// [a, b] (see analysis_eval). Where the function has a slope, a Newton step
+// is tried instead of the interpolation, under the same safeguards: steps
+// that leave the bracket or do not shrink it fast enough are replaced by
+// bisection. Returns NAN if the function does not change sign or is not
+// defined somewhere on the way.
+double analysis_solve(Marker_Kind kind, double a, double b)
+{
+    double sa, sb, sc;
+    double fa = analysis_eval(kind, a, &sa);
+    double fb = analysis_eval(kind, b, &sb);
+    if (!isfinite(fa) || !isfinite(fb) || (fa > 0.0) == (fb > 0.0)) {
+        if (fa == 0.0) return a;
+        if (fb == 0.0) return b;
+        return NAN;
+    }
+
+    double c = a;
+    double fc = fa;
+    sc = sa;
+    double d = b - a;
+    double e = d;
+
+    for (int i = 0; i < ANALYSIS_ITERATIONS; ++i) {
+        // c is the end of the bracket on the other side of b
+        if ((fb > 0.0) == (fc > 0.0)) {
+            c = a;
+            fc = fa;
+            sc = sa;
+            d = e = b - a;
+        }
+
+        // b is the best guess so far
+        if (fabs(fc) < fabs(fb)) {
+            a = b;  fa = fb;  sa = sb;
+            b = c;  fb = fc;  sb = sc;
+            c = a;  fc = fa;  sc = sa;
+        }
+
+        double tol = 2.0 * DBL_EPSILON * fabs(b) + DBL_MIN;
+        double m = 0.5 * (c - b);
+        if (fabs(m) <= tol || fb == 0.0)
+            return b;
+
+        if (fabs(e) >= tol && fabs(fa) > fabs(fb)) {
+            // The step is -p/q before p is made positive
+            double p, q;
+            if (isfinite(sb) && sb != 0.0) {
+                p = fb;
+                q = sb;
+            } else if (a == c) {
+                double s = fb / fa;
+                p = 2.0 * m * s;
+                q = 1.0 - s;
+            } else {
+                double r = fb / fc;
+                double s = fb / fa;
+                double t = fa / fc;
+                p = s * (2.0 * m * t * (t - r) - (b - a) * (r - 1.0));
+                q = (t - 1.0) * (r - 1.0) * (s - 1.0);
+            }
+            if (p > 0.0)
+                q = -q;
+            p = fabs(p);
+
+            if (2.0 * p < fmin(3.0 * m * q - fabs(tol * q), fabs(e * q))) {
+                e = d;
+                d = p / q;
+            } else {
+                d = m;
+                e = m;
+            }
+        } else {
+            d = m;
+            e = m;
+        }
+
+        a = b;
+        fa = fb;
+        sa = sb;
+        b += fabs(d) > tol ? d : (m > 0.0 ? tol : -tol);
+        fb = analysis_eval(kind, b, &sb);
+        if (!isfinite(fb))
+            return NAN;
+    }
+
+    return b;
+}
+
+// The function whose zeros are the markers of the current task: the curve
+// for roots, its derivative for extrema and the difference of the two
+// curves for intersections. Sets slope to its derivative, or to NAN when it
+// is not known.
+double analysis_eval(Marker_Kind kind, double x, double *slope)
+{
+    MP_Dual f = evaluate_dual(curves[analysis.curve].entry->env, x);
+
+    switch (kind) {
+        case MARKER_ROOT: {
+            *slope = f.derivative;
+            return f.value;
+        } break;
+
+        case MARKER_MINIMUM:
+        case MARKER_MAXIMUM: {
+            *slope = NAN;
+            return isfinite(f.value) ? f.derivative : NAN;
+        } break;
+
+        case MARKER_INTERSECTION: {
+            MP_Dual g = evaluate_dual(curves[analysis.other].entry->env, x);
+            *slope = f.derivative - g.derivative;
+            return f.value - g.value;
+        } break;
+
+        default: {
+            *slope = NAN;
+            return NAN;
+        } break;
+    }
+}
+
+// Draws the markers, with the coordinates of the one under the mouse
+void analysis_draw(void)
+{
+    Vector2 mouse = GetMousePosition();
+    const Marker *hover = NULL;
+    double hover_distance = ANALYSIS_HOVER_DISTANCE;
+
+    for (size_t i = 0; i < analysis.marker_count; ++i) {
+        const Marker *m = &analysis.markers[i];
+        Vector2 p = pjv(m->x, m->y);
+        DrawCircleV(p, MARKER_RADIUS + 1.0f, BACKGROUND_COLOR);
+        DrawCircleV(p, MARKER_RADIUS, marker_colors[m->kind]);
+
+        double distance = Vector2Distance(p, mouse);
+        if (distance < hover_distance) {
+            hover = m;
+            hover_distance = distance;
+        }
+    }
+
+    if (hover != NULL) {
+        Vector2 p = pjv(hover->x, hover->y);
+        DrawText(TextFormat("%s (%.6g ; %.6g)", marker_names[hover->kind],
+                            hover->x, hover->y),
+                 p.x + 10.0f, p.y - 24.0f, 20, marker_colors[hover->kind]);
+    }
+}
+
+// Writes the markers found so far to stdout
+void analysis_print(void)
+{
+    printf("%zu markers%s\n", analysis.marker_count,
+           analysis.done ? "" : ", still searching");
+
+    for (size_t i = 0; i < analysis.marker_count; ++i) {
+        const Marker *m = &analysis.markers[i];
+        const char *expr = curves[m->curve].entry->expr;
+
+        if (m->kind == MARKER_INTERSECTION)
+            printf("%-12s x = %-24.17g y = %-24.17g %s and %s\n",
+                   marker_names[m->kind], m->x, m->y, expr,
+                   curves[m->other].entry->expr);
+        else
+            printf("%-12s x = %-24.17g y = %-24.17g %s\n",
+                   marker_names[m->kind], m->x, m->y, expr);
+    }
+}
+
+double pjx(double x)
+{
+    double w = screen_width();
+    x = w/2.0 + x * scale.x;
+    x -= camera.x;
+    return x;
+}
+
+double pjy(double y)
+{
+    double h = screen_height();
+    y = h/2.0 - y * scale.y;
+    y += camera.y;
+    return y;
+}
+
+Vector2 rpjv(double x, double y)
+{
+    return (Vector2){rpjx(x), rpjy(y)};
+}
+
+double rpjx(double x)
+{
+    double w = screen_width();
+    x += camera.x;
+    x += w/2.0 - w;
+    x /= scale.x;
+    return x;
+}
+
+double rpjy(double y)
+{
+    double h = screen_height();
+    y -= camera.y;
+    y += h/2.0 - h;
+    y /= scale.y;
+    return -y;
+}
+
+
+void plot(func_t f, Color color, double resolution)
+{
+    double x1 = rpjx(0.0);
+    double x2 = rpjx(GetScreenWidth());
+
+    for (double x = x1; x <= x2; x += resolution) {
+        double y1 = f(x);
+        double y2 = f(x + resolution);
+
+        double dy = y2 - y1;
+        double dx = resolution;
+        double slope = dy / dx;
+
+        if (slope <= -ASYMPTOTE_TOLERANCE * 1.0 / resolution ||
+            slope >= ASYMPTOTE_TOLERANCE * 1.0 / resolution) {
+            DrawCircleLines(pjx(x), pjy(0.0), ASYMPTOTE_POINT_RADIUS,
+                            ASYMPTOTE_POINT_COLOR);
+            continue;
+        }
+
+        if (toggle_continuous)
+            DrawLineEx(pjv(x, y1), pjv(x + resolution, y2),
+                       FUNCTION_LINE_THICKNESS, color);
+        else
+            DrawCircleV(pjv(x, y1), 2.0f, color);
+    }
+}
+
+// Brings the cache in line with the grid points [k1, k2]. Points that are
+// still visible are kept, the strips exposed by panning or zooming out are
+// added to the pass for the given curve. Returns whether the cached points
+// changed.
+bool sample_cache_move(Sample_Cache *cache, long long k1, long long k2,
+                       double resolution, size_t curve)
+{
+    if (cache->resolution != resolution) {
+        cache->resolution = resolution;
+        cache->count = 0;
+    }
+
+    // An empty cache has to be redrawn even if it stays empty
+    bool changed = cache->count == 0;
+
+    long long last = cache->first + (long long)cache->count - 1;
+
+    if (cache->count == 0 || k2 < cache->first || k1 > last) {
+        changed = true;
+        cache->head = 0;
+        cache->count = 0;
+        cache->first = k1;
+        last = k1 - 1;
+    }
+
+    // Drop the points that scrolled off
+    if (k1 > cache->first) {
+        changed = true;
+        size_t dropped = k1 - cache->first;
+        cache->head = (cache->head + dropped) % CACHE_CAPACITY;
+        cache->count -= dropped;
+        cache->first = k1;
+    }
+    if (k2 < last) {
+        changed = true;
+        cache->count -= last - k2;
+        last = k2;
+    }
+
+    // Make room for the newly exposed strips, the pass fills them in
+    Frame_Profile *frame = profile_current();
+    size_t kept = cache->count;
+    if (k1 < cache->first) {
+        changed = true;
+        size_t added = cache->first - k1;
+        cache->head = (cache->head + CACHE_CAPACITY - added) % CACHE_CAPACITY;
+        cache->first = k1;
+        cache->count += added;
+        strip_add(k1, added, resolution, curve);
+    }
+    if (k2 > last) {
+        changed = true;
+        size_t added = k2 - last;
+        cache->count += added;
+        strip_add(last + 1, added, resolution, curve);
+    }
+    frame->cache_hits += kept;
+    frame->cache_misses += cache->count - kept;
+    frame->evaluations += cache->count - kept;
+
+    return changed;
+}
+
+// Samples the curves after the view changed, or only the stale ones when
+// all is not set, and updates the vertices of the ones whose points changed.
+// On the grid, the curves are sampled together and only the strips missing
+// from their caches are evaluated. The adaptive sampler also refines all the
+// curves together.
+void plot_curves(bool all)
+{
+    if (toggle_adaptive) {
+        plot_adaptive(all);
+        return;
+    }
+
+    bool changed[CURVE_CAPACITY] = {0};
+    sample_curves(all, changed);
+
+    // The decimation depends on the scale, a pan only decimates the columns
+    // at the ends
+    for (size_t i = 0; i < curve_count; ++i) {
+        Curve *curve = &curves[i];
+        if (!changed[i] && Vector2Equals(curve->scale, scale))
+            continue;
+
+        if (curve->entry == NULL || curve_is_field(curve)) {
+            curve_update(curve, points, 0);
+            continue;
+        }
+        if (curve_pan(curve))
+            continue;
+
+        const Sample_Cache *cache = curve->entry->samples;
+        size_t count = plot_cache(curve->entry->env, cache, 0, cache->count,
+                                  points, POINTS_CAPACITY);
+        curve_update(curve, points, count);
+        curve_source(curve);
+    }
+}
+
+// Looks up the visible tiles of the fields in the tile map and evaluates the
+// missing ones, all of them in a single pass on the workers
+void plot_fields(void)
+{
+    ++field_tick;
+    field_visible_count = 0;
+    tile_job_count = 0;
+
+    double cell_x = FIELD_CELL / scale.x;
+    double cell_y = FIELD_CELL / scale.y;
+    double tile_w = FIELD_TILE_CELLS * cell_x;
+    double tile_h = FIELD_TILE_CELLS * cell_y;
+    long long tx1 = (long long)floor(rpjx(0.0) / tile_w);
+    long long tx2 = (long long)floor(rpjx(screen_width()) / tile_w);
+    long long ty1 = (long long)floor(rpjy(screen_height()) / tile_h);
+    long long ty2 = (long long)floor(rpjy(0.0) / tile_h);
+
+    // Curves of the same expression share their entry, and so their tiles,
+    // which are listed once for the first of them
+    bool listed[CURVE_CAPACITY] = {0};
+    size_t field_count = 0;
+    for (size_t c = 0; c < curve_count; ++c) {
+        if (!curve_is_field(&curves[c]))
+            continue;
+
+        listed[c] = true;
+        for (size_t d = 0; d < c && listed[c]; ++d)
+            listed[c] = !(listed[d] && curves[d].entry == curves[c].entry);
+        if (listed[c])
+            ++field_count;
+    }
+    if (field_count == 0)
+        return;
+
+    size_t tiles_per_field = (size_t)((tx2 - tx1 + 1) * (ty2 - ty1 + 1));
+    if (!fields_reserve(field_count * tiles_per_field))
+        return;
+
+    for (size_t c = 0; c < curve_count; ++c) {
+        if (!listed[c])
+            continue;
+
+        for (long long ty = ty1; ty <= ty2; ++ty) {
+            for (long long tx = tx1; tx <= tx2; ++tx) {
+                bool fresh = false;
+                Field_Tile *tile = field_tile_get(curves[c].entry, cell_x,
+                                                  cell_y, tx, ty, &fresh);
+                if (tile == NULL)
+                    continue;
+
+                field_visible[field_visible_count] = tile;
+                field_visible_curves[field_visible_count++] = c;
+                if (fresh)
+                    tile_jobs[tile_job_count++] = tile;
+            }
+        }
+    }
+
+    if (tile_job_count == 0)
+        return;
+    profile_current()->evaluations +=
+        tile_job_count * FIELD_TILE_POINTS * FIELD_TILE_POINTS;
+
+    bool threaded = pool.worker_count > 0 && tile_job_count > 1;
+    for (size_t i = 0; i < tile_job_count && threaded; ++i)
+        threaded = env_entry_clone(tile_jobs[i]->entry);
+
+    if (!threaded) {
+        for (size_t i = 0; i < tile_job_count; ++i)
+            field_tile_fill(tile_jobs[i], pool.worker_count);
+        return;
+    }
+
+    strip_count = 0;
+    adaptive_batch_count = 0;
+    pool_run(&pool);
+}
+
+// Finds a tile in the tile map. On a miss, the least recently used tile that
+// is not needed by this pass is taken over, and fresh is set since the tile
+// still has to be evaluated. Returns NULL when all tiles are in use.
+Field_Tile *field_tile_get(Env_Entry *entry, double cell_x, double cell_y,
+                           long long tx, long long ty, bool *fresh)
+{
+    size_t bucket = field_tile_hash(entry, tx, ty);
+
+    for (size_t i = field_buckets[bucket]; i != 0; i = field_tiles[i - 1].next) {
+        Field_Tile *tile = &field_tiles[i - 1];
+        if (tile->entry == entry && tile->version == entry->version
+                && tile->cell_x == cell_x && tile->cell_y == cell_y
+                && tile->tx == tx && tile->ty == ty) {
+            tile->last_used = field_tick;
+            *fresh = false;
+            return tile;
+        }
+    }
+
+    Field_Tile *victim = NULL;
+    for (size_t i = 0; i < field_tile_capacity; ++i) {
+        Field_Tile *tile = &field_tiles[i];
+        if (tile->entry == NULL) {
+            victim = tile;
+            break;
+        }
+        if (tile->last_used != field_tick
+                && (victim == NULL || tile->last_used < victim->last_used))
+            victim = tile;
+    }
+    if (victim == NULL)
+        return NULL;
+
+    // Unlink the victim from its bucket
+    if (victim->entry != NULL) {
+        size_t index = victim - field_tiles + 1;
+        size_t *link = &field_buckets[field_tile_hash(victim->entry, victim->tx,
+                                                      victim->ty)];
+        while (*link != index)
+            link = &field_tiles[*link - 1].next;
+        *link = victim->next;
+    }
+
+    victim->entry = entry;
+    victim->version = entry->version;
+    victim->cell_x = cell_x;
+    victim->cell_y = cell_y;
+    victim->tx = tx;
+    victim->ty = ty;
+    victim->last_used = field_tick;
+    victim->segment_count = 0;
+    victim->heat_ready = false;
+    victim->next = field_buckets[bucket];
+    field_buckets[bucket] = victim - field_tiles + 1;
+
+    *fresh = true;
+    return victim;
+}
+
+size_t field_tile_hash(const Env_Entry *entry, long long tx, long long ty)
+{
+    unsigned long long h = (unsigned long long)(entry - env_cache);
+    h = h * 0x9E3779B97F4A7C15ull ^ (unsigned long long)tx;
+    h = h * 0x9E3779B97F4A7C15ull ^ (unsigned long long)ty;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) % field_bucket_count;
+}
+
+// Makes room for count visible tiles plus FIELD_TILE_SPARE off screen. On
+// growth the tiles keep their index, and the buckets are rebuilt for the new
+// capacity. Returns false if the tiles or their lists can not be allocated,
+// in which case nothing changes.
+bool fields_reserve(size_t count)
+{
+    size_t capacity = count + FIELD_TILE_SPARE;
+    if (capacity < FIELD_TILE_CAPACITY)
+        capacity = FIELD_TILE_CAPACITY;
+    if (capacity <= field_tile_capacity)
+        return true;
+
+    // Everything is allocated before anything is replaced
+    Field_Tile **visible = malloc(capacity * sizeof(*visible));
+    size_t *visible_curves = malloc(capacity * sizeof(*visible_curves));
+    Field_Tile **jobs = malloc(capacity * sizeof(*jobs));
+    size_t *buckets = calloc(2 * capacity, sizeof(*buckets));
+    Field_Tile *tiles = NULL;
+    if (visible != NULL && visible_curves != NULL && jobs != NULL && buckets != NULL)
+        tiles = realloc(field_tiles, capacity * sizeof(*tiles));
+    if (tiles == NULL) {
+        free(visible);
+        free(visible_curves);
+        free(jobs);
+        free(buckets);
+        return false;
+    }
+
+    field_tiles = tiles;
+    memset(field_tiles + field_tile_capacity, 0,
+           (capacity - field_tile_capacity) * sizeof(*field_tiles));
+    field_tile_capacity = capacity;
+
+    // The lists only hold tiles of the current pass, they are rebuilt anyway
+    free(field_visible);
+    free(field_visible_curves);
+    free(tile_jobs);
+    free(field_buckets);
+    field_visible = visible;
+    field_visible_curves = visible_curves;
+    tile_jobs = jobs;
+    field_buckets = buckets;
+    field_bucket_count = 2 * capacity;
+
+    for (size_t i = 0; i < field_tile_capacity; ++i) {
+        Field_Tile *tile = &field_tiles[i];
+        if (tile->entry == NULL)
+            continue;
+
+        size_t bucket = field_tile_hash(tile->entry, tile->tx, tile->ty);
+        tile->next = field_buckets[bucket];
+        field_buckets[bucket] = i + 1;
+    }
+
+    return true;
+}
+
+// Evaluates a tile one row at a time with the batch evaluator, then traces
+// f = 0 through it. Thread is the index of the worker, or worker_count for
+// the main thread. The points are computed from their index on the whole
+// grid, so neighbouring tiles agree on the edge they share.
+void field_tile_fill(Field_Tile *tile, size_t thread)
+{
+    Env_Entry *entry = tile->entry;
+    MP_Env *parser = thread < pool.worker_count ? entry->clones[thread] : entry->env;
+    double xs[FIELD_TILE_POINTS];
+    double ys[FIELD_TILE_POINTS];
+
+    long long i0 = tile->tx * FIELD_TILE_CELLS;
+    long long j0 = tile->ty * FIELD_TILE_CELLS;
+    for (size_t i = 0; i < FIELD_TILE_POINTS; ++i)
+        xs[i] = (double)(i0 + (long long)i) * tile->cell_x;
+
+    // Most tiles are far from f = 0 and have no sign change to trace
+    bool above = false;
+    bool below = false;
+
+    for (size_t j = 0; j < FIELD_TILE_POINTS; ++j) {
+        mp_variable(parser, 'y', (double)(j0 + (long long)j) * tile->cell_y);
+        evaluate(parser, xs, ys, FIELD_TILE_POINTS);
+
+        float *row = &tile->values[j * FIELD_TILE_POINTS];
+        for (size_t i = 0; i < FIELD_TILE_POINTS; ++i) {
+            row[i] = ys[i];
+            above |= ys[i] > 0.0;
+            below |= ys[i] <= 0.0;
+        }
+    }
+
+    tile->segment_count = 0;
+    if (above && below)
+        field_tile_contour(tile, parser);
+}
+
+// Marching squares. The edges of a cell whose corners are on different
+// sides of zero are crossed by f = 0 at the linear interpolation of the
+// corners. A crossing is only kept if f is continuous along its edge, so the
+// sign changes at poles draw nothing. Each cell joins its crossings in
+// pairs, a saddle with four of them is resolved by the value at its center.
+void field_tile_contour(Field_Tile *tile, MP_Env *parser)
+{
+    // Where f crosses zero along each edge, NAN if it does not
+    static _Thread_local float across[FIELD_TILE_POINTS][FIELD_TILE_CELLS];
+    static _Thread_local float along[FIELD_TILE_CELLS][FIELD_TILE_POINTS];
+
+    const float *v = tile->values;
+    long long i0 = tile->tx * FIELD_TILE_CELLS;
+    long long j0 = tile->ty * FIELD_TILE_CELLS;
+    double cx = tile->cell_x;
+    double cy = tile->cell_y;
+
+    // Horizontal edges, at a fixed y
+    for (size_t j = 0; j < FIELD_TILE_POINTS; ++j) {
+        double y = (double)(j0 + (long long)j) * cy;
+        bool bound = false;
+
+        for (size_t i = 0; i < FIELD_TILE_CELLS; ++i) {
+            float a = v[j * FIELD_TILE_POINTS + i];
+            float b = v[j * FIELD_TILE_POINTS + i + 1];
+            across[j][i] = NAN;
+            if (isnan(a) || isnan(b) || (a > 0.0f) == (b > 0.0f))
+                continue;
+
+            double x1 = (double)(i0 + (long long)i) * cx;
+            if (!bound) {
+                mp_variable(parser, 'y', y);
+                bound = true;
+            }
+            if (!evaluate_interval(parser, x1, x1 + cx).continuous)
+                continue;
+
+            double t = isinf(a) || isinf(b) ? 0.5 : a / (a - b);
+            across[j][i] = x1 + t * cx;
+        }
+    }
+
+    // Vertical edges, at a fixed x
+    for (size_t i = 0; i < FIELD_TILE_POINTS; ++i) {
+        double x = (double)(i0 + (long long)i) * cx;
+        bool bound = false;
+
+        for (size_t j = 0; j < FIELD_TILE_CELLS; ++j) {
+            float a = v[j * FIELD_TILE_POINTS + i];
+            float b = v[(j + 1) * FIELD_TILE_POINTS + i];
+            along[j][i] = NAN;
+            if (isnan(a) || isnan(b) || (a > 0.0f) == (b > 0.0f))
+                continue;
+
+            double y1 = (double)(j0 + (long long)j) * cy;
+            if (!bound) {
+                mp_variable(parser, 'x', x);
+                bound = true;
+            }
+            MP_Interval bound_y;
+            MP_Result result = mp_evaluate_interval(parser, 'y', y1, y1 + cy,
+                                                    &bound_y);
+            if (!result.error && !bound_y.continuous)
+                continue;
+
+            double t = isinf(a) || isinf(b) ? 0.5 : a / (a - b);
+            along[j][i] = y1 + t * cy;
+        }
+    }
+
+    tile->segment_count = 0;
+    for (size_t j = 0; j < FIELD_TILE_CELLS; ++j) {
+        double y1 = (double)(j0 + (long long)j) * cy;
+
+        for (size_t i = 0; i < FIELD_TILE_CELLS; ++i) {
+            // Bottom, right, top and left edges
+            bool crossed[4] = {
+                !isnan(across[j][i]), !isnan(along[j][i + 1]),
+                !isnan(across[j + 1][i]), !isnan(along[j][i]),
+            };
+            size_t count = crossed[0] + crossed[1] + crossed[2] + crossed[3];
+            if (count < 2)
+                continue;
+
+            double x1 = (double)(i0 + (long long)i) * cx;
+            Vector2 p[4];
+            p[0] = (Vector2){across[j][i], y1};
+            p[1] = (Vector2){x1 + cx, along[j][i + 1]};
+            p[2] = (Vector2){across[j + 1][i], y1 + cy};
+            p[3] = (Vector2){x1, along[j][i]};
+
+            if (count == 2) {
+                Vector2 ends[2];
+                size_t n = 0;
+                for (size_t e = 0; e < 4; ++e) {
+                    if (crossed[e])
+                        ends[n++] = p[e];
+                }
+                field_tile_segment(tile, ends[0], ends[1]);
+            } else if (count == 4) {
+                float c0 = v[j * FIELD_TILE_POINTS + i];
+                float c1 = v[j * FIELD_TILE_POINTS + i + 1];
+                float c2 = v[(j + 1) * FIELD_TILE_POINTS + i + 1];
+                float c3 = v[(j + 1) * FIELD_TILE_POINTS + i];
+                float center = (c0 + c1 + c2 + c3) / 4.0f;
+
+                // The corners on the side of the center are joined through it
+                if ((center > 0.0f) == (c0 > 0.0f)) {
+                    field_tile_segment(tile, p[0], p[1]);
+                    field_tile_segment(tile, p[2], p[3]);
+                } else {
+                    field_tile_segment(tile, p[3], p[0]);
+                    field_tile_segment(tile, p[1], p[2]);
+                }
+            }
+        }
+    }
+}
+
+void field_tile_segment(Field_Tile *tile, Vector2 a, Vector2 b)
+{
+    if (tile->segment_count + 2 > tile->segment_capacity) {
+        size_t capacity = tile->segment_capacity == 0 ? 256 : 2 * tile->segment_capacity;
+        Vector2 *segments = realloc(tile->segments, capacity * sizeof(*segments));
+        if (segments == NULL)
+            return;
+        tile->segments = segments;
+        tile->segment_capacity = capacity;
+    }
+
+    tile->segments[tile->segment_count++] = a;
+    tile->segments[tile->segment_count++] = b;
+}
+
+// Draws the visible tiles of the fields, their heatmaps first if they are
+// on. The texture of a tile is only updated after the tile was evaluated.
+void fields_draw(void)
+{
+    static Color pixels[FIELD_TILE_CELLS * FIELD_TILE_CELLS];
+
+    for (size_t k = 0; k < field_visible_count && toggle_heatmap; ++k) {
+        Field_Tile *tile = field_visible[k];
+
+        if (!tile->heat_ready) {
+            const float *v = tile->values;
+            for (size_t j = 0; j < FIELD_TILE_CELLS; ++j) {
+                // Texture rows go down the screen, tile rows go up
+                Color *row = &pixels[(FIELD_TILE_CELLS - 1 - j) * FIELD_TILE_CELLS];
+                for (size_t i = 0; i < FIELD_TILE_CELLS; ++i) {
+                    double center = (v[j * FIELD_TILE_POINTS + i]
+                                     + v[j * FIELD_TILE_POINTS + i + 1]
+                                     + v[(j + 1) * FIELD_TILE_POINTS + i]
+                                     + v[(j + 1) * FIELD_TILE_POINTS + i + 1]) / 4.0;
+                    row[i] = heat_color(center);
+                }
+            }
+
+            if (!tile->has_texture) {
+                Image image = {
+                    .data = pixels,
+                    .width = FIELD_TILE_CELLS,
+                    .height = FIELD_TILE_CELLS,
+                    .mipmaps = 1,
+                    .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+                };
+                tile->texture = LoadTextureFromImage(image);
+                SetTextureFilter(tile->texture, TEXTURE_FILTER_BILINEAR);
+                tile->has_texture = true;
+            } else {
+                UpdateTexture(tile->texture, pixels);
+            }
+            tile->heat_ready = true;
+        }
+
+        double x1 = tile->tx * FIELD_TILE_CELLS * tile->cell_x;
+        double y1 = tile->ty * FIELD_TILE_CELLS * tile->cell_y;
+        double x2 = x1 + FIELD_TILE_CELLS * tile->cell_x;
+        double y2 = y1 + FIELD_TILE_CELLS * tile->cell_y;
+        Rectangle source = {0, 0, FIELD_TILE_CELLS, FIELD_TILE_CELLS};
+        Rectangle dest = {pjx(x1), pjy(y2), pjx(x2) - pjx(x1), pjy(y1) - pjy(y2)};
+        DrawTexturePro(tile->texture, source, dest, (Vector2){0}, 0.0f,
+                       ColorAlpha(WHITE, HEAT_ALPHA));
+    }
+
+    for (size_t k = 0; k < field_visible_count; ++k) {
+        const Field_Tile *tile = field_visible[k];
+        Color color = curves[field_visible_curves[k]].color;
+
+        for (size_t i = 0; i + 1 < tile->segment_count; i += 2) {
+            Vector2 a = tile->segments[i];
+            Vector2 b = tile->segments[i + 1];
+            DrawLineEx(pjv(a.x, a.y), pjv(b.x, b.y), FUNCTION_LINE_THICKNESS, color);
+        }
+    }
+}
+
+// Blue below zero and red above, stronger the further the value is from
+// zero. The scale is fixed rather than fitted to the view, so the tiles do
+// not have to be colored again when the view changes.
+Color heat_color(double value)
+{
+    if (isnan(value))
+        return BLANK;
+
+    double t = atan(value / FIELD_HEAT_SCALE) / (PI / 2.0);
+    Color from = BACKGROUND_COLOR;
+    Color to = t < 0.0 ? HEAT_NEGATIVE_COLOR : HEAT_POSITIVE_COLOR;
+    t = fabs(t);
+
+    return (Color){
+        from.r + (to.r - from.r) * t,
+        from.g + (to.g - from.g) * t,
+        from.b + (to.b - from.b) * t,
+        255,
+    };
+}
+
+void fields_free(void)
+{
+    for (size_t i = 0; i < field_tile_capacity; ++i) {
+        free(field_tiles[i].segments);
+        if (field_tiles[i].has_texture)
+            UnloadTexture(field_tiles[i].texture);
+    }
+    free(field_tiles);
+    free(field_buckets);
+    free(field_visible);
+    free(field_visible_curves);
+    free(tile_jobs);
+    field_tiles = NULL;
+    field_tile_capacity = 0;
+    field_buckets = NULL;
+    field_bucket_count = 0;
+    field_visible = NULL;
+    field_visible_curves = NULL;
+    tile_jobs = NULL;
+    field_visible_count = 0;
+    tile_job_count = 0;
+}
+
+// Copies the cached grid samples [from, to), each with a break after it if a
+// discontinuity separates it from the next one. The blocks of BREAK_BLOCK
+// grid points are bounded together first, and only the blocks that may not
+// be continuous are checked pair by pair.
+size_t plot_cache(MP_Env *parser, const Sample_Cache *cache, size_t from,
+                  size_t to, Vector2 *buf, size_t buf_size)
+{
+    size_t count = 0;
+    bool continuous = true;
+
+    for (size_t i = from; i < to && count < buf_size; ++i) {
+        Vector2 p1 = sample_cache_at(cache, i);
+        buf[count++] = p1;
+
+        if (i + 1 == cache->count || count == buf_size)
+            break;
+
+        // Aligned on the grid, so that the blocks do not move with the cache
+        long long k = cache->first + (long long)i;
+        long long offset = (k % BREAK_BLOCK + BREAK_BLOCK) % BREAK_BLOCK;
+        if (i == from || offset == 0) {
+            size_t last = i + (size_t)(BREAK_BLOCK - offset);
+            if (last >= cache->count)
+                last = cache->count - 1;
+            double x2 = sample_cache_at(cache, last).x;
+            continuous = evaluate_interval(parser, p1.x, x2).continuous;
+        }
+        if (continuous)
+            continue;
+
+        Vector2 p2 = sample_cache_at(cache, i + 1);
+        if (is_break(parser, p1, p2))
+            buf[count++] = (Vector2){p1.x, INFINITY};
+    }
+
+    return count;
+}
+
+// Samples the visible range every ADAPTIVE_INITIAL_SPACING pixels, then keeps
+// halving the intervals whose midpoint is off the straight segment by more
+// than ADAPTIVE_TOLERANCE pixels. The intervals are refined one level at a
+// time, so the budget of each curve is spent on its coarsest errors first.
+// The curves are refined together: the midpoints of a level are evaluated
+// for all of them in a single pass on the workers.
+//
+// Every interval also has bounds from the interval evaluation, which find the
+// poles the samples step over. The bounds of an interval hold for its halves,
+// so they are only computed again where they do not settle things: where the
+// curve may be discontinuous or cross the top or bottom of the window.
+void plot_adaptive(bool all)
+{
+    double width = screen_width();
+    double x1 = rpjx(0.0);
+    double x2 = rpjx(width);
+    double min_dx = ADAPTIVE_MIN_SPACING / scale.x;
+
+    size_t n = (size_t)ceil(width / ADAPTIVE_INITIAL_SPACING) + 1;
+    if (n < 2)
+        n = 2;
+    if (n > ADAPTIVE_BUDGET / 4)
+        n = ADAPTIVE_BUDGET / 4;
+
+    Adaptive_Pass *run[CURVE_CAPACITY];
+    size_t run_count = 0;
+
+    for (size_t i = 0; i < curve_count; ++i) {
+        Curve *curve = &curves[i];
+        if (!all && !curve->stale)
+            continue;
+
+        curve->stale = false;
+        Adaptive_Pass *pass = &adaptive_passes[i];
+        if (curve->entry == NULL || curve_is_field(curve) || !adaptive_pass_init(pass)) {
+            curve_update(curve, points, 0);
+            continue;
+        }
+
+        pass->entry = curve->entry;
+        pass->curve = i;
+        for (size_t j = 0; j < n; ++j)
+            pass->xs[j] = x1 + (x2 - x1) * (double)j / (double)(n - 1);
+        pass->sample_count = n;
+        run[run_count++] = pass;
+    }
+    if (run_count == 0)
+        return;
+
+    memcpy(adaptive_batch, run, run_count * sizeof(*run));
+    adaptive_batch_count = run_count;
+    adaptive_evaluate();
+
+    for (size_t r = 0; r < run_count; ++r) {
+        Adaptive_Pass *pass = run[r];
+        for (size_t i = 0; i < n; ++i) {
+            pass->current[i].x = pass->xs[i];
+            pass->current[i].y = pass->ys[i];
+            pass->current[i].state = i + 1 < n ? INTERVAL_REFINE : INTERVAL_DONE;
+        }
+        adaptive_bound(pass->entry->env, pass->current, 0, n - 1);
+        pass->count = n;
+        pass->evaluations = n;
+    }
+
+    while (true) {
+        adaptive_batch_count = 0;
+        for (size_t r = 0; r < run_count; ++r) {
+            if (adaptive_midpoints(run[r]) > 0)
+                adaptive_batch[adaptive_batch_count++] = run[r];
+        }
+        if (adaptive_batch_count == 0)
+            break;
+
+        adaptive_evaluate();
+        for (size_t r = 0; r < adaptive_batch_count; ++r)
+            adaptive_refine(adaptive_batch[r], min_dx);
+    }
+
+    for (size_t r = 0; r < run_count; ++r) {
+        const Adaptive_Pass *pass = run[r];
+        const Adaptive_Point *current = pass->current;
+
+        size_t count = 0;
+        for (size_t i = 0; i < pass->count && count < POINTS_CAPACITY; ++i) {
+            points[count++] = (Vector2){current[i].x, current[i].y};
+
+            if (current[i].state == INTERVAL_BREAK && count < POINTS_CAPACITY) {
+                double x = (current[i].x + current[i + 1].x) / 2.0;
+                points[count++] = (Vector2){x, INFINITY};
+            }
+        }
+        profile_current()->evaluations += pass->evaluations;
+
+        curve_update(&curves[pass->curve], points, count);
+    }
+}
+
+// Allocates the points and samples of a pass on its first use
+bool adaptive_pass_init(Adaptive_Pass *pass)
+{
+    if (pass->current != NULL)
+        return true;
+
+    pass->current = malloc(ADAPTIVE_BUDGET * sizeof(*pass->current));
+    pass->next = malloc(ADAPTIVE_BUDGET * sizeof(*pass->next));
+    pass->xs = malloc(2 * ADAPTIVE_BUDGET * sizeof(*pass->xs));
+    if (pass->current == NULL || pass->next == NULL || pass->xs == NULL) {
+        free(pass->current);
+        free(pass->next);
+        free(pass->xs);
+        *pass = (Adaptive_Pass){0};
+        return false;
+    }
+
+    pass->ys = pass->xs + ADAPTIVE_BUDGET;
+    return true;
+}
+
+// Puts the midpoints of the intervals left to refine in the samples of the
+// pass, as far as the budget goes. Returns how many there are.
+size_t adaptive_midpoints(Adaptive_Pass *pass)
+{
+    Adaptive_Point *current = pass->current;
+    size_t m = 0;
+
+    for (size_t i = 0; i + 1 < pass->count; ++i) {
+        if (current[i].state != INTERVAL_REFINE)
+            continue;
+
+        if (pass->evaluations + m < ADAPTIVE_BUDGET)
+            pass->xs[m++] = (current[i].x + current[i + 1].x) / 2.0;
+        else
+            current[i].state = INTERVAL_DONE;
+    }
+
+    pass->sample_count = m;
+    return m;
+}
+
+// Evaluates the samples of the passes in adaptive_batch. Like the strips of
+// the grid, small levels are not worth waking the workers.
+void adaptive_evaluate(void)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < adaptive_batch_count; ++i)
+        total += adaptive_batch[i]->sample_count;
+
+    bool threaded = pool.worker_count > 0 && total >= 2 * WORKER_MIN_SAMPLES;
+    for (size_t i = 0; i < adaptive_batch_count && threaded; ++i)
+        threaded = env_entry_clone(adaptive_batch[i]->entry);
+
+    if (!threaded) {
+        for (size_t i = 0; i < adaptive_batch_count; ++i) {
+            Adaptive_Pass *pass = adaptive_batch[i];
+            evaluate(pass->entry->env, pass->xs, pass->ys, pass->sample_count);
+        }
+        return;
+    }
+
+    strip_count = 0;
+    tile_job_count = 0;
+    pool_run(&pool);
+}
+
+// Splits the intervals of a pass at their evaluated midpoints and decides,
+// for both halves, whether they need another level
+void adaptive_refine(Adaptive_Pass *pass, double min_dx)
+{
+    MP_Env *parser = pass->entry->env;
+    Adaptive_Point *current = pass->current;
+    Adaptive_Point *next = pass->next;
+    double height = screen_height();
+
+    size_t count = 0;
+    size_t j = 0;
+
+    for (size_t i = 0; i < pass->count; ++i) {
+        next[count++] = current[i];
+        if (current[i].state != INTERVAL_REFINE)
+            continue;
+
+        Adaptive_Point a = current[i];
+        Adaptive_Point b = current[i + 1];
+        Adaptive_Point mid = {pass->xs[j], pass->ys[j], INTERVAL_DONE, a.bound};
+        ++j;
+
+        Interval_State state = adaptive_test(a, mid, b, min_dx);
+
+        // The halves get their own bounds where the ones of the whole do not
+        // settle anything: to find the half with the pole or the end of the
+        // domain, or the half that is off the window, which it can only be
+        // if one of its samples is
+        bool exact = a.bound.continuous && a.bound.defined;
+        bool inside = pjy(a.bound.hi) >= 0.0 && pjy(a.bound.lo) <= height;
+        bool shown_a = pjy(a.y) >= 0.0 && pjy(a.y) <= height;
+        bool shown_m = pjy(mid.y) >= 0.0 && pjy(mid.y) <= height;
+        bool shown_b = pjy(b.y) >= 0.0 && pjy(b.y) <= height;
+        if (state != INTERVAL_DONE) {
+            if (!exact || (!inside && !(shown_a && shown_m)))
+                next[count - 1].bound = evaluate_interval(parser, a.x, mid.x);
+            if (!exact || (!inside && !(shown_m && shown_b)))
+                mid.bound = evaluate_interval(parser, mid.x, b.x);
+        }
+
+        if (state == INTERVAL_BREAK) {
+            // Only the half with the discontinuity gets the break, or the
+            // one with the larger jump if the bounds cannot tell
+            bool left = fabs(pjy(mid.y) - pjy(a.y)) > fabs(pjy(b.y) - pjy(mid.y));
+            if (next[count - 1].bound.continuous != mid.bound.continuous)
+                left = !next[count - 1].bound.continuous;
+            next[count - 1].state = left ? INTERVAL_BREAK : INTERVAL_DONE;
+            mid.state = left ? INTERVAL_DONE : INTERVAL_BREAK;
+        } else {
+            next[count - 1].state = state;
+            mid.state = state;
+        }
+        next[count++] = mid;
+    }
+
+    pass->next = current;
+    pass->current = next;
+    pass->count = count;
+    pass->evaluations += pass->sample_count;
+}
+
+// The pixel column of x at the current scale. The columns are fixed in world
+// space, so they do not move with the camera.
+double pixel_column(double x)
+{
+    return floor(x * scale.x);
+}
+
+// Collapses the points that fall in the same pixel column into the first,
+// lowest, highest and last of them, kept in their original order. The
+// polyline through them covers the same pixels with at most 4 vertices per
+// column. Breaks (non-finite points) are kept and end the column.
+size_t decimate(const Vector2 *points, size_t count, Vector2 *buf, size_t buf_size)
+{
+    size_t out = 0;
+    size_t i = 0;
+
+    while (i < count && out < buf_size) {
+        if (!isfinite(points[i].y)) {
+            buf[out++] = points[i++];
+            continue;
+        }
+
+        double column = pixel_column(points[i].x);
+        size_t keep[4] = {i, i, i, i}; // first, lowest, highest, last
+
+        for (++i; i < count && isfinite(points[i].y); ++i) {
+            if (pixel_column(points[i].x) != column)
+                break;
+
+            if (points[i].y < points[keep[1]].y) keep[1] = i;
+            if (points[i].y > points[keep[2]].y) keep[2] = i;
+            keep[3] = i;
+        }
+
+        // Lowest and highest can come in either order
+        if (keep[1] > keep[2]) {
+            size_t tmp = keep[1];
+            keep[1] = keep[2];
+            keep[2] = tmp;
+        }
+
+        for (size_t j = 0; j < 4 && out < buf_size; ++j) {
+            if (j > 0 && keep[j] == keep[j - 1])
+                continue;
+            buf[out++] = points[keep[j]];
+        }
+    }
+
+    return out;
+}
+
+// Allocates the vertex buffer once, for two triangles per point. The slots
+// start out as empty quads.
+void curve_mesh_init(Curve_Mesh *curve, size_t point_capacity)
+{
+    curve->capacity = (int)point_capacity * 6;
+    curve->mesh = (Mesh){0};
+    curve->mesh.vertexCount = curve->capacity;
+    curve->mesh.triangleCount = curve->capacity / 3;
+    curve->mesh.vertices = MemAlloc(curve->capacity * 3 * sizeof(float));
+    memset(curve->mesh.vertices, 0, curve->capacity * 3 * sizeof(float));
+    UploadMesh(&curve->mesh, true);
+    curve->mesh.vertexCount = 0;
+    curve->mesh.triangleCount = 0;
+
+    curve->material = LoadMaterialDefault();
+    curve->head = 0;
+    curve->scale = (Vector2){0};
+}
+
+// Tessellates the polyline into a quad of FUNCTION_LINE_THICKNESS pixels per
+// segment, with empty ones for the segments that touch a break, and uploads
+// it. The vertex buffer is made on the first build and grows with the curve,
+// to twice its size so a pan finds free slots at the ends.
+void curve_mesh_build(Curve_Mesh *curve, const Vector2 *points, size_t count)
+{
+    if ((size_t)curve->capacity < count * 6) {
+        size_t capacity = (size_t)curve->capacity / 6 * 2;
+        if (capacity < 2 * count)
+            capacity = 2 * count;
+
+        curve_mesh_free(curve);
+        curve_mesh_init(curve, capacity);
+    }
+
+    size_t slots = (size_t)curve->capacity / 6;
+    curve->head = 0;
+    for (size_t i = 0; i < slots; ++i)
+        curve_mesh_quad(curve, points, count, (long long)i);
+
+    // The whole ring is drawn, the empty quads cover no pixels
+    curve->mesh.vertexCount = count > 1 ? curve->capacity : 0;
+    curve->mesh.triangleCount = curve->mesh.vertexCount / 3;
+    curve->scale = scale;
+    curve_mesh_upload(curve, 0, (long long)slots);
+}
+
+// Replaces the quads at the ends of the ring after the vertices changed as
+// told by splice, and uploads only them. The quads of the kept segments stay
+// in their slots and the ring turns so the first segment is at its head.
+void curve_mesh_splice(Curve_Mesh *curve, const Vector2 *points, size_t count,
+                       Curve_Splice splice)
+{
+    long long n = (long long)count;
+    long long front_added = (long long)splice.front_added;
+    long long front_removed = (long long)splice.front_removed;
+    long long back_added = (long long)splice.back_added;
+    long long back_removed = (long long)splice.back_removed;
+
+    // Segments by their index in the new polyline. The removed ones at the
+    // front come before the first, the ones at the back after the last.
+    long long front_first = front_added - front_removed;
+    long long front_last = front_added;
+    long long back_first = n - back_added - 1;
+    long long back_last = back_first + back_removed;
+    if (front_first > 0)
+        front_first = 0;
+    if (back_last < n - 1)
+        back_last = n - 1;
+
+    long long slots = curve->capacity / 6;
+    if (!Vector2Equals(curve->scale, scale) || slots == 0 || n > slots ||
+        back_last - front_first > slots) {
+        curve_mesh_build(curve, points, count);
+        return;
+    }
+
+    long long shift = front_removed - front_added;
+    curve->head = (size_t)((((long long)curve->head + shift) % slots + slots) % slots);
+
+    for (long long i = front_first; i < front_last; ++i)
+        curve_mesh_quad(curve, points, count, i);
+    if (back_added > 0 || back_removed > 0) {
+        for (long long i = back_first; i < back_last; ++i)
+            curve_mesh_quad(curve, points, count, i);
+    }
+
+    curve->mesh.vertexCount = count > 1 ? curve->capacity : 0;
+    curve->mesh.triangleCount = curve->mesh.vertexCount / 3;
+    curve_mesh_upload(curve, front_first, front_last);
+    if (back_added > 0 || back_removed > 0)
+        curve_mesh_upload(curve, back_first, back_last);
+}
+
+// Writes the quad of the segment from points[i] to points[i + 1] to its slot
+// in the ring. A segment that touches a break, or that is not part of the
+// polyline, gets an empty quad.
+void curve_mesh_quad(Curve_Mesh *curve, const Vector2 *points, size_t count,
+                     long long i)
+{
+    long long slots = curve->capacity / 6;
+    long long slot = (((long long)curve->head + i) % slots + slots) % slots;
+    float *v = curve->mesh.vertices + slot * 18;
+    memset(v, 0, 18 * sizeof(float));
+
+    if (i < 0 || i + 1 >= (long long)count ||
+        !isfinite(points[i].y) || !isfinite(points[i + 1].y))
+        return;
+
+    float half = FUNCTION_LINE_THICKNESS / 2.0f;
+    float ax = points[i].x * scale.x;
+    float ay = -points[i].y * scale.y;
+    float bx = points[i + 1].x * scale.x;
+    float by = -points[i + 1].y * scale.y;
+
+    float dx = bx - ax;
+    float dy = by - ay;
+    float length = sqrtf(dx*dx + dy*dy);
+    if (!isfinite(length) || length == 0.0f)
+        return;
+
+    float nx = -dy / length * half;
+    float ny = dx / length * half;
+
+    float quad[6][2] = {
+        {ax + nx, ay + ny}, {ax - nx, ay - ny}, {bx + nx, by + ny},
+        {bx + nx, by + ny}, {ax - nx, ay - ny}, {bx - nx, by - ny},
+    };
+    for (int j = 0; j < 6; ++j) {
+        v[j*3 + 0] = quad[j][0];
+        v[j*3 + 1] = quad[j][1];
+    }
+}
+
+// Uploads the slots of the segments [first, last), in two parts if they wrap
+// around the end of the ring
+void curve_mesh_upload(Curve_Mesh *curve, long long first, long long last)
+{
+    long long slots = curve->capacity / 6;
+    if (last <= first || slots == 0)
+        return;
+
+    int stride = 18 * sizeof(float);
+    long long slot = (((long long)curve->head + first) % slots + slots) % slots;
+    long long count = last - first;
+    while (count > 0) {
+        long long n = slots - slot < count ? slots - slot : count;
+        UpdateMeshBuffer(curve->mesh, 0, curve->mesh.vertices + slot * 18,
+                         (int)n * stride, (int)slot * stride);
+        count -= n;
+        slot = 0;
+    }
+}
+
+// Draws the whole curve with one call, translated to the current camera
+void curve_mesh_draw(Curve_Mesh *curve, Color color)
+{
+    if (curve->mesh.vertexCount == 0)
+        return;
+
+    // The immediate mode batch is drawn at the end of the frame, flush it so
+    // the grid stays below the curve. The winding depends on the direction
+    // of each segment, so both faces have to be drawn.
+    rlDrawRenderBatchActive();
+    rlDisableBackfaceCulling();
+
+    curve->material.maps[MATERIAL_MAP_DIFFUSE].color = color;
+    Matrix transform = MatrixTranslate(GetScreenWidth()/2.0f - camera.x,
+                                       GetScreenHeight()/2.0f + camera.y,
+                                       -0.5f);
+    DrawMesh(curve->mesh, curve->material, transform);
+
+    rlEnableBackfaceCulling();
+}
+
+void curve_mesh_free(Curve_Mesh *curve)
+{
+    if (curve->capacity == 0)
+        return;
+
+    UnloadMaterial(curve->material);
+    UnloadMesh(curve->mesh);
+    curve->mesh = (Mesh){0};
+    curve->capacity = 0;
+}
+
+// Bounds the intervals between points[first] and points[last]. The bounds of
+// the whole range hold for every interval in it, so the range is only split
+// where the curve may be discontinuous or leave its domain.
+void adaptive_bound(MP_Env *parser, Adaptive_Point *points, size_t first,
+                    size_t last)
+{
+    MP_Interval bound = evaluate_interval(parser, points[first].x, points[last].x);
+    bool exact = bound.continuous && bound.defined;
+
+    if (exact || mp_interval_is_empty(bound) || last - first == 1) {
+        for (size_t i = first; i < last; ++i)
+            points[i].bound = bound;
+        return;
+    }
+
+    size_t mid = first + (last - first) / 2;
+    adaptive_bound(parser, points, first, mid);
+    adaptive_bound(parser, points, mid, last);
+}
+
+// Decides what to do with the two halves of [a, b] given its midpoint m and
+// the bounds of the curve over the whole interval
+Interval_State adaptive_test(Adaptive_Point a, Adaptive_Point m,
+                             Adaptive_Point b, double min_dx)
+{
+    MP_Interval bound = a.bound;
+    bool defined_a = isfinite(a.y);
+    bool defined_m = isfinite(m.y);
+    bool defined_b = isfinite(b.y);
+    bool at_limit = m.x - a.x < min_dx;
+    double height = screen_height();
+
+    // Undefined everywhere, or entirely above or below the window
+    if (mp_interval_is_empty(bound) || pjy(bound.hi) > height ||
+        pjy(bound.lo) < 0.0)
+        return INTERVAL_DONE;
+
+    // Narrow down where the function stops being defined, which may be
+    // in between the samples
+    if (!defined_a || !defined_m || !defined_b)
+        return at_limit ? INTERVAL_DONE : INTERVAL_REFINE;
+
+    double ya = pjy(a.y);
+    double ym = pjy(m.y);
+    double yb = pjy(b.y);
+
+    // Still not straight at the smallest spacing. It is a break if there is
+    // a discontinuity that the curve jumps over, a steep curve otherwise.
+    if (at_limit) {
+        double jump = max(fabs(ym - ya), fabs(yb - ym));
+        return !bound.continuous && jump > BREAK_MIN_JUMP
+            ? INTERVAL_BREAK : INTERVAL_DONE;
+    }
+
+    // A pole, or a gap in the domain, can hide in between samples that look
+    // straight
+    if (!bound.continuous || !bound.defined)
+        return INTERVAL_REFINE;
+
+    // No detail the size of a pixel left
+    if ((bound.hi - bound.lo) * scale.y <= ADAPTIVE_TOLERANCE)
+        return INTERVAL_DONE;
+
+    // Flatten whatever is more than a window away, so curves leaving the
+    // view do not use up the budget
+    ya = fmin(fmax(ya, -height), 2.0 * height);
+    ym = fmin(fmax(ym, -height), 2.0 * height);
+    yb = fmin(fmax(yb, -height), 2.0 * height);
+
+    if (fabs(ym - (ya + yb) / 2.0) <= ADAPTIVE_TOLERANCE)
+        return INTERVAL_DONE;
+
+    return INTERVAL_REFINE;
+}
+
+void evaluate(MP_Env *parser, const double *xs, double *ys, size_t n)
+{
+    MP_Result result = mp_evaluate_batch(parser, 'x', xs, ys, n);
+    if (result.error && result.error_type != MP_ERROR_ZERO_DIVISION) {
+        for (size_t i = 0; i < n; ++i)
+            ys[i] = NAN;
+    }
+}
+
+// Bounds the curve over [x1, x2]. When that fails, the bounds are unknown
+// but the curve is taken to be continuous, leaving it to the samples.
+MP_Interval evaluate_interval(MP_Env *parser, double x1, double x2)
+{
+    MP_Interval bound;
+    MP_Result result = mp_evaluate_interval(parser, 'x', x1, x2, &bound);
+    if (result.error)
+        bound = mp_interval(-INFINITY, INFINITY);
+    return bound;
+}
+
+// The value and the slope of the curve at x, both NAN if it cannot be
+// evaluated
+MP_Dual evaluate_dual(MP_Env *parser, double x)
+{
+    MP_Dual y;
+    MP_Result result = mp_evaluate_dual(parser, 'x', x, &y);
+    if (result.error)
+        y = (MP_Dual){NAN, NAN};
+    return y;
+}
+
+// The polyline through points at x, where points[k] is the first point that
+// is not left of x. NAN outside of the points or next to a break.
+double interpolate(const Vector2 *points, size_t count, size_t k, double x)
+{
+    if (k >= count)
+        return NAN;
+    if (points[k].x == x)
+        return isfinite(points[k].y) ? points[k].y : NAN;
+    if (k == 0 || !isfinite(points[k - 1].y) || !isfinite(points[k].y))
+        return NAN;
+
+    return map(x, points[k - 1].x, points[k].x, points[k - 1].y, points[k].y);
+}
+
+// Whether the curve is discontinuous between two defined neighbouring
+// samples and jumps over it. A hole like the one of sin(x)/x at 0 is not a
+// break, and a sample right on a pole is one by itself.
+bool is_break(MP_Env *parser, Vector2 p1, Vector2 p2)
+{
+    if (!isfinite(p1.y) || !isfinite(p2.y) ||
+        fabs(pjy(p2.y) - pjy(p1.y)) <= BREAK_MIN_JUMP)
+        return false;
+    return !evaluate_interval(parser, p1.x, p2.x).continuous;
+}
+
+int screen_width(void)
+{
+    return headless_width > 0 ? headless_width : GetScreenWidth();
+}
+
+int screen_height(void)
+{
+    return headless_height > 0 ? headless_height : GetScreenHeight();
 }
 
 double max(double a, double b)
@@ -1,4 +1,4 @@
-// mp - v1.4.0 - MIT License - https://github.com/seajee/mp.h
+// mp - v3.5.1 - MIT License - https://github.com/seajee/mp.h
 
 // TODO: Include documentation on how to use the library
 
@@ -11,6 +11,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <float.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -21,6 +22,22 @@
 
 #define MP_STR_UNKNOWN "?"
 
+// Every allocation of the library goes through these. Define them before
+// including mp.h to use another allocator. MP_FREE must also release what
+// MP_ALIGNED_ALLOC returns.
+#ifndef MP_MALLOC
+#define MP_MALLOC(size) malloc(size)
+#endif
+#ifndef MP_REALLOC
+#define MP_REALLOC(ptr, size) realloc(ptr, size)
+#endif
+#ifndef MP_ALIGNED_ALLOC
+#define MP_ALIGNED_ALLOC(alignment, size) aligned_alloc(alignment, size)
+#endif
+#ifndef MP_FREE
+#define MP_FREE(ptr) free(ptr)
+#endif
+
 //------------------------
 // Mathematical constants
 //------------------------
@@ -39,19 +56,19 @@
         if ((da)->count >= (da)->capacity) {                                 \
             (da)->capacity = (da)->capacity == 0                             \
                 ? MP_DA_INITIAL_CAPACITY : (da)->capacity * 2;               \
-            (da)->items =                                                    \
-                realloc((da)->items, (da)->capacity * sizeof(*(da)->items)); \
+            (da)->items = MP_REALLOC((da)->items,                            \
+                (da)->capacity * sizeof(*(da)->items));                      \
             assert((da)->items != NULL && "Buy more RAM LOL");               \
         }                                                                    \
         (da)->items[(da)->count++] = (item);                                 \
     } while (0)
 
-#define mp_da_free(da)      \
-    do {                    \
-        free((da)->items);  \
-        (da)->items = NULL; \
-        (da)->count = 0;    \
-        (da)->capacity = 0; \
+#define mp_da_free(da)        \
+    do {                      \
+        MP_FREE((da)->items); \
+        (da)->items = NULL;   \
+        (da)->count = 0;      \
+        (da)->capacity = 0;   \
     } while (0)
 
 #define mp_da_reset(da)  \
@@ -63,20 +80,41 @@
 // Arena
 //-------
 
-// TODO: Implement the arena as a linked list of regions
-
 #define MP_ARENA_DEFAULT_CAPACITY (8*1024)
+#define MP_ARENA_ALIGNMENT _Alignof(max_align_t)
+
+typedef struct MP_Region MP_Region;
+
+struct MP_Region {
+    MP_Region *next;
+    size_t count;    // Bytes used
+    size_t capacity; // Bytes available in data
+    max_align_t data[];
+};
 
+// A linked list of regions. Regions are only freed by mp_arena_free, so an
+// arena that is reset or rewound reuses its memory without calling malloc.
 typedef struct {
-    size_t count;
-    size_t capacity;
-    void *data;
+    MP_Region *begin;
+    MP_Region *end;         // Region allocations are currently made from
+    size_t capacity;        // Minimum capacity of new regions
+    size_t bytes_used;      // Bytes allocated since the last reset
+    size_t region_count;
 } MP_Arena;
 
+// A checkpoint to rewind an arena to
+typedef struct {
+    MP_Region *region;
+    size_t count;
+    size_t bytes_used;
+} MP_Arena_Mark;
+
 MP_Arena mp_arena_init(size_t capacity);
 void *mp_arena_alloc(MP_Arena *arena, size_t size);
 void mp_arena_free(MP_Arena *arena);
 void mp_arena_reset(MP_Arena *arena);
+MP_Arena_Mark mp_arena_mark(const MP_Arena *arena);
+void mp_arena_rewind(MP_Arena *arena, MP_Arena_Mark mark);
 
 //-----------
 // Tokenizer
@@ -147,6 +185,17 @@ const char *mp_error_to_string(MP_Error_Type err);
 // Tokenizer functions
 //---------------------
 
+// Produces tokens one at a time, so the parser needs no token list
+typedef struct {
+    const char *expr;
+    size_t cursor;
+    size_t end;
+    MP_Result result; // Set on the first invalid token
+} MP_Lexer;
+
+MP_Lexer mp_lexer_init(const char *expr);
+MP_Lexer mp_lexer_init_n(const char *expr, size_t length);
+bool mp_lexer_next(MP_Lexer *lexer, MP_Token *token);
 MP_Result mp_tokenize(MP_Token_List *list, const char *expr);
 const char *mp_token_to_string(MP_Token token);
 void mp_print_token_list(MP_Token_List list);
@@ -216,9 +265,8 @@ struct MP_Tree_Node {
 };
 
 typedef struct {
-    MP_Token_List tokens;
+    MP_Lexer lexer;
     MP_Token current;
-    size_t cursor;
 } MP_Parser;
 
 typedef struct {
@@ -234,7 +282,9 @@ MP_Tree_Node *mp_make_node_binop(MP_Arena *a, MP_Node_Type t,
 MP_Tree_Node *mp_make_node_function(MP_Arena *a, const MP_Token *name,
                                     MP_Tree_Node *arg);
 
-MP_Result mp_parse(MP_Arena *a, MP_Parse_Tree *tree, MP_Token_List list);
+MP_Result mp_parse(MP_Arena *a, MP_Parse_Tree *tree, const char *expr);
+MP_Result mp_parse_n(MP_Arena *a, MP_Parse_Tree *tree, const char *expr,
+                     size_t length);
 void mp_parser_advance(MP_Parser *parser);
 MP_Tree_Node *mp_parse_expr(MP_Arena *a, MP_Parser *parser, MP_Result *result);
 MP_Tree_Node *mp_parse_term(MP_Arena *a, MP_Parser *parser, MP_Result *result);
@@ -242,6 +292,7 @@ MP_Tree_Node *mp_parse_factor(MP_Arena *a, MP_Parser *parser, MP_Result *result)
 MP_Tree_Node *mp_parse_primary(MP_Arena *a, MP_Parser *parser, MP_Result *result);
 void mp_print_parse_tree(MP_Parse_Tree tree);
 void mp_print_tree_node(MP_Tree_Node *root);
+MP_Tree_Node *mp_tree_node_clone(MP_Arena *a, const MP_Tree_Node *node);
 
 const char *mp_function_name_to_string(MP_Function name);
 
@@ -249,6 +300,15 @@ const char *mp_function_name_to_string(MP_Function name);
 // Interpreter
 //-------------
 
+// Number of inputs evaluated together by the batch functions
+#define MP_BATCH_CAPACITY 256
+
+// Integer exponents in this range are compiled to repeated multiplication
+#define MP_POWI_MAX 64
+
+// Bit of a variable in the masks returned by mp_variables, 'a' is bit 0
+#define MP_VARIABLE_BIT(var) ((uint32_t)1 << ((var) - 'a'))
+
 typedef struct {
     MP_Parse_Tree tree;
     MP_Arena arena;
@@ -257,11 +317,82 @@ typedef struct {
 
 MP_Result mp_interpret(MP_Interpreter *interpreter);
 MP_Result mp_interpret_node(MP_Interpreter *interpreter, MP_Tree_Node *root);
+MP_Result mp_interpret_batch(MP_Interpreter *interpreter, char var,
+                             const double *xs, double *ys, size_t n);
+MP_Result mp_interpret_node_batch(MP_Interpreter *interpreter,
+                                  MP_Tree_Node *root, char var,
+                                  const double *xs, double *ys, size_t n);
 
 MP_Interpreter mp_interpreter_init(MP_Parse_Tree tree, MP_Arena arena);
 void mp_interpreter_var(MP_Interpreter *interpreter, char var, double value);
 void mp_interpreter_free(MP_Interpreter *interpreter);
 
+//-----------
+// Optimizer
+//-----------
+
+// The optimizer rewrites the tree in place. Symbols 'p' and 'e' are treated
+// as the constants pi and e, like mp_init does. Define MP_TRACE_OPTIMIZER to
+// print the trees before and after optimization in mp_init.
+
+MP_Tree_Node *mp_optimize(MP_Arena *a, MP_Tree_Node *root);
+bool mp_symbol_constant(char symbol, double *value);
+bool mp_node_is_number(MP_Tree_Node *node, double value);
+uint32_t mp_node_variables(const MP_Tree_Node *node);
+
+//------
+// SIMD
+//------
+
+// Vectorized kernels used by the batch VM. Each kernel is built for SSE2,
+// AVX2 and AVX-512 and the best one the CPU supports is picked at runtime.
+// Define MP_NO_SIMD to always use the scalar libm loops instead.
+//
+// Maximum error of the approximations measured against a long double
+// reference, for |x| <= 1e8 (trigonometry) and all positive normal x (logs):
+//   sin, cos: 2 ULP      tan: 4 ULP
+//   ln:       1 ULP      log: 2 ULP
+//   sqrt:     correctly rounded (hardware instruction)
+// Lanes outside the reduction range (|x| > 2^30, zero, NaN, infinities,
+// non-positive or subnormal logarithm arguments) fall back to libm.
+
+#if !defined(MP_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define MP_SIMD
+#endif
+
+// Kernels process n rounded up to a multiple of this, so buffers must have
+// room for the padding (the VM blocks always do)
+#define MP_SIMD_LANES 8
+
+typedef enum {
+    MP_SIMD_NONE,
+    MP_SIMD_SSE2,
+    MP_SIMD_AVX2,
+    MP_SIMD_AVX512,
+    MP_SIMD_COUNT
+} MP_Simd_Level;
+
+typedef void (*MP_Simd_Unary)(double *x, size_t n);
+typedef void (*MP_Simd_Binary)(double *a, const double *b, size_t n);
+
+typedef struct {
+    MP_Simd_Level level;
+    MP_Simd_Binary add;
+    MP_Simd_Binary sub;
+    MP_Simd_Binary mul;
+    MP_Simd_Binary div;
+    MP_Simd_Unary ln;
+    MP_Simd_Unary log;
+    MP_Simd_Unary sin;
+    MP_Simd_Unary cos;
+    MP_Simd_Unary tan;
+    MP_Simd_Unary sqrt;
+} MP_Simd_Kernels;
+
+const MP_Simd_Kernels *mp_simd_kernels(void);
+const MP_Simd_Kernels *mp_simd_kernels_for(MP_Simd_Level level);
+const char *mp_simd_level_to_string(MP_Simd_Level level);
+
 //----------
 // Compiler
 //----------
@@ -275,51 +406,174 @@ typedef enum {
     MP_OP_MUL,
     MP_OP_DIV,
     MP_OP_POW,
+    MP_OP_POWI,
     MP_OP_NEG,
+    MP_OP_LN,
+    MP_OP_LOG,
+    MP_OP_SIN,
+    MP_OP_COS,
+    MP_OP_TAN,
+    MP_OP_SQRT,
     MP_OP_COUNT
 } MP_Opcode;
 
+// Every instruction names the stack slot (register) it writes. Since the stack
+// depth at each instruction is known at compile time, the slots are fixed:
+//   PUSH_NUM: r[dst] = constants[arg]
+//   PUSH_VAR: r[dst] = vars[arg]
+//   binary:   r[dst] = r[dst] op r[dst + 1]
+//   unary:    r[dst] = op(r[dst])
+//   POWI:     r[dst] = r[dst] ^ (int32_t)arg
+typedef struct {
+    uint16_t op;
+    uint16_t dst;
+    uint32_t arg;
+} MP_Instruction;
+
 typedef struct {
     size_t count;
     size_t capacity;
-    uint8_t *items;
-} MP_Program;
+    MP_Instruction *items;
+} MP_Code;
 
 typedef struct {
     size_t count;
     size_t capacity;
     double *items;
-} MP_Stack;
+} MP_Constants;
 
 typedef struct {
-    MP_Program program;
-    MP_Stack stack;
-    double vars[26]; // a - z
-    size_t ip;
-} MP_Vm;
+    MP_Code code;
+    MP_Constants constants;
+    size_t register_count; // Maximum stack depth
+    size_t depth;          // Stack depth while compiling
+    uint32_t reads;        // Variables pushed, see MP_VARIABLE_BIT
+} MP_Program;
 
 typedef struct {
-    bool present;
-    double value;
-} MP_Optional;
+    MP_Program program;
+    double *registers; // register_count + 1 slots for scalar runs
+    double *blocks;    // register_count * MP_BATCH_CAPACITY slots for batches
+    double vars[26];   // a - z
+    bool verified;
+    const MP_Simd_Kernels *simd; // Kernels used by the batch VM
+} MP_Vm;
 
 bool mp_program_compile(MP_Program *p, MP_Parse_Tree parse_tree);
 bool mp_program_compile_node(MP_Program *p, MP_Tree_Node *node);
 void mp_program_push_opcode(MP_Program *p, MP_Opcode op);
 void mp_program_push_const(MP_Program *p, double value);
 void mp_program_push_var(MP_Program *p, char var);
+void mp_program_push_powi(MP_Program *p, int32_t exponent);
+bool mp_program_verify(const MP_Program *p);
+bool mp_program_clone(MP_Program *dst, const MP_Program *src);
+void mp_program_free(MP_Program *p);
 void mp_print_program(MP_Program p);
 
-void mp_stack_push(MP_Stack *stack, double n);
-MP_Optional mp_stack_pop(MP_Stack *stack);
-MP_Optional mp_stack_peek(MP_Stack *stack);
-
 MP_Vm mp_vm_init(MP_Program program);
 void mp_vm_var(MP_Vm *vm, char var, double value);
 bool mp_vm_run(MP_Vm *vm);
+bool mp_vm_run_batch(MP_Vm *vm, char var, const double *xs, double *ys,
+                     size_t n);
+bool mp_vm_run_block(MP_Vm *vm, char var, const double *xs, double *ys,
+                     size_t n);
 double mp_vm_result(MP_Vm *vm);
+double mp_powi(double base, int32_t exponent);
 void mp_vm_free(MP_Vm *vm);
 
+//-----
+// JIT
+//-----
+
+// Translates a verified program to x86-64 machine code (System V ABI) in an
+// executable mapping. Define MP_NO_JIT to disable it; on other platforms
+// mp_jit_compile always fails and the JIT falls back to the VM.
+
+#if !defined(MP_NO_JIT) && defined(__x86_64__) && \
+    (defined(__linux__) || defined(__FreeBSD__) || defined(__APPLE__))
+#define MP_JIT
+#endif
+
+typedef double (*MP_Jit_Fn)(const double *vars);
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    uint8_t *items;
+} MP_Jit_Code;
+
+typedef struct {
+    MP_Vm vm;       // Runs batches, and everything if fn is NULL
+    MP_Jit_Fn fn;   // Native code for a single evaluation
+    void *code;     // Executable mapping behind fn
+    size_t code_size;
+} MP_Jit;
+
+bool mp_jit_emit(MP_Jit_Code *c, const MP_Program *p);
+bool mp_jit_compile(MP_Jit *jit);
+MP_Jit mp_jit_init(MP_Program program);
+bool mp_jit_run(MP_Jit *jit, double *result);
+void mp_jit_free(MP_Jit *jit);
+
+//----------
+// Interval
+//----------
+
+// Interval arithmetic: bounds every value an expression takes while one of
+// its variables ranges over [lo, hi]. The bounds are rounded outwards, so they
+// always contain the exact range, but they may be wider than it (a variable
+// that appears twice is treated as two independent ones). The evaluation also
+// tracks whether the expression is defined on the whole interval and whether
+// it is continuous where it is defined, which tells a pole apart from a steep
+// but continuous curve or from the end of its domain.
+
+// Programs that need more registers than this allocate them on every run
+#define MP_INTERVAL_REGISTERS 64
+
+typedef struct {
+    double lo;
+    double hi;
+    bool defined;    // Defined everywhere in the interval
+    bool continuous; // No pole or jump where it is defined in the interval
+} MP_Interval;
+
+MP_Interval mp_interval(double lo, double hi);
+MP_Interval mp_interval_empty(void);
+bool mp_interval_is_empty(MP_Interval x);
+MP_Interval mp_interval_unary(MP_Opcode op, MP_Interval x);
+MP_Interval mp_interval_binary(MP_Opcode op, MP_Interval a, MP_Interval b);
+MP_Interval mp_interval_powi(MP_Interval x, int32_t exponent);
+MP_Result mp_interpret_interval(MP_Interpreter *interpreter, MP_Tree_Node *root,
+                                char var, MP_Interval x, MP_Interval *y);
+bool mp_vm_run_interval(MP_Vm *vm, char var, MP_Interval x, MP_Interval *y);
+
+//------------
+// Derivative
+//------------
+
+// Derivatives with respect to one variable, either as an expression of their
+// own with mp_differentiate or together with the value using dual numbers.
+// The other variables are constants. A derivative can be defined where the
+// expression is not, e.g. the one of x + ln(-1).
+
+// Programs that need more registers than this allocate them on every run
+#define MP_DUAL_REGISTERS 64
+
+// A value and its derivative
+typedef struct {
+    double value;
+    double derivative;
+} MP_Dual;
+
+MP_Tree_Node *mp_differentiate(MP_Arena *a, const MP_Tree_Node *root, char var);
+bool mp_node_depends_on(const MP_Tree_Node *node, char var);
+MP_Dual mp_dual_unary(MP_Opcode op, MP_Dual x);
+MP_Dual mp_dual_binary(MP_Opcode op, MP_Dual a, MP_Dual b);
+MP_Dual mp_dual_powi(MP_Dual x, int32_t exponent);
+MP_Result mp_interpret_dual(MP_Interpreter *interpreter, MP_Tree_Node *root,
+                            char var, double x, MP_Dual *y);
+bool mp_vm_run_dual(MP_Vm *vm, char var, double x, MP_Dual *y);
+
 //----------------
 // Simplified API
 //----------------
@@ -327,6 +581,7 @@ void mp_vm_free(MP_Vm *vm);
 typedef enum {
     MP_MODE_INTERPRET,
     MP_MODE_COMPILE,
+    MP_MODE_JIT,
     MP_MODE_COUNT
 } MP_Mode;
 
@@ -335,13 +590,39 @@ typedef struct {
     union {
         MP_Interpreter interpreter;
         MP_Vm vm;
+        MP_Jit jit;
     };
 } MP_Env;
 
 MP_Env *mp_init(const char *expression);
 MP_Env *mp_init_mode(const char *expression, MP_Mode mode);
+MP_Env *mp_init_arena(const char *expression, MP_Mode mode, MP_Arena *arena);
+MP_Env *mp_init_ex(const char *expression, size_t length, MP_Mode mode,
+                   MP_Arena *arena, MP_Result *result);
+MP_Env *mp_init_derivative(const char *expression, char var, MP_Mode mode);
+MP_Env *mp_init_derivative_ex(const char *expression, size_t length, char var,
+                              MP_Mode mode, MP_Arena *arena, MP_Result *result);
+
+// One expression of a batch. The expression does not have to be
+// NUL-terminated, so it can point straight into a larger buffer.
+typedef struct {
+    const char *expression;
+    size_t length;
+    MP_Env *env;      // NULL if the expression did not compile
+    MP_Result result; // Why it did not
+} MP_Batch_Item;
+
+size_t mp_init_batch(MP_Batch_Item *items, size_t count, MP_Mode mode,
+                     MP_Arena *arena);
+MP_Env *mp_clone(const MP_Env *env);
 void mp_variable(MP_Env *env, char var, double value);
 MP_Result mp_evaluate(MP_Env *env);
+MP_Result mp_evaluate_batch(MP_Env *env, char var, const double *xs,
+                            double *ys, size_t n);
+MP_Result mp_evaluate_interval(MP_Env *env, char var, double lo, double hi,
+                               MP_Interval *y);
+MP_Result mp_evaluate_dual(MP_Env *env, char var, double x, MP_Dual *y);
+uint32_t mp_variables(const MP_Env *env);
 void mp_free(MP_Env *env);
 
 #endif // MP_H_
@@ -356,27 +637,66 @@ void mp_free(MP_Env *env);
 // Arena
 //-------
 
+static MP_Region *mp_region_new(size_t capacity)
+{
+    MP_Region *region = MP_MALLOC(sizeof(*region) + capacity);
+    if (region == NULL)
+        return NULL;
+
+    region->next = NULL;
+    region->count = 0;
+    region->capacity = capacity;
+
+    return region;
+}
+
 MP_Arena mp_arena_init(size_t capacity)
 {
     MP_Arena arena = {0};
-    arena.capacity = capacity;
-    arena.count = 0;
-    arena.data = malloc(capacity);
-    assert(arena.data != NULL);
+    arena.capacity = capacity == 0 ? MP_ARENA_DEFAULT_CAPACITY : capacity;
+    arena.begin = mp_region_new(arena.capacity);
+    arena.end = arena.begin;
+    arena.region_count = arena.begin != NULL ? 1 : 0;
 
     return arena;
 }
 
 void *mp_arena_alloc(MP_Arena *arena, size_t size)
 {
-    if (arena->data == NULL) {
-        *arena = mp_arena_init(MP_ARENA_DEFAULT_CAPACITY);
+    size = (size + MP_ARENA_ALIGNMENT - 1) & ~(MP_ARENA_ALIGNMENT - 1);
+
+    if (arena->capacity == 0) {
+        arena->capacity = MP_ARENA_DEFAULT_CAPACITY;
+    }
+
+    // Skip full regions, which after a reset are reused in order
+    while (arena->end != NULL && arena->end->count + size > arena->end->capacity) {
+        if (arena->end->next == NULL)
+            break;
+        arena->end = arena->end->next;
+        arena->end->count = 0;
     }
 
-    assert(arena->count + size <= arena->capacity);
+    if (arena->end == NULL || arena->end->count + size > arena->end->capacity) {
+        // Double the last region so long expressions need few regions
+        size_t capacity = arena->end != NULL ? 2*arena->end->capacity : arena->capacity;
+        if (capacity < size)
+            capacity = size;
+        MP_Region *region = mp_region_new(capacity);
+        assert(region != NULL);
+
+        if (arena->end == NULL)
+            arena->begin = region;
+        else
+            arena->end->next = region;
+
+        arena->end = region;
+        arena->region_count += 1;
+    }
 
-    void *result = (uint8_t*)arena->data + arena->count;
-    arena->count += size;
+    void *result = (uint8_t*)arena->end->data + arena->end->count;
+    arena->end->count += size;
+    arena->bytes_used += size;
 
     return result;
 }
@@ -386,11 +706,17 @@ void mp_arena_free(MP_Arena *arena)
     if (arena == NULL)
         return;
 
-    arena->count = 0;
-    arena->capacity = 0;
+    MP_Region *region = arena->begin;
+    while (region != NULL) {
+        MP_Region *next = region->next;
+        MP_FREE(region);
+        region = next;
+    }
 
-    free(arena->data);
-    arena->data = NULL;
+    arena->begin = NULL;
+    arena->end = NULL;
+    arena->bytes_used = 0;
+    arena->region_count = 0;
 }
 
 void mp_arena_reset(MP_Arena *arena)
@@ -398,122 +724,151 @@ void mp_arena_reset(MP_Arena *arena)
     if (arena == NULL)
         return;
 
-    arena->count = 0;
+    if (arena->begin != NULL)
+        arena->begin->count = 0;
+
+    arena->end = arena->begin;
+    arena->bytes_used = 0;
+}
+
+MP_Arena_Mark mp_arena_mark(const MP_Arena *arena)
+{
+    MP_Arena_Mark mark = {0};
+    mark.region = arena->end;
+    mark.count = arena->end != NULL ? arena->end->count : 0;
+    mark.bytes_used = arena->bytes_used;
+
+    return mark;
+}
+
+// Frees everything allocated after the mark was taken
+void mp_arena_rewind(MP_Arena *arena, MP_Arena_Mark mark)
+{
+    if (mark.region == NULL) {
+        mp_arena_reset(arena);
+        return;
+    }
+
+    arena->end = mark.region;
+    arena->end->count = mark.count;
+    arena->bytes_used = mark.bytes_used;
 }
 
 //-----------
 // Tokenizer
 //-----------
 
-MP_Result mp_tokenize(MP_Token_List *list, const char *expr)
+MP_Lexer mp_lexer_init(const char *expr)
 {
-    MP_Result result = {0};
-    size_t cursor = 0;
-    size_t end = strlen(expr);
+    return mp_lexer_init_n(expr, strlen(expr));
+}
+
+// Lexes the first length characters of expr. A number must not run up to
+// the end of the buffer unless the buffer is NUL-terminated, since strtod
+// has no length limit.
+MP_Lexer mp_lexer_init_n(const char *expr, size_t length)
+{
+    MP_Lexer lexer = {0};
+    lexer.expr = expr;
+    lexer.cursor = 0;
+    lexer.end = length;
+
+    return lexer;
+}
 
-    while (cursor < end) {
+// Reads the next token. At the end of the expression only the type of token
+// is set to MP_TOKEN_EOF, the rest is left as it was. Returns false on an
+// invalid token, which is then described by lexer->result.
+bool mp_lexer_next(MP_Lexer *lexer, MP_Token *token)
+{
+    const char *expr = lexer->expr;
+    size_t end = lexer->end;
+
+    while (lexer->cursor < end) {
+        size_t cursor = lexer->cursor;
         char c = expr[cursor];
-        MP_Token token = {0};
-        token.position = cursor;
 
         switch (c) {
             case '\n':
             case '\t':
             case ' ': {
-                ++cursor;
-            } break;
-
-            case '+': {
-                token.type = MP_TOKEN_PLUS;
-                mp_da_append(list, token);
-                ++cursor;
-            } break;
-
-            case '-': {
-                token.type = MP_TOKEN_MINUS;
-                mp_da_append(list, token);
-                ++cursor;
-            } break;
-
-            case '*': {
-                token.type = MP_TOKEN_MULTIPLY;
-                mp_da_append(list, token);
-                ++cursor;
-            } break;
-
-            case '/': {
-                token.type = MP_TOKEN_DIVIDE;
-                mp_da_append(list, token);
-                ++cursor;
-            } break;
-
-            case '^': {
-                token.type = MP_TOKEN_POWER;
-                mp_da_append(list, token);
-                ++cursor;
-            } break;
-
-            case '(': {
-                token.type = MP_TOKEN_LPAREN;
-                mp_da_append(list, token);
-                ++cursor;
-            } break;
+                lexer->cursor++;
+                continue;
+            }
 
-            case ')': {
-                token.type = MP_TOKEN_RPAREN;
-                mp_da_append(list, token);
-                ++cursor;
-            } break;
+            case '+': *token = (MP_Token){ .type = MP_TOKEN_PLUS,     .position = cursor }; break;
+            case '-': *token = (MP_Token){ .type = MP_TOKEN_MINUS,    .position = cursor }; break;
+            case '*': *token = (MP_Token){ .type = MP_TOKEN_MULTIPLY, .position = cursor }; break;
+            case '/': *token = (MP_Token){ .type = MP_TOKEN_DIVIDE,   .position = cursor }; break;
+            case '^': *token = (MP_Token){ .type = MP_TOKEN_POWER,    .position = cursor }; break;
+            case '(': *token = (MP_Token){ .type = MP_TOKEN_LPAREN,   .position = cursor }; break;
+            case ')': *token = (MP_Token){ .type = MP_TOKEN_RPAREN,   .position = cursor }; break;
 
             default: {
+                *token = (MP_Token){ .type = MP_TOKEN_INVALID, .position = cursor };
+
                 // Numbers
                 if (isdigit(c)) {
-                    char *end;
-                    token.type = MP_TOKEN_NUMBER;
-                    token.value = strtod(&expr[cursor], &end);
-                    cursor = end - expr;
-                    mp_da_append(list, token);
-                    break;
+                    char *number_end;
+                    token->type = MP_TOKEN_NUMBER;
+                    token->value = strtod(&expr[cursor], &number_end);
+                    lexer->cursor = number_end - expr;
+                    return true;
                 }
 
                 // Symbols / Names
                 if (islower(c)) {
                     // Symbol
                     if (cursor >= end - 1 || !islower(expr[cursor + 1])) {
-                        token.type = MP_TOKEN_SYMBOL;
-                        token.symbol = c;
-                        mp_da_append(list, token);
-                        ++cursor;
-                        break;
+                        token->type = MP_TOKEN_SYMBOL;
+                        token->symbol = c;
+                        lexer->cursor++;
+                        return true;
                     }
 
                     // Name
-                    token.type = MP_TOKEN_NAME;
+                    token->type = MP_TOKEN_NAME;
                     size_t name_len = 0;
                     do {
-                        token.name[name_len++] = expr[cursor];
+                        token->name[name_len++] = expr[cursor];
                         cursor++;
                     } while (name_len <= MP_NAME_CAPACITY
                             && cursor < end && islower(expr[cursor]));
 
                     if (name_len <= MP_NAME_CAPACITY) {
-                        mp_da_append(list, token);
-                        break;
+                        lexer->cursor = cursor;
+                        return true;
                     }
                 }
 
-                // Invalid
-                token.type = MP_TOKEN_INVALID;
-                result.error = true;
-                result.error_type = MP_ERROR_INVALID_TOKEN;
-                result.error_position = cursor;
-                result.faulty_token = token;
-                return result;
-            } break;
+                // Invalid. The cursor stays, so the error repeats.
+                token->type = MP_TOKEN_INVALID;
+                lexer->result.error = true;
+                lexer->result.error_type = MP_ERROR_INVALID_TOKEN;
+                lexer->result.error_position = cursor;
+                lexer->result.faulty_token = *token;
+                return false;
+            }
         }
+
+        lexer->cursor++;
+        return true;
     }
 
-    return result;
+    token->type = MP_TOKEN_EOF;
+    return true;
+}
+
+MP_Result mp_tokenize(MP_Token_List *list, const char *expr)
+{
+    MP_Lexer lexer = mp_lexer_init(expr);
+    MP_Token token = {0};
+
+    while (mp_lexer_next(&lexer, &token) && token.type != MP_TOKEN_EOF) {
+        mp_da_append(list, token);
+    }
+
+    return lexer.result;
 }
 
 const char *mp_token_to_string(MP_Token token)
@@ -632,12 +987,20 @@ MP_Tree_Node *mp_make_node(MP_Arena *a, MP_Node_Type t, double value)
     return r;
 }
 
-MP_Result mp_parse(MP_Arena *a, MP_Parse_Tree *tree, MP_Token_List list)
+// Tokens are read on demand. Errors are reported as if the whole expression
+// was tokenized first: an invalid token anywhere wins over a parse error.
+MP_Result mp_parse(MP_Arena *a, MP_Parse_Tree *tree, const char *expr)
+{
+    return mp_parse_n(a, tree, expr, strlen(expr));
+}
+
+MP_Result mp_parse_n(MP_Arena *a, MP_Parse_Tree *tree, const char *expr,
+                     size_t length)
 {
     MP_Result result = {0};
 
     MP_Parser parser = {0};
-    parser.tokens = list;
+    parser.lexer = mp_lexer_init_n(expr, length);
 
     mp_parser_advance(&parser);
 
@@ -654,20 +1017,24 @@ MP_Result mp_parse(MP_Arena *a, MP_Parse_Tree *tree, MP_Token_List list)
         result.error = true;
         result.error_type = MP_ERROR_INVALID_EXPRESSION;
         result.error_position = parser.current.position;
-        return result;
     }
 
+    // Look for an invalid token in the rest of the expression
+    while (result.error && !parser.lexer.result.error
+        && parser.current.type != MP_TOKEN_EOF) {
+        mp_parser_advance(&parser);
+    }
+
+    if (parser.lexer.result.error)
+        return parser.lexer.result;
+
     return result;
 }
 
 void mp_parser_advance(MP_Parser *parser)
 {
-    if (parser->cursor >= parser->tokens.count) {
-        parser->current.type = MP_TOKEN_EOF;
-        return;
-    }
-
-    parser->current = parser->tokens.items[parser->cursor++];
+    if (!parser->lexer.result.error)
+        mp_lexer_next(&parser->lexer, &parser->current);
 }
 
 MP_Tree_Node *mp_parse_expr(MP_Arena *a, MP_Parser *parser, MP_Result *result)
@@ -896,6 +1263,40 @@ void mp_print_tree_node(MP_Tree_Node *root)
     }
 }
 
+// Deep copies a tree into another arena
+MP_Tree_Node *mp_tree_node_clone(MP_Arena *a, const MP_Tree_Node *node)
+{
+    if (node == NULL)
+        return NULL;
+
+    MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
+    *r = *node;
+
+    switch (node->type) {
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER: {
+            r->binop.lhs = mp_tree_node_clone(a, node->binop.lhs);
+            r->binop.rhs = mp_tree_node_clone(a, node->binop.rhs);
+        } break;
+
+        case MP_NODE_PLUS:
+        case MP_NODE_MINUS: {
+            r->unary.node = mp_tree_node_clone(a, node->unary.node);
+        } break;
+
+        case MP_NODE_FUNCTION: {
+            r->function.arg = mp_tree_node_clone(a, node->function.arg);
+        } break;
+
+        default: break;
+    }
+
+    return r;
+}
+
 const char *mp_function_name_to_string(MP_Function name)
 {
     switch (name) {
@@ -1060,93 +1461,811 @@ MP_Result mp_interpret_node(MP_Interpreter *interpreter, MP_Tree_Node *root)
     return result;
 }
 
-MP_Interpreter mp_interpreter_init(MP_Parse_Tree tree, MP_Arena arena)
+MP_Result mp_interpret_batch(MP_Interpreter *interpreter, char var,
+                             const double *xs, double *ys, size_t n)
 {
-    MP_Interpreter intpr = {0};
-    intpr.tree = tree;
-    intpr.arena = arena;
-
-    return intpr;
-}
+    MP_Result result = {0};
+    if (interpreter == NULL) {
+        result.error = true;
+        return result;
+    }
 
-void mp_interpreter_var(MP_Interpreter *interpreter, char var, double value)
-{
-    if (interpreter == NULL)
-        return;
+    if (interpreter->tree.root == NULL) {
+        result.error = true;
+        result.error_type = MP_ERROR_EMPTY_EXPRESSION;
+        return result;
+    }
 
-    assert('a' <= var && var <= 'z');
-    interpreter->vars[var - 'a'] = value;
-}
+    for (size_t offset = 0; offset < n; offset += MP_BATCH_CAPACITY) {
+        size_t count = n - offset;
+        if (count > MP_BATCH_CAPACITY)
+            count = MP_BATCH_CAPACITY;
 
-void mp_interpreter_free(MP_Interpreter *interpreter)
-{
-    mp_arena_free(&interpreter->arena);
-}
+        MP_Result r = mp_interpret_node_batch(interpreter,
+                interpreter->tree.root, var, xs + offset, ys + offset, count);
 
-//----------
-// Compiler
-//----------
+        if (r.error) {
+            if (r.error_type != MP_ERROR_ZERO_DIVISION)
+                return r;
+            if (!result.error)
+                result = r;
+        }
+    }
 
-// TODO: Implement function evaluation in the compiler and the VM
+    return result;
+}
 
-bool mp_program_compile(MP_Program *p, MP_Parse_Tree parse_tree)
+// Evaluates up to MP_BATCH_CAPACITY inputs in a single walk of the tree.
+// Inputs that fail to evaluate (e.g. division by zero) are set to NAN and the
+// error is reported in the returned MP_Result, while the others are still
+// computed. Structural errors (invalid nodes or functions) abort the batch.
+MP_Result mp_interpret_node_batch(MP_Interpreter *interpreter,
+                                  MP_Tree_Node *root, char var,
+                                  const double *xs, double *ys, size_t n)
 {
-    if (p == NULL)
-        return false;
+#define TRY_BATCH(r)                                          \
+    do {                                                      \
+        MP_Result r_ = (r);                                   \
+        if (r_.error) {                                       \
+            if (r_.error_type != MP_ERROR_ZERO_DIVISION)      \
+                return r_;                                    \
+            if (!result.error)                                \
+                result = r_;                                  \
+        }                                                     \
+    } while (0)
 
-    return mp_program_compile_node(p, parse_tree.root);
-}
+    MP_Result result = {0};
+    double rhs[MP_BATCH_CAPACITY];
 
-bool mp_program_compile_node(MP_Program *p, MP_Tree_Node *node)
-{
-    switch (node->type) {
-        case MP_NODE_INVALID: {
-            return false;
-        } break;
+    assert(n <= MP_BATCH_CAPACITY);
+
+    if (root == NULL) {
+        result.error = true;
+        result.error_type = MP_ERROR_INVALID_NODE;
+        return result;
+    }
 
+    switch (root->type) {
         case MP_NODE_NUMBER: {
-            mp_program_push_opcode(p, MP_OP_PUSH_NUM);
-            mp_program_push_const(p, node->value);
+            for (size_t i = 0; i < n; ++i)
+                ys[i] = root->value;
         } break;
 
         case MP_NODE_SYMBOL: {
-            assert('a' <= node->symbol && node->symbol <= 'z');
-            mp_program_push_opcode(p, MP_OP_PUSH_VAR);
-            mp_program_push_var(p, node->symbol - 'a');
+            assert('a' <= root->symbol && root->symbol <= 'z');
+            if (root->symbol == var) {
+                memcpy(ys, xs, n * sizeof(*ys));
+            } else {
+                double value = interpreter->vars[root->symbol - 'a'];
+                for (size_t i = 0; i < n; ++i)
+                    ys[i] = value;
+            }
+        } break;
+
+        case MP_NODE_FUNCTION: {
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->function.arg,
+                                              var, xs, ys, n));
+
+            switch (root->function.name) {
+                case MP_FUNCTION_LN:
+                    for (size_t i = 0; i < n; ++i) ys[i] = log(ys[i]);
+                    break;
+
+                case MP_FUNCTION_LOG:
+                    for (size_t i = 0; i < n; ++i) ys[i] = log10(ys[i]);
+                    break;
+
+                case MP_FUNCTION_SIN:
+                    for (size_t i = 0; i < n; ++i) ys[i] = sin(ys[i]);
+                    break;
+
+                case MP_FUNCTION_COS:
+                    for (size_t i = 0; i < n; ++i) ys[i] = cos(ys[i]);
+                    break;
+
+                case MP_FUNCTION_TAN:
+                    for (size_t i = 0; i < n; ++i) ys[i] = tan(ys[i]);
+                    break;
+
+                case MP_FUNCTION_SQRT:
+                    for (size_t i = 0; i < n; ++i) ys[i] = sqrt(ys[i]);
+                    break;
+
+                default:
+                    result.error = true;
+                    result.error_type = MP_ERROR_INVALID_FUNCTION;
+                    return result;
+            }
         } break;
 
         case MP_NODE_ADD: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_ADD);
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.lhs,
+                                              var, xs, ys, n));
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.rhs,
+                                              var, xs, rhs, n));
+            for (size_t i = 0; i < n; ++i) ys[i] += rhs[i];
         } break;
 
         case MP_NODE_SUBTRACT: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_SUB);
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.lhs,
+                                              var, xs, ys, n));
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.rhs,
+                                              var, xs, rhs, n));
+            for (size_t i = 0; i < n; ++i) ys[i] -= rhs[i];
         } break;
 
         case MP_NODE_MULTIPLY: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_MUL);
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.lhs,
+                                              var, xs, ys, n));
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.rhs,
+                                              var, xs, rhs, n));
+            for (size_t i = 0; i < n; ++i) ys[i] *= rhs[i];
         } break;
 
         case MP_NODE_DIVIDE: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_DIV);
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.lhs,
+                                              var, xs, ys, n));
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.rhs,
+                                              var, xs, rhs, n));
+            for (size_t i = 0; i < n; ++i) {
+                if (rhs[i] == 0.0) {
+                    ys[i] = NAN;
+                    if (!result.error) {
+                        result.error = true;
+                        result.error_type = MP_ERROR_ZERO_DIVISION;
+                    }
+                } else {
+                    ys[i] /= rhs[i];
+                }
+            }
         } break;
 
         case MP_NODE_POWER: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_POW);
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.lhs,
+                                              var, xs, ys, n));
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->binop.rhs,
+                                              var, xs, rhs, n));
+            for (size_t i = 0; i < n; ++i) ys[i] = pow(ys[i], rhs[i]);
         } break;
 
         case MP_NODE_PLUS: {
-            if (!mp_program_compile_node(p, node->unary.node)) return false;
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->unary.node,
+                                              var, xs, ys, n));
+        } break;
+
+        case MP_NODE_MINUS: {
+            TRY_BATCH(mp_interpret_node_batch(interpreter, root->unary.node,
+                                              var, xs, ys, n));
+            for (size_t i = 0; i < n; ++i) ys[i] = -ys[i];
+        } break;
+
+        case MP_NODE_INVALID:
+        default: {
+            result.error = true;
+            result.error_type = MP_ERROR_INVALID_NODE;
+            return result;
+        } break;
+    }
+
+    return result;
+
+#undef TRY_BATCH
+}
+
+MP_Interpreter mp_interpreter_init(MP_Parse_Tree tree, MP_Arena arena)
+{
+    MP_Interpreter intpr = {0};
+    intpr.tree = tree;
+    intpr.arena = arena;
+
+    return intpr;
+}
+
+void mp_interpreter_var(MP_Interpreter *interpreter, char var, double value)
+{
+    if (interpreter == NULL)
+        return;
+
+    assert('a' <= var && var <= 'z');
+    interpreter->vars[var - 'a'] = value;
+}
+
+void mp_interpreter_free(MP_Interpreter *interpreter)
+{
+    mp_arena_free(&interpreter->arena);
+}
+
+//------
+// SIMD
+//------
+
+#ifdef MP_SIMD
+
+#include <immintrin.h>
+
+// The kernels are written once with GCC vector extensions on 8 doubles and
+// instantiated for every instruction set through the target attribute, so the
+// same source compiles to 4 SSE2, 2 AVX2 or 1 AVX-512 operation per step.
+// Vectors are only passed by pointer, which keeps the helpers free of the
+// ABI differences between instruction sets.
+
+typedef double   MP_F64x8 __attribute__((vector_size(64)));
+typedef uint64_t MP_U64x8 __attribute__((vector_size(64)));
+
+#define MP_SIMD_INLINE static inline __attribute__((always_inline))
+#define MP_SIMD_SPLAT(x) ((MP_F64x8){x, x, x, x, x, x, x, x})
+
+// Vector comparisons on 8 doubles do not lower well to SSE2 and AVX2, so the
+// kernels avoid them: lane selection is done arithmetically with 0.0/1.0
+// factors and range checks are done on the integer representation.
+
+// Converts integers in [0, 2^52) to doubles without a conversion instruction
+MP_SIMD_INLINE void mp_simd_u64_to_f64(const MP_U64x8 *u, MP_F64x8 *d)
+{
+    *d = (MP_F64x8)(*u | 0x4330000000000000) - 0x1p52;
+}
+
+// Reduces x to r in [-pi/4, pi/4] with x = k*pi/2 + r (Cody-Waite, Cephes
+// constants) and evaluates sin(r) and cos(r). Valid for |x| <= 2^30.
+MP_SIMD_INLINE void mp_simd_sincos_reduced(const MP_F64x8 *x, MP_F64x8 *s,
+                                           MP_F64x8 *c, MP_U64x8 *quadrant)
+{
+    const double DP1 = 2.0 * 7.85398125648498535156E-1;
+    const double DP2 = 2.0 * 3.77489470793079817668E-8;
+    const double DP3 = 2.0 * 2.69515142907905952645E-15;
+    const double magic = 0x1.8p52;
+
+    // Round to nearest, the low bits of the shifted value hold k
+    MP_F64x8 shifted = *x * (2.0 / MP_PI) + magic;
+    *quadrant = (MP_U64x8)shifted;
+    MP_F64x8 k = shifted - magic;
+
+    MP_F64x8 r = ((*x - k * DP1) - k * DP2) - k * DP3;
+    MP_F64x8 z = r * r;
+
+    MP_F64x8 ps = MP_SIMD_SPLAT(1.58962301576546568060E-10);
+    ps = ps * z - 2.50507477628578072866E-8;
+    ps = ps * z + 2.75573136213857245213E-6;
+    ps = ps * z - 1.98412698295895385996E-4;
+    ps = ps * z + 8.33333333332211858878E-3;
+    ps = ps * z - 1.66666666666666307295E-1;
+    *s = r + r * z * ps;
+
+    MP_F64x8 pc = MP_SIMD_SPLAT(-1.13585365213876817300E-11);
+    pc = pc * z + 2.08757008419747316778E-9;
+    pc = pc * z - 2.75573141792967388112E-7;
+    pc = pc * z + 2.48015872888517045348E-5;
+    pc = pc * z - 1.38888888888730564116E-3;
+    pc = pc * z + 4.16666666666665929218E-2;
+    *c = 1.0 - 0.5 * z + z * z * pc;
+}
+
+// sin(k*pi/2 + r) for quadrant q is (+s, +c, -s, -c)[q mod 4]
+MP_SIMD_INLINE void mp_simd_quadrant(MP_F64x8 *x, const MP_F64x8 *s,
+                                     const MP_F64x8 *c, const MP_U64x8 *q)
+{
+    MP_U64x8 odd_bit = *q & 1;
+    MP_F64x8 odd;
+    mp_simd_u64_to_f64(&odd_bit, &odd);
+
+    MP_F64x8 y = odd * *c + (1.0 - odd) * *s;
+    *x = (MP_F64x8)((MP_U64x8)y ^ ((*q & 2) << 62));
+}
+
+MP_SIMD_INLINE void mp_simd_sin8(MP_F64x8 *x)
+{
+    MP_F64x8 s, c;
+    MP_U64x8 q;
+    mp_simd_sincos_reduced(x, &s, &c, &q);
+    mp_simd_quadrant(x, &s, &c, &q);
+}
+
+MP_SIMD_INLINE void mp_simd_cos8(MP_F64x8 *x)
+{
+    MP_F64x8 s, c;
+    MP_U64x8 q;
+    mp_simd_sincos_reduced(x, &s, &c, &q);
+    q += 1;
+    mp_simd_quadrant(x, &s, &c, &q);
+}
+
+MP_SIMD_INLINE void mp_simd_tan8(MP_F64x8 *x)
+{
+    MP_F64x8 s, c;
+    MP_U64x8 q;
+    mp_simd_sincos_reduced(x, &s, &c, &q);
+
+    // Even quadrants: s/c, odd quadrants: -c/s
+    MP_U64x8 odd_bit = q & 1;
+    MP_F64x8 odd;
+    mp_simd_u64_to_f64(&odd_bit, &odd);
+
+    MP_F64x8 num = (1.0 - odd) * s - odd * c;
+    MP_F64x8 den = (1.0 - odd) * c + odd * s;
+    *x = num / den;
+}
+
+// Natural logarithm for positive normal finite x (Cephes log)
+MP_SIMD_INLINE void mp_simd_ln8(MP_F64x8 *x)
+{
+    // x = m * 2^e with m in [0.7056, 1.4112), the offset keeps the shifted
+    // exponent field positive so a logical shift is enough
+    const uint64_t offset = 0x3fe6955500000000;
+    const uint64_t bias = (uint64_t)1024 << 52;
+
+    MP_U64x8 bits = (MP_U64x8)*x;
+    MP_U64x8 field = (bits - offset + bias) >> 52;
+    MP_U64x8 m_bits = bits - ((field << 52) - bias);
+
+    MP_F64x8 e;
+    mp_simd_u64_to_f64(&field, &e);
+    e = e - 1024.0;
+    MP_F64x8 m = (MP_F64x8)m_bits - 1.0;
+
+    MP_F64x8 z = m * m;
+
+    MP_F64x8 p = MP_SIMD_SPLAT(1.01875663804580931796E-4);
+    p = p * m + 4.97494994976747001425E-1;
+    p = p * m + 4.70579119878881725854E0;
+    p = p * m + 1.44989225341610930846E1;
+    p = p * m + 1.79368678507819816313E1;
+    p = p * m + 7.70838733755885391666E0;
+
+    MP_F64x8 q = m + 1.12873587189167450590E1;
+    q = q * m + 4.52279145837532221105E1;
+    q = q * m + 8.29875266912776603211E1;
+    q = q * m + 7.11544750618563894466E1;
+    q = q * m + 2.31251620126765340583E1;
+
+    MP_F64x8 y = m * (z * p / q);
+    y = y - e * 2.121944400546905827679e-4;
+    y = y - 0.5 * z;
+    *x = (m + y) + e * 0.693359375;
+}
+
+MP_SIMD_INLINE void mp_simd_log8(MP_F64x8 *x)
+{
+    mp_simd_ln8(x);
+    *x = *x * 0.43429448190325182765;
+}
+
+// The fallback checks return true if any lane is outside the valid range
+
+MP_SIMD_INLINE bool mp_simd_trig_fallback(const MP_F64x8 *x)
+{
+    // Zero (to keep its sign), |x| > 2^30, infinities and NaN
+    MP_U64x8 ax = ((MP_U64x8)*x & 0x7fffffffffffffff) - 1;
+    bool slow = false;
+    for (int i = 0; i < MP_SIMD_LANES; ++i)
+        slow |= ax[i] >= 0x41d0000000000000;
+    return slow;
+}
+
+MP_SIMD_INLINE bool mp_simd_log_fallback(const MP_F64x8 *x)
+{
+    // Anything but positive normal finite numbers
+    MP_U64x8 bits = (MP_U64x8)*x - 0x0010000000000000;
+    bool slow = false;
+    for (int i = 0; i < MP_SIMD_LANES; ++i)
+        slow |= bits[i] >= 0x7fe0000000000000;
+    return slow;
+}
+
+#define MP_SIMD_UNARY_KERNEL(name, body, fallback, libm)             \
+    MP_SIMD_INLINE void mp_simd_##name##_kernel(double *x, size_t n) \
+    {                                                                \
+        for (size_t i = 0; i < n; i += MP_SIMD_LANES) {              \
+            MP_F64x8 v;                                              \
+            memcpy(&v, x + i, sizeof(v));                            \
+            if (fallback(&v)) {                                      \
+                for (int j = 0; j < MP_SIMD_LANES; ++j)              \
+                    x[i + j] = libm(x[i + j]);                       \
+                continue;                                            \
+            }                                                        \
+            body(&v);                                                \
+            memcpy(x + i, &v, sizeof(v));                            \
+        }                                                            \
+    }
+
+#define MP_SIMD_BINARY_KERNEL(name, op)                                     \
+    MP_SIMD_INLINE void mp_simd_##name##_kernel(double *a, const double *b, \
+                                                size_t n)                   \
+    {                                                                       \
+        for (size_t i = 0; i < n; i += MP_SIMD_LANES) {                     \
+            MP_F64x8 u, v;                                                  \
+            memcpy(&u, a + i, sizeof(u));                                   \
+            memcpy(&v, b + i, sizeof(v));                                   \
+            u = u op v;                                                     \
+            memcpy(a + i, &u, sizeof(u));                                   \
+        }                                                                   \
+    }
+
+MP_SIMD_UNARY_KERNEL(sin, mp_simd_sin8, mp_simd_trig_fallback, sin)
+MP_SIMD_UNARY_KERNEL(cos, mp_simd_cos8, mp_simd_trig_fallback, cos)
+MP_SIMD_UNARY_KERNEL(tan, mp_simd_tan8, mp_simd_trig_fallback, tan)
+MP_SIMD_UNARY_KERNEL(ln,  mp_simd_ln8,  mp_simd_log_fallback,  log)
+MP_SIMD_UNARY_KERNEL(log, mp_simd_log8, mp_simd_log_fallback,  log10)
+
+MP_SIMD_BINARY_KERNEL(add, +)
+MP_SIMD_BINARY_KERNEL(sub, -)
+MP_SIMD_BINARY_KERNEL(mul, *)
+MP_SIMD_BINARY_KERNEL(div, /)
+
+// Instantiates every kernel for one instruction set. sqrt has no generic
+// vector form, so it is passed in as a per-ISA loop body.
+#define MP_SIMD_DEFINE(suffix, isa, lvl, sqrt_step)                                    \
+    __attribute__((target(isa))) void mp_simd_add_##suffix(double *a, const double *b, size_t n) { mp_simd_add_kernel(a, b, n); } \
+    __attribute__((target(isa))) void mp_simd_sub_##suffix(double *a, const double *b, size_t n) { mp_simd_sub_kernel(a, b, n); } \
+    __attribute__((target(isa))) void mp_simd_mul_##suffix(double *a, const double *b, size_t n) { mp_simd_mul_kernel(a, b, n); } \
+    __attribute__((target(isa))) void mp_simd_div_##suffix(double *a, const double *b, size_t n) { mp_simd_div_kernel(a, b, n); } \
+    __attribute__((target(isa))) void mp_simd_ln_##suffix(double *x, size_t n)  { mp_simd_ln_kernel(x, n); }  \
+    __attribute__((target(isa))) void mp_simd_log_##suffix(double *x, size_t n) { mp_simd_log_kernel(x, n); } \
+    __attribute__((target(isa))) void mp_simd_sin_##suffix(double *x, size_t n) { mp_simd_sin_kernel(x, n); } \
+    __attribute__((target(isa))) void mp_simd_cos_##suffix(double *x, size_t n) { mp_simd_cos_kernel(x, n); } \
+    __attribute__((target(isa))) void mp_simd_tan_##suffix(double *x, size_t n) { mp_simd_tan_kernel(x, n); } \
+    __attribute__((target(isa))) void mp_simd_sqrt_##suffix(double *x, size_t n)    \
+    {                                                                               \
+        for (size_t i = 0; i < n; i += MP_SIMD_LANES) { sqrt_step; }               \
+    }                                                                               \
+    const MP_Simd_Kernels mp_simd_kernels_##suffix = {                              \
+        .level = lvl,                                                               \
+        .add = mp_simd_add_##suffix, .sub = mp_simd_sub_##suffix,                   \
+        .mul = mp_simd_mul_##suffix, .div = mp_simd_div_##suffix,                   \
+        .ln  = mp_simd_ln_##suffix,  .log = mp_simd_log_##suffix,                   \
+        .sin = mp_simd_sin_##suffix, .cos = mp_simd_cos_##suffix,                   \
+        .tan = mp_simd_tan_##suffix, .sqrt = mp_simd_sqrt_##suffix,                 \
+    };
+
+MP_SIMD_DEFINE(sse2, "sse2", MP_SIMD_SSE2,
+    for (int j = 0; j < 8; j += 2)
+        _mm_storeu_pd(x + i + j, _mm_sqrt_pd(_mm_loadu_pd(x + i + j))))
+
+MP_SIMD_DEFINE(avx2, "avx2", MP_SIMD_AVX2,
+    for (int j = 0; j < 8; j += 4)
+        _mm256_storeu_pd(x + i + j, _mm256_sqrt_pd(_mm256_loadu_pd(x + i + j))))
+
+MP_SIMD_DEFINE(avx512, "avx512f", MP_SIMD_AVX512,
+    _mm512_storeu_pd(x + i, _mm512_sqrt_pd(_mm512_loadu_pd(x + i))))
+
+#endif // MP_SIMD
+
+void mp_simd_add_scalar(double *a, const double *b, size_t n) { for (size_t i = 0; i < n; ++i) a[i] += b[i]; }
+void mp_simd_sub_scalar(double *a, const double *b, size_t n) { for (size_t i = 0; i < n; ++i) a[i] -= b[i]; }
+void mp_simd_mul_scalar(double *a, const double *b, size_t n) { for (size_t i = 0; i < n; ++i) a[i] *= b[i]; }
+void mp_simd_div_scalar(double *a, const double *b, size_t n) { for (size_t i = 0; i < n; ++i) a[i] /= b[i]; }
+void mp_simd_ln_scalar(double *x, size_t n)   { for (size_t i = 0; i < n; ++i) x[i] = log(x[i]); }
+void mp_simd_log_scalar(double *x, size_t n)  { for (size_t i = 0; i < n; ++i) x[i] = log10(x[i]); }
+void mp_simd_sin_scalar(double *x, size_t n)  { for (size_t i = 0; i < n; ++i) x[i] = sin(x[i]); }
+void mp_simd_cos_scalar(double *x, size_t n)  { for (size_t i = 0; i < n; ++i) x[i] = cos(x[i]); }
+void mp_simd_tan_scalar(double *x, size_t n)  { for (size_t i = 0; i < n; ++i) x[i] = tan(x[i]); }
+void mp_simd_sqrt_scalar(double *x, size_t n) { for (size_t i = 0; i < n; ++i) x[i] = sqrt(x[i]); }
+
+const MP_Simd_Kernels mp_simd_kernels_scalar = {
+    .level = MP_SIMD_NONE,
+    .add = mp_simd_add_scalar, .sub = mp_simd_sub_scalar,
+    .mul = mp_simd_mul_scalar, .div = mp_simd_div_scalar,
+    .ln  = mp_simd_ln_scalar,  .log = mp_simd_log_scalar,
+    .sin = mp_simd_sin_scalar, .cos = mp_simd_cos_scalar,
+    .tan = mp_simd_tan_scalar, .sqrt = mp_simd_sqrt_scalar,
+};
+
+// Safe to call from several threads at once: the level is picked into a
+// local and published with a single atomic store. Threads that race on the
+// first call all pick the same table.
+const MP_Simd_Kernels *mp_simd_kernels(void)
+{
+    static const MP_Simd_Kernels *best = NULL;
+
+    const MP_Simd_Kernels *kernels = __atomic_load_n(&best, __ATOMIC_ACQUIRE);
+    if (kernels == NULL) {
+        for (int level = MP_SIMD_COUNT - 1; level >= MP_SIMD_NONE; --level) {
+            kernels = mp_simd_kernels_for(level);
+            if (kernels != NULL)
+                break;
+        }
+        __atomic_store_n(&best, kernels, __ATOMIC_RELEASE);
+    }
+
+    return kernels;
+}
+
+// Returns NULL if the level is not compiled in or not supported by the CPU
+const MP_Simd_Kernels *mp_simd_kernels_for(MP_Simd_Level level)
+{
+    if (level == MP_SIMD_NONE)
+        return &mp_simd_kernels_scalar;
+
+#ifdef MP_SIMD
+    __builtin_cpu_init();
+
+    switch (level) {
+        case MP_SIMD_SSE2: {
+            return &mp_simd_kernels_sse2;
+        } break;
+
+        case MP_SIMD_AVX2: {
+            if (__builtin_cpu_supports("avx2"))
+                return &mp_simd_kernels_avx2;
+        } break;
+
+        case MP_SIMD_AVX512: {
+            if (__builtin_cpu_supports("avx512f"))
+                return &mp_simd_kernels_avx512;
+        } break;
+
+        default: break;
+    }
+#endif // MP_SIMD
+
+    return NULL;
+}
+
+const char *mp_simd_level_to_string(MP_Simd_Level level)
+{
+    switch (level) {
+        case MP_SIMD_NONE:   return "scalar";
+        case MP_SIMD_SSE2:   return "sse2";
+        case MP_SIMD_AVX2:   return "avx2";
+        case MP_SIMD_AVX512: return "avx512";
+        default:             return MP_STR_UNKNOWN;
+    }
+}
+
+//-----------
+// Optimizer
+//-----------
+
+MP_Tree_Node *mp_optimize(MP_Arena *a, MP_Tree_Node *root)
+{
+    if (root == NULL)
+        return NULL;
+
+    MP_Interpreter constants = {0};
+
+    switch (root->type) {
+        case MP_NODE_SYMBOL: {
+            double value;
+            if (mp_symbol_constant(root->symbol, &value))
+                return mp_make_node(a, MP_NODE_NUMBER, value);
+        } break;
+
+        case MP_NODE_FUNCTION: {
+            root->function.arg = mp_optimize(a, root->function.arg);
+            if (root->function.arg == NULL)
+                return root;
+
+            if (root->function.arg->type == MP_NODE_NUMBER) {
+                MP_Result r = mp_interpret_node(&constants, root);
+                if (!r.error)
+                    return mp_make_node(a, MP_NODE_NUMBER, r.value);
+            }
+        } break;
+
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER: {
+            root->binop.lhs = mp_optimize(a, root->binop.lhs);
+            root->binop.rhs = mp_optimize(a, root->binop.rhs);
+
+            MP_Tree_Node *lhs = root->binop.lhs;
+            MP_Tree_Node *rhs = root->binop.rhs;
+            if (lhs == NULL || rhs == NULL)
+                return root;
+
+            // Constant subtree
+            if (lhs->type == MP_NODE_NUMBER && rhs->type == MP_NODE_NUMBER) {
+                MP_Result r = mp_interpret_node(&constants, root);
+                if (!r.error)
+                    return mp_make_node(a, MP_NODE_NUMBER, r.value);
+                return root; // Keep the error for evaluation time
+            }
+
+            if (root->type == MP_NODE_ADD) {
+                if (mp_node_is_number(lhs, 0.0)) return rhs;
+                if (mp_node_is_number(rhs, 0.0)) return lhs;
+            }
+
+            if (root->type == MP_NODE_SUBTRACT) {
+                if (mp_node_is_number(rhs, 0.0)) return lhs;
+            }
+
+            if (root->type == MP_NODE_MULTIPLY) {
+                if (mp_node_is_number(lhs, 1.0)) return rhs;
+                if (mp_node_is_number(rhs, 1.0)) return lhs;
+            }
+
+            // x / c -> x * (1/c)
+            if (root->type == MP_NODE_DIVIDE && rhs->type == MP_NODE_NUMBER
+                    && rhs->value != 0.0) {
+                if (rhs->value == 1.0)
+                    return lhs;
+
+                root->type = MP_NODE_MULTIPLY;
+                root->binop.rhs = mp_make_node(a, MP_NODE_NUMBER,
+                                               1.0 / rhs->value);
+            }
+
+            // x^1 -> x, x^2 -> x*x, x^3 -> x*x*x
+            if (root->type == MP_NODE_POWER && rhs->type == MP_NODE_NUMBER) {
+                if (rhs->value == 1.0)
+                    return lhs;
+
+                if (lhs->type == MP_NODE_SYMBOL
+                        && (rhs->value == 2.0 || rhs->value == 3.0)) {
+                    MP_Tree_Node *square = mp_make_node_binop(a,
+                            MP_NODE_MULTIPLY, lhs,
+                            mp_make_node_symbol(a, lhs->symbol));
+
+                    if (rhs->value == 2.0)
+                        return square;
+
+                    return mp_make_node_binop(a, MP_NODE_MULTIPLY, square,
+                            mp_make_node_symbol(a, lhs->symbol));
+                }
+            }
+        } break;
+
+        case MP_NODE_PLUS: {
+            return mp_optimize(a, root->unary.node);
+        } break;
+
+        case MP_NODE_MINUS: {
+            MP_Tree_Node *node = mp_optimize(a, root->unary.node);
+            root->unary.node = node;
+            if (node == NULL)
+                return root;
+
+            if (node->type == MP_NODE_NUMBER)
+                return mp_make_node(a, MP_NODE_NUMBER, -node->value);
+
+            if (node->type == MP_NODE_MINUS)
+                return node->unary.node;
+        } break;
+
+        default: break;
+    }
+
+    return root;
+}
+
+bool mp_symbol_constant(char symbol, double *value)
+{
+    switch (symbol) {
+        case 'p': *value = MP_PI; return true;
+        case 'e': *value = MP_E;  return true;
+        default:                  return false;
+    }
+}
+
+bool mp_node_is_number(MP_Tree_Node *node, double value)
+{
+    return node != NULL && node->type == MP_NODE_NUMBER && node->value == value;
+}
+
+// The variables a tree reads, see MP_VARIABLE_BIT
+uint32_t mp_node_variables(const MP_Tree_Node *node)
+{
+    if (node == NULL)
+        return 0;
+
+    switch (node->type) {
+        case MP_NODE_SYMBOL:
+            if ('a' <= node->symbol && node->symbol <= 'z')
+                return MP_VARIABLE_BIT(node->symbol);
+            return 0;
+
+        case MP_NODE_FUNCTION:
+            return mp_node_variables(node->function.arg);
+
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER:
+            return mp_node_variables(node->binop.lhs)
+                 | mp_node_variables(node->binop.rhs);
+
+        case MP_NODE_PLUS:
+        case MP_NODE_MINUS:
+            return mp_node_variables(node->unary.node);
+
+        default:
+            return 0;
+    }
+}
+
+//----------
+// Compiler
+//----------
+
+bool mp_program_compile(MP_Program *p, MP_Parse_Tree parse_tree)
+{
+    if (p == NULL || parse_tree.root == NULL)
+        return false;
+
+    p->depth = 0;
+    if (!mp_program_compile_node(p, parse_tree.root))
+        return false;
+
+    return p->depth == 1;
+}
+
+bool mp_program_compile_node(MP_Program *p, MP_Tree_Node *node)
+{
+    if (node == NULL)
+        return false;
+
+    switch (node->type) {
+        case MP_NODE_INVALID: {
+            return false;
+        } break;
+
+        case MP_NODE_NUMBER: {
+            mp_program_push_const(p, node->value);
+        } break;
+
+        case MP_NODE_SYMBOL: {
+            assert('a' <= node->symbol && node->symbol <= 'z');
+            mp_program_push_var(p, node->symbol);
+        } break;
+
+        case MP_NODE_FUNCTION: {
+            if (!mp_program_compile_node(p, node->function.arg)) return false;
+
+            switch (node->function.name) {
+                case MP_FUNCTION_LN:   mp_program_push_opcode(p, MP_OP_LN);   break;
+                case MP_FUNCTION_LOG:  mp_program_push_opcode(p, MP_OP_LOG);  break;
+                case MP_FUNCTION_SIN:  mp_program_push_opcode(p, MP_OP_SIN);  break;
+                case MP_FUNCTION_COS:  mp_program_push_opcode(p, MP_OP_COS);  break;
+                case MP_FUNCTION_TAN:  mp_program_push_opcode(p, MP_OP_TAN);  break;
+                case MP_FUNCTION_SQRT: mp_program_push_opcode(p, MP_OP_SQRT); break;
+                default:               return false;
+            }
+        } break;
+
+        case MP_NODE_ADD: {
+            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
+            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
+            mp_program_push_opcode(p, MP_OP_ADD);
+        } break;
+
+        case MP_NODE_SUBTRACT: {
+            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
+            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
+            mp_program_push_opcode(p, MP_OP_SUB);
+        } break;
+
+        case MP_NODE_MULTIPLY: {
+            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
+            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
+            mp_program_push_opcode(p, MP_OP_MUL);
+        } break;
+
+        case MP_NODE_DIVIDE: {
+            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
+            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
+            mp_program_push_opcode(p, MP_OP_DIV);
+        } break;
+
+        case MP_NODE_POWER: {
+            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
+
+            MP_Tree_Node *rhs = node->binop.rhs;
+            if (rhs != NULL && rhs->type == MP_NODE_NUMBER
+                    && fabs(rhs->value) <= MP_POWI_MAX
+                    && rhs->value == (int32_t)rhs->value) {
+                mp_program_push_powi(p, (int32_t)rhs->value);
+                break;
+            }
+
+            if (!mp_program_compile_node(p, rhs)) return false;
+            mp_program_push_opcode(p, MP_OP_POW);
+        } break;
+
+        case MP_NODE_PLUS: {
+            if (!mp_program_compile_node(p, node->unary.node)) return false;
         } break;
 
         case MP_NODE_MINUS: {
@@ -1155,232 +2274,1815 @@ bool mp_program_compile_node(MP_Program *p, MP_Tree_Node *node)
         } break;
 
         default: {
-            return false;
+            return false;
+        } break;
+    }
+
+    return true;
+}
+
+// Appends an operator reading its operands from the top of the stack. Binary
+// operators consume the two topmost slots and write into the lower one.
+void mp_program_push_opcode(MP_Program *p, MP_Opcode op)
+{
+    if (p == NULL)
+        return;
+
+    MP_Instruction inst = {0};
+    inst.op = op;
+
+    switch (op) {
+        case MP_OP_ADD:
+        case MP_OP_SUB:
+        case MP_OP_MUL:
+        case MP_OP_DIV:
+        case MP_OP_POW: {
+            assert(p->depth >= 2);
+            p->depth--;
+        } break;
+
+        default: {
+            assert(p->depth >= 1);
+        } break;
+    }
+
+    inst.dst = p->depth - 1;
+    mp_da_append(&p->code, inst);
+}
+
+void mp_program_push_const(MP_Program *p, double value)
+{
+    if (p == NULL)
+        return;
+
+    size_t index = 0;
+    while (index < p->constants.count
+            && memcmp(&p->constants.items[index], &value, sizeof(value)) != 0) {
+        ++index;
+    }
+    if (index == p->constants.count) {
+        mp_da_append(&p->constants, value);
+    }
+
+    MP_Instruction inst = {0};
+    inst.op = MP_OP_PUSH_NUM;
+    inst.dst = p->depth++;
+    inst.arg = index;
+    mp_da_append(&p->code, inst);
+
+    if (p->depth > p->register_count)
+        p->register_count = p->depth;
+}
+
+void mp_program_push_var(MP_Program *p, char var)
+{
+    if (p == NULL)
+        return;
+
+    assert('a' <= var && var <= 'z');
+
+    MP_Instruction inst = {0};
+    inst.op = MP_OP_PUSH_VAR;
+    inst.dst = p->depth++;
+    inst.arg = var - 'a';
+    mp_da_append(&p->code, inst);
+    p->reads |= MP_VARIABLE_BIT(var);
+
+    if (p->depth > p->register_count)
+        p->register_count = p->depth;
+}
+
+void mp_program_push_powi(MP_Program *p, int32_t exponent)
+{
+    if (p == NULL)
+        return;
+
+    assert(p->depth >= 1);
+
+    MP_Instruction inst = {0};
+    inst.op = MP_OP_POWI;
+    inst.dst = p->depth - 1;
+    inst.arg = (uint32_t)exponent;
+    mp_da_append(&p->code, inst);
+}
+
+// Checks once that every instruction is well formed and only touches slots
+// inside the stack, so the VM can run the program without any checks.
+bool mp_program_verify(const MP_Program *p)
+{
+    if (p == NULL || p->code.count == 0 || p->register_count == 0)
+        return false;
+
+    if (p->register_count > UINT16_MAX)
+        return false;
+
+    size_t depth = 0;
+    for (size_t ip = 0; ip < p->code.count; ++ip) {
+        MP_Instruction inst = p->code.items[ip];
+
+        switch (inst.op) {
+            case MP_OP_PUSH_NUM: {
+                if (inst.arg >= p->constants.count) return false;
+                if (inst.dst != depth) return false;
+                ++depth;
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                if (inst.arg >= 26) return false;
+                if (inst.dst != depth) return false;
+                ++depth;
+            } break;
+
+            case MP_OP_ADD:
+            case MP_OP_SUB:
+            case MP_OP_MUL:
+            case MP_OP_DIV:
+            case MP_OP_POW: {
+                if (depth < 2 || inst.dst != depth - 2) return false;
+                --depth;
+            } break;
+
+            case MP_OP_POWI:
+            case MP_OP_NEG:
+            case MP_OP_LN:
+            case MP_OP_LOG:
+            case MP_OP_SIN:
+            case MP_OP_COS:
+            case MP_OP_TAN:
+            case MP_OP_SQRT: {
+                if (depth < 1 || inst.dst != depth - 1) return false;
+            } break;
+
+            default: {
+                return false;
+            } break;
+        }
+
+        if (depth > p->register_count)
+            return false;
+    }
+
+    return depth == 1;
+}
+
+bool mp_program_clone(MP_Program *dst, const MP_Program *src)
+{
+    if (dst == NULL || src == NULL)
+        return false;
+
+    MP_Program p = {0};
+    for (size_t i = 0; i < src->code.count; ++i)
+        mp_da_append(&p.code, src->code.items[i]);
+    for (size_t i = 0; i < src->constants.count; ++i)
+        mp_da_append(&p.constants, src->constants.items[i]);
+    p.register_count = src->register_count;
+    p.depth = src->depth;
+    p.reads = src->reads;
+
+    *dst = p;
+    return true;
+}
+
+void mp_program_free(MP_Program *p)
+{
+    if (p == NULL)
+        return;
+
+    mp_da_free(&p->code);
+    mp_da_free(&p->constants);
+    p->register_count = 0;
+    p->depth = 0;
+    p->reads = 0;
+}
+
+void mp_print_program(MP_Program p)
+{
+    for (size_t ip = 0; ip < p.code.count; ++ip) {
+        MP_Instruction inst = p.code.items[ip];
+
+        switch (inst.op) {
+            case MP_OP_PUSH_NUM: {
+                printf("%ld: PUSH_NUM r%d ", ip, inst.dst);
+                if (inst.arg < p.constants.count)
+                    printf("%f\n", p.constants.items[inst.arg]);
+                else
+                    printf("%s\n", MP_STR_UNKNOWN);
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                printf("%ld: PUSH_VAR r%d %c\n", ip, inst.dst, inst.arg + 'a');
+            } break;
+
+            case MP_OP_ADD:  printf("%ld: ADD r%d\n", ip, inst.dst);  break;
+            case MP_OP_SUB:  printf("%ld: SUB r%d\n", ip, inst.dst);  break;
+            case MP_OP_MUL:  printf("%ld: MUL r%d\n", ip, inst.dst);  break;
+            case MP_OP_DIV:  printf("%ld: DIV r%d\n", ip, inst.dst);  break;
+            case MP_OP_POW:  printf("%ld: POW r%d\n", ip, inst.dst);  break;
+            case MP_OP_POWI: printf("%ld: POWI r%d %d\n", ip, inst.dst, (int32_t)inst.arg); break;
+            case MP_OP_NEG:  printf("%ld: NEG r%d\n", ip, inst.dst);  break;
+            case MP_OP_LN:   printf("%ld: LN r%d\n", ip, inst.dst);   break;
+            case MP_OP_LOG:  printf("%ld: LOG r%d\n", ip, inst.dst);  break;
+            case MP_OP_SIN:  printf("%ld: SIN r%d\n", ip, inst.dst);  break;
+            case MP_OP_COS:  printf("%ld: COS r%d\n", ip, inst.dst);  break;
+            case MP_OP_TAN:  printf("%ld: TAN r%d\n", ip, inst.dst);  break;
+            case MP_OP_SQRT: printf("%ld: SQRT r%d\n", ip, inst.dst); break;
+
+            default: {
+                printf("%ld: ?\n", ip);
+            } break;
+        }
+    }
+}
+
+// Verifies the program and preallocates its stack. The blocks for batches are
+// only allocated by the first batch, so compiling many expressions stays
+// cheap. The returned VM refuses to run if the program did not pass
+// verification.
+MP_Vm mp_vm_init(MP_Program program)
+{
+    MP_Vm vm = {0};
+    vm.program = program;
+
+    if (!mp_program_verify(&program))
+        return vm;
+
+    size_t count = program.register_count;
+    vm.registers = MP_MALLOC((count + 1) * sizeof(*vm.registers));
+    if (vm.registers == NULL)
+        return vm;
+
+    vm.simd = mp_simd_kernels();
+    vm.verified = true;
+    return vm;
+}
+
+void mp_vm_var(MP_Vm *vm, char var, double value)
+{
+    if (vm == NULL)
+        return;
+
+    assert('a' <= var && var <= 'z');
+    vm->vars[var - 'a'] = value;
+}
+
+bool mp_vm_run(MP_Vm *vm)
+{
+    if (vm == NULL || !vm->verified)
+        return false;
+
+    const MP_Instruction *code = vm->program.code.items;
+    const double *constants = vm->program.constants.items;
+    size_t count = vm->program.code.count;
+
+    // The top of the stack is cached in a local. The slot below it lives in
+    // r[dst - 1], which is why the register file has one extra leading slot.
+    double *r = vm->registers + 1;
+    double top = 0.0;
+
+    for (size_t ip = 0; ip < count; ++ip) {
+        MP_Instruction inst = code[ip];
+        double *d = r + inst.dst;
+
+        switch (inst.op) {
+            case MP_OP_PUSH_NUM: d[-1] = top; top = constants[inst.arg]; break;
+            case MP_OP_PUSH_VAR: d[-1] = top; top = vm->vars[inst.arg];  break;
+            case MP_OP_ADD:      top = d[0] + top;                      break;
+            case MP_OP_SUB:      top = d[0] - top;                      break;
+            case MP_OP_MUL:      top = d[0] * top;                      break;
+            case MP_OP_DIV:      top = d[0] / top;                      break;
+            case MP_OP_POW:      top = pow(d[0], top);                  break;
+            case MP_OP_POWI:     top = mp_powi(top, inst.arg);          break;
+            case MP_OP_NEG:      top = -top;                            break;
+            case MP_OP_LN:       top = log(top);                        break;
+            case MP_OP_LOG:      top = log10(top);                      break;
+            case MP_OP_SIN:      top = sin(top);                        break;
+            case MP_OP_COS:      top = cos(top);                        break;
+            case MP_OP_TAN:      top = tan(top);                        break;
+            case MP_OP_SQRT:     top = sqrt(top);                       break;
+            default:             return false;
+        }
+    }
+
+    r[0] = top;
+    return true;
+}
+
+bool mp_vm_run_batch(MP_Vm *vm, char var, const double *xs, double *ys,
+                     size_t n)
+{
+    if (vm == NULL)
+        return false;
+
+    for (size_t offset = 0; offset < n; offset += MP_BATCH_CAPACITY) {
+        size_t count = n - offset;
+        if (count > MP_BATCH_CAPACITY)
+            count = MP_BATCH_CAPACITY;
+
+        if (!mp_vm_run_block(vm, var, xs + offset, ys + offset, count))
+            return false;
+    }
+
+    return true;
+}
+
+// Runs the program once over up to MP_BATCH_CAPACITY inputs. Every stack slot
+// holds a whole block of values, so each opcode is dispatched once per block
+// instead of once per input.
+bool mp_vm_run_block(MP_Vm *vm, char var, const double *xs, double *ys,
+                     size_t n)
+{
+    if (vm == NULL || !vm->verified)
+        return false;
+
+    assert(n <= MP_BATCH_CAPACITY);
+    assert('a' <= var && var <= 'z');
+
+    if (vm->blocks == NULL) {
+        size_t slots = vm->program.register_count * MP_BATCH_CAPACITY;
+        vm->blocks = MP_ALIGNED_ALLOC(64, slots * sizeof(*vm->blocks));
+        if (vm->blocks == NULL)
+            return false;
+    }
+
+    const MP_Instruction *code = vm->program.code.items;
+    const double *constants = vm->program.constants.items;
+    size_t count = vm->program.code.count;
+    const MP_Simd_Kernels *k = vm->simd;
+
+    // The kernels work on whole vectors, so the blocks are padded with zeros
+    size_t padded = (n + MP_SIMD_LANES - 1) / MP_SIMD_LANES * MP_SIMD_LANES;
+
+    for (size_t ip = 0; ip < count; ++ip) {
+        MP_Instruction inst = code[ip];
+        double *a = vm->blocks + (size_t)inst.dst * MP_BATCH_CAPACITY;
+        double *b = a + MP_BATCH_CAPACITY;
+
+        switch (inst.op) {
+            case MP_OP_PUSH_NUM: {
+                double value = constants[inst.arg];
+                for (size_t i = 0; i < padded; ++i) a[i] = value;
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                if (inst.arg == (uint32_t)(var - 'a')) {
+                    memcpy(a, xs, n * sizeof(*a));
+                    for (size_t i = n; i < padded; ++i) a[i] = 0.0;
+                } else {
+                    double value = vm->vars[inst.arg];
+                    for (size_t i = 0; i < padded; ++i) a[i] = value;
+                }
+            } break;
+
+            case MP_OP_ADD:  k->add(a, b, padded); break;
+            case MP_OP_SUB:  k->sub(a, b, padded); break;
+            case MP_OP_MUL:  k->mul(a, b, padded); break;
+            case MP_OP_DIV:  k->div(a, b, padded); break;
+            case MP_OP_POW:  for (size_t i = 0; i < n; ++i) a[i] = pow(a[i], b[i]);        break;
+            case MP_OP_POWI: for (size_t i = 0; i < n; ++i) a[i] = mp_powi(a[i], inst.arg); break;
+            case MP_OP_NEG:  for (size_t i = 0; i < padded; ++i) a[i] = -a[i];             break;
+            case MP_OP_LN:   k->ln(a, padded);   break;
+            case MP_OP_LOG:  k->log(a, padded);  break;
+            case MP_OP_SIN:  k->sin(a, padded);  break;
+            case MP_OP_COS:  k->cos(a, padded);  break;
+            case MP_OP_TAN:  k->tan(a, padded);  break;
+            case MP_OP_SQRT: k->sqrt(a, padded); break;
+            default:         return false;
+        }
+    }
+
+    memcpy(ys, vm->blocks, n * sizeof(*ys));
+
+    return true;
+}
+
+double mp_vm_result(MP_Vm *vm)
+{
+    if (vm == NULL || !vm->verified)
+        return 0.0;
+
+    return vm->registers[1];
+}
+
+double mp_powi(double base, int32_t exponent)
+{
+    uint32_t e = exponent < 0 ? -(uint32_t)exponent : (uint32_t)exponent;
+    double result = 1.0;
+
+    while (e > 0) {
+        if (e & 1)
+            result *= base;
+        base *= base;
+        e >>= 1;
+    }
+
+    return exponent < 0 ? 1.0 / result : result;
+}
+
+void mp_vm_free(MP_Vm *vm)
+{
+    if (vm == NULL)
+        return;
+
+    MP_FREE(vm->registers);
+    MP_FREE(vm->blocks);
+    vm->registers = NULL;
+    vm->blocks = NULL;
+    vm->verified = false;
+    mp_program_free(&vm->program);
+}
+
+//-----
+// JIT
+//-----
+
+#ifdef MP_JIT
+
+#include <sys/mman.h>
+
+#define mp_jit_bytes(c, ...)                                         \
+    do {                                                             \
+        const uint8_t bytes_[] = {__VA_ARGS__};                      \
+        for (size_t i_ = 0; i_ < sizeof(bytes_); ++i_)               \
+            mp_da_append((c), bytes_[i_]);                           \
+    } while (0)
+
+static void mp_jit_u32(MP_Jit_Code *c, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        mp_da_append(c, (uint8_t)(value >> (8 * i)));
+}
+
+static void mp_jit_u64(MP_Jit_Code *c, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        mp_da_append(c, (uint8_t)(value >> (8 * i)));
+}
+
+// call imm64 through rax
+static void mp_jit_call(MP_Jit_Code *c, uint64_t address)
+{
+    mp_jit_bytes(c, 0x48, 0xB8); // mov rax, imm64
+    mp_jit_u64(c, address);
+    mp_jit_bytes(c, 0xFF, 0xD0); // call rax
+}
+
+// op xmm, [rsp + 8*slot] with the ModRM byte selecting the xmm register
+static void mp_jit_slot(MP_Jit_Code *c, uint8_t prefix, uint8_t op,
+                        uint8_t modrm, size_t slot)
+{
+    mp_jit_bytes(c, prefix, 0x0F, op, modrm, 0x24);
+    mp_jit_u32(c, (uint32_t)(slot * sizeof(double)));
+}
+
+#endif // MP_JIT
+
+// Emits the same computation as mp_vm_run: the top of the stack lives in
+// xmm0 and the slots below it in the stack frame, rbx holds the variables.
+// xmm0 is also where the math functions take and return their argument.
+bool mp_jit_emit(MP_Jit_Code *c, const MP_Program *p)
+{
+#ifdef MP_JIT
+    if (c == NULL || !mp_program_verify(p))
+        return false;
+
+    // After pushing rbx the stack is 16 byte aligned, keep it that way for calls
+    uint32_t frame = (uint32_t)((p->register_count * sizeof(double) + 15) & ~(size_t)15);
+
+    mp_jit_bytes(c, 0x53);                   // push rbx
+    mp_jit_bytes(c, 0x48, 0x89, 0xFB);       // mov rbx, rdi
+    mp_jit_bytes(c, 0x48, 0x81, 0xEC);       // sub rsp, imm32
+    mp_jit_u32(c, frame);
+
+    for (size_t ip = 0; ip < p->code.count; ++ip) {
+        MP_Instruction inst = p->code.items[ip];
+
+        // Pushes spill the current top into its slot first
+        if ((inst.op == MP_OP_PUSH_NUM || inst.op == MP_OP_PUSH_VAR) &&
+            inst.dst > 0) {
+            mp_jit_slot(c, 0xF2, 0x11, 0x84, inst.dst - 1); // movsd [slot], xmm0
+        }
+
+        switch (inst.op) {
+            case MP_OP_PUSH_NUM: {
+                uint64_t bits;
+                memcpy(&bits, &p->constants.items[inst.arg], sizeof(bits));
+                mp_jit_bytes(c, 0x48, 0xB8);                   // mov rax, imm64
+                mp_jit_u64(c, bits);
+                mp_jit_bytes(c, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                mp_jit_bytes(c, 0xF2, 0x0F, 0x10, 0x83);       // movsd xmm0, [rbx + disp32]
+                mp_jit_u32(c, inst.arg * sizeof(double));
+            } break;
+
+            case MP_OP_ADD: {
+                mp_jit_slot(c, 0xF2, 0x58, 0x84, inst.dst);   // addsd xmm0, [slot]
+            } break;
+
+            case MP_OP_MUL: {
+                mp_jit_slot(c, 0xF2, 0x59, 0x84, inst.dst);   // mulsd xmm0, [slot]
+            } break;
+
+            case MP_OP_SUB:
+            case MP_OP_DIV: {
+                uint8_t op = inst.op == MP_OP_SUB ? 0x5C : 0x5E;
+                mp_jit_slot(c, 0xF2, 0x10, 0x8C, inst.dst);   // movsd xmm1, [slot]
+                mp_jit_bytes(c, 0xF2, 0x0F, op, 0xC8);         // subsd/divsd xmm1, xmm0
+                mp_jit_bytes(c, 0x66, 0x0F, 0x28, 0xC1);       // movapd xmm0, xmm1
+            } break;
+
+            case MP_OP_POW: {
+                mp_jit_bytes(c, 0x66, 0x0F, 0x28, 0xC8);       // movapd xmm1, xmm0
+                mp_jit_slot(c, 0xF2, 0x10, 0x84, inst.dst);   // movsd xmm0, [slot]
+                mp_jit_call(c, (uint64_t)(uintptr_t)&pow);
+            } break;
+
+            case MP_OP_POWI: {
+                mp_jit_bytes(c, 0xBF);                         // mov edi, imm32
+                mp_jit_u32(c, inst.arg);
+                mp_jit_call(c, (uint64_t)(uintptr_t)&mp_powi);
+            } break;
+
+            case MP_OP_NEG: {
+                mp_jit_bytes(c, 0x48, 0xB8);                   // mov rax, imm64
+                mp_jit_u64(c, 0x8000000000000000);
+                mp_jit_bytes(c, 0x66, 0x48, 0x0F, 0x6E, 0xC8); // movq xmm1, rax
+                mp_jit_bytes(c, 0x66, 0x0F, 0x57, 0xC1);       // xorpd xmm0, xmm1
+            } break;
+
+            case MP_OP_SQRT: {
+                mp_jit_bytes(c, 0xF2, 0x0F, 0x51, 0xC0);       // sqrtsd xmm0, xmm0
+            } break;
+
+            case MP_OP_LN:  mp_jit_call(c, (uint64_t)(uintptr_t)&log);   break;
+            case MP_OP_LOG: mp_jit_call(c, (uint64_t)(uintptr_t)&log10); break;
+            case MP_OP_SIN: mp_jit_call(c, (uint64_t)(uintptr_t)&sin);   break;
+            case MP_OP_COS: mp_jit_call(c, (uint64_t)(uintptr_t)&cos);   break;
+            case MP_OP_TAN: mp_jit_call(c, (uint64_t)(uintptr_t)&tan);   break;
+
+            default: {
+                return false;
+            } break;
+        }
+    }
+
+    mp_jit_bytes(c, 0x48, 0x81, 0xC4);       // add rsp, imm32
+    mp_jit_u32(c, frame);
+    mp_jit_bytes(c, 0x5B);                   // pop rbx
+    mp_jit_bytes(c, 0xC3);                   // ret
+
+    return true;
+#else
+    (void) c;
+    (void) p;
+    return false;
+#endif // MP_JIT
+}
+
+// Maps the emitted code read-write, copies it in and flips the mapping to
+// read-execute, so no page is ever writable and executable at once
+bool mp_jit_compile(MP_Jit *jit)
+{
+#ifdef MP_JIT
+    if (jit == NULL || !jit->vm.verified)
+        return false;
+
+    MP_Jit_Code c = {0};
+    if (!mp_jit_emit(&c, &jit->vm.program)) {
+        mp_da_free(&c);
+        return false;
+    }
+
+    void *code = mmap(NULL, c.count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        mp_da_free(&c);
+        return false;
+    }
+
+    memcpy(code, c.items, c.count);
+    size_t size = c.count;
+    mp_da_free(&c);
+
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        return false;
+    }
+
+    jit->code = code;
+    jit->code_size = size;
+    jit->fn = (MP_Jit_Fn)code;
+    return true;
+#else
+    (void) jit;
+    return false;
+#endif // MP_JIT
+}
+
+// The VM is always initialized, if native code cannot be generated the JIT
+// keeps working through it
+MP_Jit mp_jit_init(MP_Program program)
+{
+    MP_Jit jit = {0};
+    jit.vm = mp_vm_init(program);
+    mp_jit_compile(&jit);
+    return jit;
+}
+
+bool mp_jit_run(MP_Jit *jit, double *result)
+{
+    if (jit == NULL || !jit->vm.verified)
+        return false;
+
+    if (jit->fn != NULL) {
+        *result = jit->fn(jit->vm.vars);
+        return true;
+    }
+
+    if (!mp_vm_run(&jit->vm))
+        return false;
+
+    *result = mp_vm_result(&jit->vm);
+    return true;
+}
+
+void mp_jit_free(MP_Jit *jit)
+{
+    if (jit == NULL)
+        return;
+
+#ifdef MP_JIT
+    if (jit->code != NULL)
+        munmap(jit->code, jit->code_size);
+#endif // MP_JIT
+
+    jit->code = NULL;
+    jit->code_size = 0;
+    jit->fn = NULL;
+    mp_vm_free(&jit->vm);
+}
+
+//----------
+// Interval
+//----------
+
+// The bounds are rounded outwards by moving them an ulp away from the result
+// rounded to nearest, which covers the rounding of the arithmetic and the
+// error of libm (within an ulp of the exact value). Changing the rounding
+// mode of the FPU would be tighter, but much slower.
+
+static double mp_next_down(double value)
+{
+    if (isnan(value) || value == -INFINITY)
+        return value;
+    if (value == 0.0)
+        return -DBL_TRUE_MIN;
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits += value > 0.0 ? -1 : 1;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static double mp_next_up(double value)
+{
+    return -mp_next_down(-value);
+}
+
+// fmin and fmax are library calls, and the bounds are never NaN here
+static double mp_min(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+static double mp_max(double a, double b)
+{
+    return a > b ? a : b;
+}
+
+static void mp_interval_mul_corner(MP_Interval *y, double a, double b)
+{
+    // 0 * inf is 0 here: the infinite bound is never reached. A product with
+    // zero is exact.
+    if (a == 0.0 || b == 0.0) {
+        y->lo = mp_min(y->lo, 0.0);
+        y->hi = mp_max(y->hi, 0.0);
+        return;
+    }
+
+    double p = a * b;
+    y->lo = mp_min(y->lo, mp_next_down(p));
+    y->hi = mp_max(y->hi, mp_next_up(p));
+}
+
+static void mp_interval_div_corner(MP_Interval *y, double a, double b)
+{
+    double q = a / b;
+    if (isnan(q)) { // inf / inf
+        y->lo = -INFINITY;
+        y->hi = INFINITY;
+        return;
+    }
+
+    y->lo = mp_min(y->lo, mp_next_down(q));
+    y->hi = mp_max(y->hi, mp_next_up(q));
+}
+
+// Whether phase + k*period is in [lo, hi] for some integer k. The reduction
+// is not exact, so the test answers yes when in doubt.
+static bool mp_interval_has_phase(double lo, double hi, double phase,
+                                  double period)
+{
+    double tolerance = 1e-15 * (1.0 + fabs(hi));
+    double k = floor((hi - phase) / period);
+    double t = phase + k * period;
+    return t >= lo - tolerance || t + period <= hi + tolerance;
+}
+
+// sin and cos over x, given where their maxima and minima are
+static MP_Interval mp_interval_wave(MP_Interval x, double (*f)(double),
+                                    double max_phase, double min_phase)
+{
+    MP_Interval y = x;
+    y.lo = -1.0;
+    y.hi = 1.0;
+
+    // Past 2^30 the reduction is too coarse to place the extremes
+    if (!(fabs(x.lo) <= 0x1p30 && fabs(x.hi) <= 0x1p30) ||
+        x.hi - x.lo >= 2.0 * MP_PI)
+        return y;
+
+    double a = f(x.lo);
+    double b = f(x.hi);
+    if (!mp_interval_has_phase(x.lo, x.hi, min_phase, 2.0 * MP_PI))
+        y.lo = mp_max(mp_next_down(mp_min(a, b)), -1.0);
+    if (!mp_interval_has_phase(x.lo, x.hi, max_phase, 2.0 * MP_PI))
+        y.hi = mp_min(mp_next_up(mp_max(a, b)), 1.0);
+
+    return y;
+}
+
+// x^exponent like the VM computes it: POWI multiplies, larger exponents are
+// left to pow
+static double mp_pow_unsigned(double x, uint32_t exponent)
+{
+    if (exponent <= MP_POWI_MAX)
+        return mp_powi(x, (int32_t)exponent);
+    return pow(x, (double)exponent);
+}
+
+// Integer powers without the sign of the exponent, which are monotonic on
+// either side of zero. The bounds leave room for the rounding of both pow and
+// mp_powi, whose squarings double the relative error each time.
+static MP_Interval mp_interval_powu(MP_Interval x, uint32_t exponent)
+{
+    MP_Interval y = x;
+    double slack = (double)exponent * DBL_EPSILON;
+
+    if (exponent % 2 == 1) {
+        y.lo = mp_pow_unsigned(x.lo, exponent);
+        y.hi = mp_pow_unsigned(x.hi, exponent);
+    } else {
+        double lo = fabs(x.lo);
+        double hi = fabs(x.hi);
+        bool zero = x.lo <= 0.0 && x.hi >= 0.0;
+        y.lo = zero ? 0.0 : mp_pow_unsigned(mp_min(lo, hi), exponent);
+        y.hi = mp_pow_unsigned(mp_max(lo, hi), exponent);
+    }
+
+    y.lo = mp_next_down(y.lo - fabs(y.lo) * slack);
+    y.hi = mp_next_up(y.hi + fabs(y.hi) * slack);
+    if (exponent % 2 == 0)
+        y.lo = mp_max(y.lo, 0.0);
+    return y;
+}
+
+// The exponent n when the subtree is a product of var with itself, which the
+// optimizer makes out of var^2 and var^3, and 0 otherwise. Multiplying the
+// two factors as independent intervals would bound x*x over [-1, 2] with
+// [-2, 4] instead of [0, 4].
+static int32_t mp_node_var_power(const MP_Tree_Node *node, char var)
+{
+    if (node == NULL)
+        return 0;
+
+    if (node->type == MP_NODE_SYMBOL)
+        return node->symbol == var ? 1 : 0;
+
+    if (node->type == MP_NODE_MULTIPLY) {
+        int32_t a = mp_node_var_power(node->binop.lhs, var);
+        int32_t b = mp_node_var_power(node->binop.rhs, var);
+        if (a > 0 && b > 0 && a + b <= MP_POWI_MAX)
+            return a + b;
+    }
+
+    return 0;
+}
+
+// An interval with NaN or reversed bounds is empty
+MP_Interval mp_interval(double lo, double hi)
+{
+    if (!(lo <= hi))
+        return mp_interval_empty();
+
+    MP_Interval x = {lo, hi, true, true};
+    return x;
+}
+
+// The result of an expression that is defined nowhere in the interval
+MP_Interval mp_interval_empty(void)
+{
+    MP_Interval x = {INFINITY, -INFINITY, false, false};
+    return x;
+}
+
+bool mp_interval_is_empty(MP_Interval x)
+{
+    return !(x.lo <= x.hi);
+}
+
+MP_Interval mp_interval_unary(MP_Opcode op, MP_Interval x)
+{
+    if (mp_interval_is_empty(x))
+        return x;
+
+    MP_Interval y = x;
+
+    switch (op) {
+        case MP_OP_NEG: {
+            y.lo = -x.hi;
+            y.hi = -x.lo;
+        } break;
+
+        case MP_OP_LN:
+        case MP_OP_LOG: {
+            double (*f)(double) = op == MP_OP_LN ? log : log10;
+            if (x.hi < 0.0)
+                return mp_interval_empty();
+
+            // Unbounded towards the end of the domain, which is a pole
+            if (x.lo <= 0.0) {
+                y.defined = false;
+                y.continuous = false;
+                y.lo = -INFINITY;
+            } else {
+                y.lo = mp_next_down(f(x.lo));
+            }
+            y.hi = mp_next_up(f(x.hi));
+        } break;
+
+        case MP_OP_SQRT: {
+            if (x.hi < 0.0)
+                return mp_interval_empty();
+
+            // Goes to 0 at the end of the domain, still continuous
+            if (x.lo < 0.0) {
+                y.defined = false;
+                y.lo = 0.0;
+            } else {
+                y.lo = mp_max(mp_next_down(sqrt(x.lo)), 0.0);
+            }
+            y.hi = mp_next_up(sqrt(x.hi));
+        } break;
+
+        case MP_OP_SIN: {
+            y = mp_interval_wave(x, sin, MP_PI / 2.0, -MP_PI / 2.0);
+        } break;
+
+        case MP_OP_COS: {
+            y = mp_interval_wave(x, cos, 0.0, MP_PI);
+        } break;
+
+        case MP_OP_TAN: {
+            // Increasing between the poles at pi/2 + k*pi
+            if (!(fabs(x.lo) <= 0x1p30 && fabs(x.hi) <= 0x1p30) ||
+                x.hi - x.lo >= MP_PI ||
+                mp_interval_has_phase(x.lo, x.hi, MP_PI / 2.0, MP_PI)) {
+                y.lo = -INFINITY;
+                y.hi = INFINITY;
+                y.defined = false;
+                y.continuous = false;
+            } else {
+                y.lo = mp_next_down(tan(x.lo));
+                y.hi = mp_next_up(tan(x.hi));
+            }
+        } break;
+
+        default: {
+            assert(false && "Unreachable unary MP_Opcode");
+        } break;
+    }
+
+    if (isnan(y.lo)) y.lo = -INFINITY;
+    if (isnan(y.hi)) y.hi = INFINITY;
+    return y;
+}
+
+MP_Interval mp_interval_binary(MP_Opcode op, MP_Interval a, MP_Interval b)
+{
+    if (mp_interval_is_empty(a) || mp_interval_is_empty(b))
+        return mp_interval_empty();
+
+    MP_Interval y = {INFINITY, -INFINITY, a.defined && b.defined,
+                     a.continuous && b.continuous};
+
+    switch (op) {
+        case MP_OP_ADD: {
+            y.lo = mp_next_down(a.lo + b.lo);
+            y.hi = mp_next_up(a.hi + b.hi);
+        } break;
+
+        case MP_OP_SUB: {
+            y.lo = mp_next_down(a.lo - b.hi);
+            y.hi = mp_next_up(a.hi - b.lo);
+        } break;
+
+        case MP_OP_MUL: {
+            mp_interval_mul_corner(&y, a.lo, b.lo);
+            mp_interval_mul_corner(&y, a.lo, b.hi);
+            mp_interval_mul_corner(&y, a.hi, b.lo);
+            mp_interval_mul_corner(&y, a.hi, b.hi);
+        } break;
+
+        case MP_OP_DIV: {
+            if (b.lo > 0.0 || b.hi < 0.0) {
+                mp_interval_div_corner(&y, a.lo, b.lo);
+                mp_interval_div_corner(&y, a.lo, b.hi);
+                mp_interval_div_corner(&y, a.hi, b.lo);
+                mp_interval_div_corner(&y, a.hi, b.hi);
+                break;
+            }
+
+            // The divisor reaches zero, so there is a pole or a hole
+            if (b.lo == 0.0 && b.hi == 0.0)
+                return mp_interval_empty();
+
+            y.defined = false;
+            y.continuous = false;
+            if (b.lo < 0.0 && b.hi > 0.0) {
+                y.lo = -INFINITY;
+                y.hi = INFINITY;
+                break;
+            }
+
+            // 1/b is unbounded on one side only
+            MP_Interval r = {INFINITY, -INFINITY, false, false};
+            if (b.lo == 0.0) {
+                mp_interval_div_corner(&r, 1.0, b.hi);
+                r.hi = INFINITY;
+            } else {
+                mp_interval_div_corner(&r, 1.0, b.lo);
+                r.lo = -INFINITY;
+            }
+            mp_interval_mul_corner(&y, a.lo, r.lo);
+            mp_interval_mul_corner(&y, a.lo, r.hi);
+            mp_interval_mul_corner(&y, a.hi, r.lo);
+            mp_interval_mul_corner(&y, a.hi, r.hi);
+        } break;
+
+        case MP_OP_POW: {
+            // A constant integer exponent, like the compiler turns into POWI
+            if (b.lo == b.hi && b.lo == floor(b.lo) && fabs(b.lo) <= INT32_MAX) {
+                MP_Interval p = mp_interval_powi(a, (int32_t)b.lo);
+                p.defined = p.defined && b.defined;
+                p.continuous = p.continuous && b.continuous;
+                return p;
+            }
+
+            // Negative bases are only defined for integer exponents, which a
+            // range of exponents only hits here and there. A constant one
+            // only cuts off the negative part, like sqrt.
+            if (a.lo < 0.0) {
+                y.defined = false;
+                if (b.lo != b.hi) {
+                    y.continuous = false;
+                    y.lo = -INFINITY;
+                    y.hi = INFINITY;
+                    break;
+                }
+                if (a.hi < 0.0)
+                    return mp_interval_empty();
+                a.lo = 0.0;
+            }
+
+            // 0^b has a pole for b < 0 and jumps at b = 0
+            if (a.lo == 0.0 && b.lo <= 0.0 && !(b.lo == 0.0 && b.hi == 0.0)) {
+                y.continuous = false;
+                if (b.lo < 0.0)
+                    y.defined = false;
+            }
+
+            // For a >= 0, a^b is monotonic in each argument, so the bounds
+            // are in the corners
+            double corners[4] = {
+                pow(a.lo, b.lo), pow(a.lo, b.hi), pow(a.hi, b.lo), pow(a.hi, b.hi)
+            };
+            for (size_t i = 0; i < 4; ++i) {
+                y.lo = mp_min(y.lo, corners[i]);
+                y.hi = mp_max(y.hi, corners[i]);
+            }
+            y.lo = mp_max(mp_next_down(y.lo), 0.0);
+            y.hi = mp_next_up(y.hi);
+        } break;
+
+        default: {
+            assert(false && "Unreachable binary MP_Opcode");
         } break;
     }
 
-    return true;
+    if (isnan(y.lo)) y.lo = -INFINITY;
+    if (isnan(y.hi)) y.hi = INFINITY;
+    return y;
 }
 
-void mp_program_push_opcode(MP_Program *p, MP_Opcode op)
+MP_Interval mp_interval_powi(MP_Interval x, int32_t exponent)
 {
-    if (p == NULL)
-        return;
+    if (mp_interval_is_empty(x))
+        return x;
+
+    if (exponent == 0) {
+        MP_Interval y = x;
+        y.lo = 1.0;
+        y.hi = 1.0;
+        return y;
+    }
 
-    mp_da_append(p, op);
+    if (exponent > 0)
+        return mp_interval_powu(x, (uint32_t)exponent);
+
+    MP_Interval one = mp_interval(1.0, 1.0);
+    return mp_interval_binary(MP_OP_DIV, one,
+                              mp_interval_powu(x, -(uint32_t)exponent));
 }
 
-void mp_program_push_const(MP_Program *p, double value)
+// Bounds the subtree while var ranges over x. The other symbols are the values
+// set with mp_interpreter_var. Like in the batch interpreter, dividing by zero
+// is not an error, it only leaves the result undefined.
+MP_Result mp_interpret_interval(MP_Interpreter *interpreter, MP_Tree_Node *root,
+                                char var, MP_Interval x, MP_Interval *y)
 {
-    if (p == NULL)
-        return;
+    MP_Result result = {0};
 
-    for (size_t i = 0; i < sizeof(value); ++i) {
-        mp_da_append(p, 0);
+    if (root == NULL) {
+        result.error = true;
+        result.error_type = MP_ERROR_INVALID_NODE;
+        return result;
     }
-    double *loc = (double*)((p->items + p->count) - sizeof(*loc));
-    *loc = value;
-}
 
-void mp_program_push_var(MP_Program *p, char var)
-{
-    if (p == NULL)
-        return;
+    switch (root->type) {
+        case MP_NODE_NUMBER: {
+            *y = mp_interval(root->value, root->value);
+        } break;
+
+        case MP_NODE_SYMBOL: {
+            assert('a' <= root->symbol && root->symbol <= 'z');
+            if (root->symbol == var) {
+                *y = x;
+            } else {
+                double value = interpreter->vars[root->symbol - 'a'];
+                *y = mp_interval(value, value);
+            }
+        } break;
+
+        case MP_NODE_FUNCTION: {
+            MP_Interval arg;
+            result = mp_interpret_interval(interpreter, root->function.arg,
+                                           var, x, &arg);
+            if (result.error) return result;
 
-    mp_da_append(p, var);
+            MP_Opcode op = MP_OP_INVALID;
+            switch (root->function.name) {
+                case MP_FUNCTION_LN:   op = MP_OP_LN;   break;
+                case MP_FUNCTION_LOG:  op = MP_OP_LOG;  break;
+                case MP_FUNCTION_SIN:  op = MP_OP_SIN;  break;
+                case MP_FUNCTION_COS:  op = MP_OP_COS;  break;
+                case MP_FUNCTION_TAN:  op = MP_OP_TAN;  break;
+                case MP_FUNCTION_SQRT: op = MP_OP_SQRT; break;
+                default: {
+                    result.error = true;
+                    result.error_type = MP_ERROR_INVALID_FUNCTION;
+                    return result;
+                }
+            }
+
+            *y = mp_interval_unary(op, arg);
+        } break;
+
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER: {
+            int32_t power = mp_node_var_power(root, var);
+            if (power > 1) {
+                *y = mp_interval_powi(x, power);
+                break;
+            }
+
+            MP_Interval a;
+            result = mp_interpret_interval(interpreter, root->binop.lhs, var, x, &a);
+            if (result.error) return result;
+            MP_Interval b;
+            result = mp_interpret_interval(interpreter, root->binop.rhs, var, x, &b);
+            if (result.error) return result;
+
+            MP_Opcode op = MP_OP_POW;
+            switch (root->type) {
+                case MP_NODE_ADD:      op = MP_OP_ADD; break;
+                case MP_NODE_SUBTRACT: op = MP_OP_SUB; break;
+                case MP_NODE_MULTIPLY: op = MP_OP_MUL; break;
+                case MP_NODE_DIVIDE:   op = MP_OP_DIV; break;
+                default:                               break;
+            }
+
+            *y = mp_interval_binary(op, a, b);
+        } break;
+
+        case MP_NODE_PLUS: {
+            result = mp_interpret_interval(interpreter, root->unary.node, var, x, y);
+        } break;
+
+        case MP_NODE_MINUS: {
+            MP_Interval n;
+            result = mp_interpret_interval(interpreter, root->unary.node, var, x, &n);
+            if (result.error) return result;
+            *y = mp_interval_unary(MP_OP_NEG, n);
+        } break;
+
+        case MP_NODE_INVALID:
+        default: {
+            result.error = true;
+            result.error_type = MP_ERROR_INVALID_NODE;
+        } break;
+    }
+
+    return result;
 }
 
-void mp_print_program(MP_Program p)
+// A register of the interval VM. Like mp_node_var_power, power is n when the
+// register holds var^n for a positive n and 0 otherwise.
+typedef struct {
+    MP_Interval value;
+    int32_t power;
+} MP_Interval_Register;
+
+// Runs the program on intervals instead of numbers, with var ranging over x
+// and the other variables set with mp_vm_var
+bool mp_vm_run_interval(MP_Vm *vm, char var, MP_Interval x, MP_Interval *y)
 {
-    size_t ip = 0;
-    for (size_t i = 0; i < p.count; ++i) {
-        MP_Opcode op = p.items[i];
+    if (vm == NULL || !vm->verified)
+        return false;
 
-        switch (op) {
-            case MP_OP_PUSH_NUM: {
-                printf("%ld: PUSH_NUM ", ip++);
-                double num = 0.0;
+    assert('a' <= var && var <= 'z');
 
-                if (i + sizeof(num) >= p.count)
-                    continue;
+    const MP_Instruction *code = vm->program.code.items;
+    const double *constants = vm->program.constants.items;
+    size_t count = vm->program.code.count;
+
+    MP_Interval_Register stack[MP_INTERVAL_REGISTERS];
+    MP_Interval_Register *r = stack;
+    if (vm->program.register_count > MP_INTERVAL_REGISTERS) {
+        r = MP_MALLOC(vm->program.register_count * sizeof(*r));
+        if (r == NULL)
+            return false;
+    }
 
-                ++i;
-                num = *(double*)&p.items[i];
-                i += sizeof(num) - 1;
+    bool ok = true;
+    for (size_t ip = 0; ip < count && ok; ++ip) {
+        MP_Instruction inst = code[ip];
+        MP_Interval_Register *d = r + inst.dst;
 
-                printf("%f\n", num);
+        switch (inst.op) {
+            case MP_OP_PUSH_NUM: {
+                double value = constants[inst.arg];
+                d->value = mp_interval(value, value);
+                d->power = 0;
             } break;
 
             case MP_OP_PUSH_VAR: {
-                printf("%ld: PUSH_VAR ", ip++);
-                char var = 0;
+                double value = vm->vars[inst.arg];
+                bool is_var = inst.arg == (uint32_t)(var - 'a');
+                d->value = is_var ? x : mp_interval(value, value);
+                d->power = is_var ? 1 : 0;
+            } break;
+
+            case MP_OP_MUL: {
+                int32_t power = d[0].power + d[1].power;
+                if (d[0].power > 0 && d[1].power > 0 && power <= MP_POWI_MAX) {
+                    d->value = mp_interval_powi(x, power);
+                    d->power = power;
+                    break;
+                }
+
+                d->value = mp_interval_binary(inst.op, d[0].value, d[1].value);
+                d->power = 0;
+            } break;
 
-                if (i + sizeof(var) >= p.count)
-                    continue;
+            case MP_OP_ADD:
+            case MP_OP_SUB:
+            case MP_OP_DIV:
+            case MP_OP_POW: {
+                d->value = mp_interval_binary(inst.op, d[0].value, d[1].value);
+                d->power = 0;
+            } break;
 
-                ++i;
-                var = p.items[i] + 'a';
-                // i += sizeof(var) - 1; // Increment by 0
+            case MP_OP_POWI: {
+                int32_t exponent = (int32_t)inst.arg;
+                int32_t power = d->power * exponent;
+                if (d->power > 0 && exponent > 0 && power <= MP_POWI_MAX) {
+                    d->value = mp_interval_powi(x, power);
+                    d->power = power;
+                    break;
+                }
 
-                printf("%c\n", var);
+                d->value = mp_interval_powi(d->value, exponent);
+                d->power = 0;
             } break;
 
-            case MP_OP_ADD: printf("%ld: ADD\n", ip++); break;
-            case MP_OP_SUB: printf("%ld: SUB\n", ip++); break;
-            case MP_OP_MUL: printf("%ld: MUL\n", ip++); break;
-            case MP_OP_DIV: printf("%ld: DIV\n", ip++); break;
-            case MP_OP_POW: printf("%ld: POW\n", ip++); break;
-            case MP_OP_NEG: printf("%ld: NEG\n", ip++); break;
+            case MP_OP_NEG:
+            case MP_OP_LN:
+            case MP_OP_LOG:
+            case MP_OP_SIN:
+            case MP_OP_COS:
+            case MP_OP_TAN:
+            case MP_OP_SQRT: {
+                d->value = mp_interval_unary(inst.op, d->value);
+                d->power = 0;
+            } break;
 
             default: {
-                printf("%ld: ?\n", ip++);
+                ok = false;
             } break;
         }
     }
+
+    if (ok)
+        *y = r[0].value;
+    if (r != stack)
+        MP_FREE(r);
+    return ok;
 }
 
-void mp_stack_push(MP_Stack *stack, double n)
+//------------
+// Derivative
+//------------
+
+#define MP_LN10 2.30258509299404568402 // ln(10)
+
+// The builders drop the terms that the rules multiply by a zero derivative,
+// so constant subtrees do not leave dead code behind. Subtrees of the
+// original expression are cloned where they are used, since mp_optimize
+// rewrites nodes in place.
+
+static MP_Tree_Node *mp_diff_neg(MP_Arena *a, MP_Tree_Node *node)
 {
-    if (stack == NULL)
-        return;
+    if (node->type == MP_NODE_NUMBER)
+        return mp_make_node(a, MP_NODE_NUMBER, -node->value);
+    if (node->type == MP_NODE_MINUS)
+        return node->unary.node;
+    return mp_make_node_unary(a, MP_NODE_MINUS, node);
+}
+
+static MP_Tree_Node *mp_diff_add(MP_Arena *a, MP_Tree_Node *lhs, MP_Tree_Node *rhs)
+{
+    if (mp_node_is_number(lhs, 0.0)) return rhs;
+    if (mp_node_is_number(rhs, 0.0)) return lhs;
+    return mp_make_node_binop(a, MP_NODE_ADD, lhs, rhs);
+}
+
+static MP_Tree_Node *mp_diff_sub(MP_Arena *a, MP_Tree_Node *lhs, MP_Tree_Node *rhs)
+{
+    if (mp_node_is_number(rhs, 0.0)) return lhs;
+    if (mp_node_is_number(lhs, 0.0)) return mp_diff_neg(a, rhs);
+    return mp_make_node_binop(a, MP_NODE_SUBTRACT, lhs, rhs);
+}
+
+static MP_Tree_Node *mp_diff_mul(MP_Arena *a, MP_Tree_Node *lhs, MP_Tree_Node *rhs)
+{
+    if (mp_node_is_number(lhs, 0.0)) return lhs;
+    if (mp_node_is_number(rhs, 0.0)) return rhs;
+    if (mp_node_is_number(lhs, 1.0)) return rhs;
+    if (mp_node_is_number(rhs, 1.0)) return lhs;
+    return mp_make_node_binop(a, MP_NODE_MULTIPLY, lhs, rhs);
+}
+
+static MP_Tree_Node *mp_diff_div(MP_Arena *a, MP_Tree_Node *lhs, MP_Tree_Node *rhs)
+{
+    if (mp_node_is_number(lhs, 0.0)) return lhs;
+    return mp_make_node_binop(a, MP_NODE_DIVIDE, lhs, rhs);
+}
+
+// derivative * node, cloning node only if the derivative is not zero
+static MP_Tree_Node *mp_diff_scale(MP_Arena *a, MP_Tree_Node *derivative,
+                                   const MP_Tree_Node *node)
+{
+    if (mp_node_is_number(derivative, 0.0))
+        return derivative;
+    return mp_diff_mul(a, derivative, mp_tree_node_clone(a, node));
+}
+
+static MP_Tree_Node *mp_diff_function(MP_Arena *a, MP_Function name,
+                                      const MP_Tree_Node *arg)
+{
+    MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
+    r->type = MP_NODE_FUNCTION;
+    r->function.name = name;
+    r->function.arg = mp_tree_node_clone(a, arg);
+    return r;
+}
+
+static MP_Tree_Node *mp_diff_power(MP_Arena *a, const MP_Tree_Node *base,
+                                   MP_Tree_Node *exponent)
+{
+    return mp_make_node_binop(a, MP_NODE_POWER, mp_tree_node_clone(a, base),
+                              exponent);
+}
+
+static MP_Tree_Node *mp_differentiate_node(MP_Arena *a, const MP_Tree_Node *node,
+                                           char var)
+{
+    if (node == NULL)
+        return NULL;
+
+    switch (node->type) {
+        case MP_NODE_NUMBER: {
+            return mp_make_node(a, MP_NODE_NUMBER, 0.0);
+        } break;
+
+        case MP_NODE_SYMBOL: {
+            return mp_make_node(a, MP_NODE_NUMBER, node->symbol == var ? 1.0 : 0.0);
+        } break;
+
+        case MP_NODE_FUNCTION: {
+            const MP_Tree_Node *u = node->function.arg;
+            MP_Tree_Node *du = mp_differentiate_node(a, u, var);
+            if (du == NULL || node->function.name <= MP_FUNCTION_INVALID
+                    || node->function.name >= MP_FUNCTION_COUNT)
+                return NULL;
+            if (mp_node_is_number(du, 0.0))
+                return du;
+
+            switch (node->function.name) {
+                // du / u
+                case MP_FUNCTION_LN: {
+                    return mp_diff_div(a, du, mp_tree_node_clone(a, u));
+                } break;
+
+                // du / (u * ln(10))
+                case MP_FUNCTION_LOG: {
+                    return mp_diff_div(a, du, mp_diff_mul(a,
+                            mp_tree_node_clone(a, u),
+                            mp_make_node(a, MP_NODE_NUMBER, MP_LN10)));
+                } break;
+
+                // cos(u) * du
+                case MP_FUNCTION_SIN: {
+                    return mp_diff_mul(a, mp_diff_function(a, MP_FUNCTION_COS, u), du);
+                } break;
+
+                // -sin(u) * du
+                case MP_FUNCTION_COS: {
+                    return mp_diff_neg(a, mp_diff_mul(a,
+                            mp_diff_function(a, MP_FUNCTION_SIN, u), du));
+                } break;
+
+                // du / cos(u)^2
+                case MP_FUNCTION_TAN: {
+                    return mp_diff_div(a, du, mp_make_node_binop(a, MP_NODE_POWER,
+                            mp_diff_function(a, MP_FUNCTION_COS, u),
+                            mp_make_node(a, MP_NODE_NUMBER, 2.0)));
+                } break;
+
+                // du / (2 * sqrt(u))
+                case MP_FUNCTION_SQRT: {
+                    return mp_diff_div(a, du, mp_diff_mul(a,
+                            mp_make_node(a, MP_NODE_NUMBER, 2.0),
+                            mp_diff_function(a, MP_FUNCTION_SQRT, u)));
+                } break;
+
+                default: return NULL;
+            }
+        } break;
+
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER: {
+            const MP_Tree_Node *u = node->binop.lhs;
+            const MP_Tree_Node *v = node->binop.rhs;
+            MP_Tree_Node *du = mp_differentiate_node(a, u, var);
+            if (du == NULL)
+                return NULL;
+            MP_Tree_Node *dv = mp_differentiate_node(a, v, var);
+            if (dv == NULL)
+                return NULL;
+
+            switch (node->type) {
+                case MP_NODE_ADD:      return mp_diff_add(a, du, dv);
+                case MP_NODE_SUBTRACT: return mp_diff_sub(a, du, dv);
+
+                // du * v + dv * u, or n * var^(n - 1) for the products that
+                // the optimizer makes out of var^n
+                case MP_NODE_MULTIPLY: {
+                    int32_t power = mp_node_var_power(node, var);
+                    if (power > 1) {
+                        return mp_diff_mul(a,
+                                mp_make_node(a, MP_NODE_NUMBER, power),
+                                mp_make_node_binop(a, MP_NODE_POWER,
+                                    mp_make_node_symbol(a, var),
+                                    mp_make_node(a, MP_NODE_NUMBER, power - 1)));
+                    }
+
+                    return mp_diff_add(a, mp_diff_scale(a, du, v),
+                                       mp_diff_scale(a, dv, u));
+                } break;
+
+                // (du * v - dv * u) / v^2, or du / v for a constant v
+                case MP_NODE_DIVIDE: {
+                    if (mp_node_is_number(dv, 0.0))
+                        return mp_diff_div(a, du, mp_tree_node_clone(a, v));
+
+                    return mp_diff_div(a,
+                            mp_diff_sub(a, mp_diff_scale(a, du, v),
+                                        mp_diff_scale(a, dv, u)),
+                            mp_diff_power(a, v, mp_make_node(a, MP_NODE_NUMBER, 2.0)));
+                } break;
+
+                default: break;
+            }
+
+            // v * u^(v - 1) * du for a constant exponent, which unlike the
+            // general rule also holds for a negative base
+            if (!mp_node_depends_on(v, var)) {
+                if (mp_node_is_number(du, 0.0))
+                    return du;
+
+                MP_Tree_Node *exponent = v->type == MP_NODE_NUMBER
+                    ? mp_make_node(a, MP_NODE_NUMBER, v->value - 1.0)
+                    : mp_diff_sub(a, mp_tree_node_clone(a, v),
+                                  mp_make_node(a, MP_NODE_NUMBER, 1.0));
+                return mp_diff_mul(a, mp_diff_mul(a, mp_tree_node_clone(a, v),
+                                                  mp_diff_power(a, u, exponent)),
+                                   du);
+            }
+
+            // u^v * ln(u) * dv for a constant base
+            MP_Tree_Node *power = mp_diff_power(a, u, mp_tree_node_clone(a, v));
+            MP_Tree_Node *ln = mp_diff_function(a, MP_FUNCTION_LN, u);
+            if (!mp_node_depends_on(u, var))
+                return mp_diff_mul(a, mp_diff_mul(a, power, ln), dv);
+
+            // u^v * (dv * ln(u) + v * du / u)
+            return mp_diff_mul(a, power, mp_diff_add(a, mp_diff_mul(a, dv, ln),
+                    mp_diff_div(a, mp_diff_scale(a, du, v),
+                                mp_tree_node_clone(a, u))));
+        } break;
+
+        case MP_NODE_PLUS: {
+            return mp_differentiate_node(a, node->unary.node, var);
+        } break;
+
+        case MP_NODE_MINUS: {
+            MP_Tree_Node *d = mp_differentiate_node(a, node->unary.node, var);
+            if (d == NULL)
+                return NULL;
+            return mp_diff_neg(a, d);
+        } break;
+
+        case MP_NODE_INVALID:
+        default: {
+            return NULL;
+        } break;
+    }
+}
+
+// Builds the derivative of the tree with respect to var in the arena and
+// simplifies it with mp_optimize. The tree itself is left untouched. Returns
+// NULL if the tree has an invalid node or function.
+MP_Tree_Node *mp_differentiate(MP_Arena *a, const MP_Tree_Node *root, char var)
+{
+    assert('a' <= var && var <= 'z');
+
+    MP_Tree_Node *derivative = mp_differentiate_node(a, root, var);
+    if (derivative == NULL)
+        return NULL;
 
-    mp_da_append(stack, n);
+    return mp_optimize(a, derivative);
 }
 
-MP_Optional mp_stack_pop(MP_Stack *stack)
+bool mp_node_depends_on(const MP_Tree_Node *node, char var)
 {
-    MP_Optional result = mp_stack_peek(stack);
-    if (result.present) {
-        stack->count--;
+    if (node == NULL)
+        return false;
+
+    switch (node->type) {
+        case MP_NODE_SYMBOL:
+            return node->symbol == var;
+
+        case MP_NODE_FUNCTION:
+            return mp_node_depends_on(node->function.arg, var);
+
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER:
+            return mp_node_depends_on(node->binop.lhs, var)
+                || mp_node_depends_on(node->binop.rhs, var);
+
+        case MP_NODE_PLUS:
+        case MP_NODE_MINUS:
+            return mp_node_depends_on(node->unary.node, var);
+
+        default:
+            return false;
     }
+}
 
-    return result;
+// derivative * value, which is 0 for a zero derivative even if the value
+// is infinite, like the terms mp_differentiate drops
+static double mp_dual_scale(double derivative, double value)
+{
+    return derivative == 0.0 ? 0.0 : derivative * value;
 }
 
-MP_Optional mp_stack_peek(MP_Stack *stack)
+MP_Dual mp_dual_unary(MP_Opcode op, MP_Dual x)
 {
-    MP_Optional result = {0};
-    if (stack == NULL || stack->count == 0) {
-        return result;
+    MP_Dual y = {0};
+    double slope = 0.0;
+
+    switch (op) {
+        case MP_OP_NEG: {
+            y.value = -x.value;
+            slope = -1.0;
+        } break;
+
+        case MP_OP_LN: {
+            y.value = log(x.value);
+            slope = 1.0 / x.value;
+        } break;
+
+        case MP_OP_LOG: {
+            y.value = log10(x.value);
+            slope = 1.0 / (x.value * MP_LN10);
+        } break;
+
+        case MP_OP_SIN: {
+            y.value = sin(x.value);
+            slope = cos(x.value);
+        } break;
+
+        case MP_OP_COS: {
+            y.value = cos(x.value);
+            slope = -sin(x.value);
+        } break;
+
+        case MP_OP_TAN: {
+            y.value = tan(x.value);
+            slope = 1.0 + y.value * y.value;
+        } break;
+
+        case MP_OP_SQRT: {
+            y.value = sqrt(x.value);
+            slope = 0.5 / y.value;
+        } break;
+
+        default: {
+            return (MP_Dual){NAN, NAN};
+        } break;
     }
 
-    result.present = true;
-    result.value = stack->items[stack->count - 1];
-    return result;
+    y.derivative = mp_dual_scale(x.derivative, slope);
+    return y;
+}
+
+MP_Dual mp_dual_binary(MP_Opcode op, MP_Dual a, MP_Dual b)
+{
+    MP_Dual y = {0};
+
+    switch (op) {
+        case MP_OP_ADD: {
+            y.value = a.value + b.value;
+            y.derivative = a.derivative + b.derivative;
+        } break;
+
+        case MP_OP_SUB: {
+            y.value = a.value - b.value;
+            y.derivative = a.derivative - b.derivative;
+        } break;
+
+        case MP_OP_MUL: {
+            y.value = a.value * b.value;
+            y.derivative = mp_dual_scale(a.derivative, b.value)
+                         + mp_dual_scale(b.derivative, a.value);
+        } break;
+
+        case MP_OP_DIV: {
+            y.value = a.value / b.value;
+            y.derivative = (a.derivative - mp_dual_scale(b.derivative, y.value))
+                         / b.value;
+        } break;
+
+        case MP_OP_POW: {
+            y.value = pow(a.value, b.value);
+            if (a.derivative != 0.0)
+                y.derivative += a.derivative * b.value
+                              * pow(a.value, b.value - 1.0);
+            if (b.derivative != 0.0)
+                y.derivative += b.derivative * y.value * log(a.value);
+        } break;
+
+        default: {
+            return (MP_Dual){NAN, NAN};
+        } break;
+    }
+
+    return y;
+}
+
+// The value is the one mp_vm_run computes for POWI
+MP_Dual mp_dual_powi(MP_Dual x, int32_t exponent)
+{
+    MP_Dual y = {mp_powi(x.value, exponent), 0.0};
+    if (x.derivative == 0.0 || exponent == 0)
+        return y;
+
+    double power = exponent > INT32_MIN
+        ? mp_powi(x.value, exponent - 1)
+        : pow(x.value, (double)exponent - 1.0);
+    y.derivative = x.derivative * exponent * power;
+    return y;
 }
 
-MP_Vm mp_vm_init(MP_Program program)
-{
-    MP_Vm vm = {0};
-    vm.program = program;
-    return vm;
+// Evaluates the subtree and its derivative with respect to var at x. Like
+// mp_interpret_interval, dividing by zero is not an error, the result is then
+// infinite or NaN.
+MP_Result mp_interpret_dual(MP_Interpreter *interpreter, MP_Tree_Node *root,
+                            char var, double x, MP_Dual *y)
+{
+    MP_Result result = {0};
+
+    if (root == NULL) {
+        result.error = true;
+        result.error_type = MP_ERROR_INVALID_NODE;
+        return result;
+    }
+
+    switch (root->type) {
+        case MP_NODE_NUMBER: {
+            *y = (MP_Dual){root->value, 0.0};
+        } break;
+
+        case MP_NODE_SYMBOL: {
+            assert('a' <= root->symbol && root->symbol <= 'z');
+            if (root->symbol == var)
+                *y = (MP_Dual){x, 1.0};
+            else
+                *y = (MP_Dual){interpreter->vars[root->symbol - 'a'], 0.0};
+        } break;
+
+        case MP_NODE_FUNCTION: {
+            MP_Dual arg;
+            result = mp_interpret_dual(interpreter, root->function.arg, var, x, &arg);
+            if (result.error) return result;
+
+            MP_Opcode op = MP_OP_INVALID;
+            switch (root->function.name) {
+                case MP_FUNCTION_LN:   op = MP_OP_LN;   break;
+                case MP_FUNCTION_LOG:  op = MP_OP_LOG;  break;
+                case MP_FUNCTION_SIN:  op = MP_OP_SIN;  break;
+                case MP_FUNCTION_COS:  op = MP_OP_COS;  break;
+                case MP_FUNCTION_TAN:  op = MP_OP_TAN;  break;
+                case MP_FUNCTION_SQRT: op = MP_OP_SQRT; break;
+                default: {
+                    result.error = true;
+                    result.error_type = MP_ERROR_INVALID_FUNCTION;
+                    return result;
+                }
+            }
+
+            *y = mp_dual_unary(op, arg);
+        } break;
+
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER: {
+            MP_Dual a;
+            result = mp_interpret_dual(interpreter, root->binop.lhs, var, x, &a);
+            if (result.error) return result;
+            MP_Dual b;
+            result = mp_interpret_dual(interpreter, root->binop.rhs, var, x, &b);
+            if (result.error) return result;
+
+            MP_Opcode op = MP_OP_POW;
+            switch (root->type) {
+                case MP_NODE_ADD:      op = MP_OP_ADD; break;
+                case MP_NODE_SUBTRACT: op = MP_OP_SUB; break;
+                case MP_NODE_MULTIPLY: op = MP_OP_MUL; break;
+                case MP_NODE_DIVIDE:   op = MP_OP_DIV; break;
+                default:                               break;
+            }
+
+            *y = mp_dual_binary(op, a, b);
+        } break;
+
+        case MP_NODE_PLUS: {
+            result = mp_interpret_dual(interpreter, root->unary.node, var, x, y);
+        } break;
+
+        case MP_NODE_MINUS: {
+            MP_Dual n;
+            result = mp_interpret_dual(interpreter, root->unary.node, var, x, &n);
+            if (result.error) return result;
+            *y = mp_dual_unary(MP_OP_NEG, n);
+        } break;
+
+        case MP_NODE_INVALID:
+        default: {
+            result.error = true;
+            result.error_type = MP_ERROR_INVALID_NODE;
+        } break;
+    }
+
+    return result;
 }
 
-void mp_vm_var(MP_Vm *vm, char var, double value)
+// Runs the program on dual numbers, with var set to x and the other
+// variables set with mp_vm_var. The value is the one mp_vm_run computes.
+bool mp_vm_run_dual(MP_Vm *vm, char var, double x, MP_Dual *y)
 {
-    if (vm == NULL)
-        return;
+    if (vm == NULL || !vm->verified)
+        return false;
 
     assert('a' <= var && var <= 'z');
-    vm->vars[var - 'a'] = value;
-}
 
-bool mp_vm_run(MP_Vm *vm)
-{
-#define ASSERT_PRESENT(o) if (!(o).present) return false
-
-    if (vm == NULL)
-        return false;;
+    const MP_Instruction *code = vm->program.code.items;
+    const double *constants = vm->program.constants.items;
+    size_t count = vm->program.code.count;
 
-    MP_Stack *stack = &vm->stack;
-    MP_Program *program = &vm->program;
-    vm->ip = 0;
+    MP_Dual stack[MP_DUAL_REGISTERS];
+    MP_Dual *r = stack;
+    if (vm->program.register_count > MP_DUAL_REGISTERS) {
+        r = MP_MALLOC(vm->program.register_count * sizeof(*r));
+        if (r == NULL)
+            return false;
+    }
 
-    while (vm->ip < program->count) {
-        MP_Opcode op = program->items[vm->ip];
+    bool ok = true;
+    for (size_t ip = 0; ip < count && ok; ++ip) {
+        MP_Instruction inst = code[ip];
+        MP_Dual *d = r + inst.dst;
 
-        switch (op) {
+        switch (inst.op) {
             case MP_OP_PUSH_NUM: {
-                ++vm->ip;
-                double operand = *(double*)&program->items[vm->ip];
-                mp_stack_push(stack, operand);
-                vm->ip += sizeof(operand);
+                *d = (MP_Dual){constants[inst.arg], 0.0};
             } break;
 
             case MP_OP_PUSH_VAR: {
-                ++vm->ip;
-                char var = *(char*)&program->items[vm->ip];
-                mp_stack_push(stack, vm->vars[(int)var]);
-                vm->ip += sizeof(var);
-            } break;
-
-            case MP_OP_ADD: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value + b.value);
-                ++vm->ip;
-            } break;
-
-            case MP_OP_SUB: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value - b.value);
-                ++vm->ip;
-            } break;
-
-            case MP_OP_MUL: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value * b.value);
-                ++vm->ip;
+                if (inst.arg == (uint32_t)(var - 'a'))
+                    *d = (MP_Dual){x, 1.0};
+                else
+                    *d = (MP_Dual){vm->vars[inst.arg], 0.0};
             } break;
 
-            case MP_OP_DIV: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value / b.value);
-                ++vm->ip;
+            case MP_OP_ADD:
+            case MP_OP_SUB:
+            case MP_OP_MUL:
+            case MP_OP_DIV:
+            case MP_OP_POW: {
+                *d = mp_dual_binary(inst.op, d[0], d[1]);
             } break;
 
-            case MP_OP_POW: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, pow(a.value, b.value));
-                ++vm->ip;
+            case MP_OP_POWI: {
+                *d = mp_dual_powi(*d, (int32_t)inst.arg);
             } break;
 
-            case MP_OP_NEG: {
-                MP_Optional n = mp_stack_pop(stack); ASSERT_PRESENT(n);
-                mp_stack_push(stack, -n.value);
-                ++vm->ip;
+            case MP_OP_NEG:
+            case MP_OP_LN:
+            case MP_OP_LOG:
+            case MP_OP_SIN:
+            case MP_OP_COS:
+            case MP_OP_TAN:
+            case MP_OP_SQRT: {
+                *d = mp_dual_unary(inst.op, *d);
             } break;
 
             default: {
-                return false;
+                ok = false;
             } break;
         }
     }
 
-    return true;
-
-#undef ASSERT_PRESENT
-}
-
-double mp_vm_result(MP_Vm *vm)
-{
-    if (vm == NULL)
-        return 0.0;
-
-    return mp_stack_peek(&vm->stack).value;
-}
-
-void mp_vm_free(MP_Vm *vm)
-{
-    if (vm == NULL)
-        return;
-
-    mp_da_free(&vm->stack);
-    mp_da_free(&vm->program);
+    if (ok)
+        *y = r[0];
+    if (r != stack)
+        MP_FREE(r);
+    return ok;
 }
 
 //----------------
@@ -1395,12 +4097,35 @@ MP_Env *mp_init(const char *expression)
 }
 
 MP_Env *mp_init_mode(const char *expression, MP_Mode mode)
+{
+    return mp_init_arena(expression, mode, NULL);
+}
+
+// Parses into a caller-owned arena, or into a private one if arena is NULL.
+// Compiled modes rewind the arena before returning, so it can be reused for
+// the next expression. In MP_MODE_INTERPRET the tree stays in the arena,
+// which then has to outlive the environment.
+MP_Env *mp_init_arena(const char *expression, MP_Mode mode, MP_Arena *arena)
 {
     if (expression == NULL) {
         return NULL;
     }
 
-    MP_Env *env = malloc(sizeof(*env));
+    return mp_init_ex(expression, strlen(expression), mode, arena, NULL);
+}
+
+// Compiles the expression, or its derivative with respect to var unless var
+// is '\0'
+static MP_Env *mp_init_env(const char *expression, size_t length, char var,
+                           MP_Mode mode, MP_Arena *arena, MP_Result *result)
+{
+    MP_Result ignored = {0};
+    if (result == NULL) {
+        result = &ignored;
+    }
+    *result = (MP_Result){0};
+
+    MP_Env *env = MP_MALLOC(sizeof(*env));
     if (env == NULL) {
         return NULL;
     }
@@ -1408,46 +4133,99 @@ MP_Env *mp_init_mode(const char *expression, MP_Mode mode)
 
     env->mode = mode;
 
-    MP_Token_List token_list = {0};
-
-    MP_Result tr = mp_tokenize(&token_list, expression);
-    if (tr.error) {
-        free(env);
-        mp_da_free(&token_list);
-        return NULL;
+    MP_Arena own = {0};
+    if (arena == NULL) {
+        arena = &own;
     }
+    MP_Arena_Mark mark = mp_arena_mark(arena);
 
-    MP_Arena arena = {0};
     MP_Parse_Tree parse_tree = {0};
 
-    MP_Result pr = mp_parse(&arena, &parse_tree, token_list);
-    if (pr.error) {
-        free(env);
-        mp_da_free(&token_list);
-        mp_arena_free(&arena);
+    *result = mp_parse_n(arena, &parse_tree, expression, length);
+    if (result->error) {
+        MP_FREE(env);
+        mp_arena_rewind(arena, mark);
+        mp_arena_free(&own);
         return NULL;
     }
 
-    mp_da_free(&token_list);
+#ifdef MP_TRACE_OPTIMIZER
+    printf("before: ");
+    mp_print_parse_tree(parse_tree);
+#endif
+
+    parse_tree.root = mp_optimize(arena, parse_tree.root);
+    if (var != '\0') {
+        parse_tree.root = mp_differentiate(arena, parse_tree.root, var);
+        if (parse_tree.root == NULL) {
+            MP_FREE(env);
+            mp_arena_rewind(arena, mark);
+            mp_arena_free(&own);
+            result->error = true;
+            result->error_type = MP_ERROR_INVALID_NODE;
+            return NULL;
+        }
+    }
+
+#ifdef MP_TRACE_OPTIMIZER
+    printf("after:  ");
+    mp_print_parse_tree(parse_tree);
+#endif
 
     switch (env->mode) {
         case MP_MODE_INTERPRET: {
-            env->interpreter = mp_interpreter_init(parse_tree, arena);
+            // A caller-owned arena is not handed over, own is empty then
+            env->interpreter = mp_interpreter_init(parse_tree, own);
         } break;
 
         case MP_MODE_COMPILE: {
             MP_Program program = {0};
 
-            if (!mp_program_compile(&program, parse_tree)) {
-                free(env);
-                mp_arena_free(&arena);
-                mp_da_free(&program);
+            bool compiled = mp_program_compile(&program, parse_tree);
+            mp_arena_rewind(arena, mark);
+            mp_arena_free(&own);
+
+            if (!compiled) {
+                MP_FREE(env);
+                mp_program_free(&program);
+                result->error = true;
+                result->error_type = MP_ERROR_INVALID_NODE;
                 return NULL;
             }
 
-            mp_arena_free(&arena);
-
             env->vm = mp_vm_init(program);
+            if (!env->vm.verified) {
+                mp_vm_free(&env->vm);
+                MP_FREE(env);
+                result->error = true;
+                result->error_type = MP_ERROR_INVALID_NODE;
+                return NULL;
+            }
+        } break;
+
+        case MP_MODE_JIT: {
+            MP_Program program = {0};
+
+            bool compiled = mp_program_compile(&program, parse_tree);
+            mp_arena_rewind(arena, mark);
+            mp_arena_free(&own);
+
+            if (!compiled) {
+                MP_FREE(env);
+                mp_program_free(&program);
+                result->error = true;
+                result->error_type = MP_ERROR_INVALID_NODE;
+                return NULL;
+            }
+
+            env->jit = mp_jit_init(program);
+            if (!env->jit.vm.verified) {
+                mp_jit_free(&env->jit);
+                MP_FREE(env);
+                result->error = true;
+                result->error_type = MP_ERROR_INVALID_NODE;
+                return NULL;
+            }
         } break;
 
         default: {
@@ -1462,6 +4240,116 @@ MP_Env *mp_init_mode(const char *expression, MP_Mode mode)
 
 }
 
+// Like mp_init_arena, for an expression of the given length. If result is not
+// NULL it receives the reason the expression did not compile. Errors after
+// parsing have no position.
+MP_Env *mp_init_ex(const char *expression, size_t length, MP_Mode mode,
+                   MP_Arena *arena, MP_Result *result)
+{
+    return mp_init_env(expression, length, '\0', mode, arena, result);
+}
+
+// Compiles the derivative of the expression with respect to var, see
+// mp_differentiate. The environment works like any other.
+MP_Env *mp_init_derivative(const char *expression, char var, MP_Mode mode)
+{
+    if (expression == NULL) {
+        return NULL;
+    }
+
+    return mp_init_derivative_ex(expression, strlen(expression), var, mode,
+                                 NULL, NULL);
+}
+
+MP_Env *mp_init_derivative_ex(const char *expression, size_t length, char var,
+                              MP_Mode mode, MP_Arena *arena, MP_Result *result)
+{
+    assert('a' <= var && var <= 'z');
+    return mp_init_env(expression, length, var, mode, arena, result);
+}
+
+// Compiles every item, parsing them all in the same arena. In the compiled
+// modes the arena is rewound after each item, so the whole batch parses in
+// the memory of its largest expression. An arena must not be shared between
+// threads; split the items and give every thread its own arena instead.
+// Returns the number of items that compiled.
+size_t mp_init_batch(MP_Batch_Item *items, size_t count, MP_Mode mode,
+                     MP_Arena *arena)
+{
+    size_t compiled = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        MP_Batch_Item *item = &items[i];
+        item->env = mp_init_ex(item->expression, item->length, mode, arena,
+                               &item->result);
+        if (item->env != NULL)
+            ++compiled;
+    }
+
+    return compiled;
+}
+
+// Creates an independent copy of an environment, including its variables.
+// Evaluating an environment mutates it, so every thread needs its own copy.
+MP_Env *mp_clone(const MP_Env *env)
+{
+    if (env == NULL)
+        return NULL;
+
+    MP_Env *clone = MP_MALLOC(sizeof(*clone));
+    if (clone == NULL)
+        return NULL;
+    memset(clone, 0, sizeof(*clone));
+
+    clone->mode = env->mode;
+
+    switch (env->mode) {
+        case MP_MODE_INTERPRET: {
+            const MP_Interpreter *src = &env->interpreter;
+
+            MP_Arena arena = mp_arena_init(src->arena.capacity);
+            if (arena.begin == NULL) {
+                MP_FREE(clone);
+                return NULL;
+            }
+
+            MP_Parse_Tree tree = src->tree;
+            tree.root = mp_tree_node_clone(&arena, src->tree.root);
+
+            clone->interpreter = mp_interpreter_init(tree, arena);
+            memcpy(clone->interpreter.vars, src->vars, sizeof(src->vars));
+        } break;
+
+        case MP_MODE_COMPILE:
+        case MP_MODE_JIT: {
+            const MP_Vm *src = env->mode == MP_MODE_JIT ? &env->jit.vm : &env->vm;
+            MP_Vm *dst = env->mode == MP_MODE_JIT ? &clone->jit.vm : &clone->vm;
+
+            MP_Program program = {0};
+            mp_program_clone(&program, &src->program);
+
+            if (env->mode == MP_MODE_JIT)
+                clone->jit = mp_jit_init(program);
+            else
+                clone->vm = mp_vm_init(program);
+
+            if (!dst->verified) {
+                mp_free(clone);
+                return NULL;
+            }
+
+            memcpy(dst->vars, src->vars, sizeof(src->vars));
+            dst->simd = src->simd;
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return clone;
+}
+
 void mp_variable(MP_Env *env, char var, double value)
 {
     if (env == NULL)
@@ -1476,6 +4364,10 @@ void mp_variable(MP_Env *env, char var, double value)
             mp_vm_var(&env->vm, var, value);
         } break;
 
+        case MP_MODE_JIT: {
+            mp_vm_var(&env->jit.vm, var, value);
+        } break;
+
         default: {
             assert(false && "Unreachable MP_MODE");
         } break;
@@ -1505,14 +4397,186 @@ MP_Result mp_evaluate(MP_Env *env)
             result.value = mp_vm_result(&env->vm);
         } break;
 
+        case MP_MODE_JIT: {
+            if (!mp_jit_run(&env->jit, &result.value)) {
+                result.error = true;
+                return result;
+            }
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return result;
+}
+
+// Evaluates the expression for every value of `var` in xs, storing the
+// results in ys. All backends process MP_BATCH_CAPACITY inputs per pass.
+MP_Result mp_evaluate_batch(MP_Env *env, char var, const double *xs,
+                            double *ys, size_t n)
+{
+    MP_Result result = {0};
+
+    if (env == NULL) {
+        result.error = true;
+        return result;
+    }
+
+    switch (env->mode) {
+        case MP_MODE_INTERPRET: {
+            result = mp_interpret_batch(&env->interpreter, var, xs, ys, n);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            if (!mp_vm_run_batch(&env->vm, var, xs, ys, n)) {
+                result.error = true;
+                return result;
+            }
+        } break;
+
+        // The vectorized VM is faster over a block than calling native code
+        // once per input
+        case MP_MODE_JIT: {
+            if (!mp_vm_run_batch(&env->jit.vm, var, xs, ys, n)) {
+                result.error = true;
+                return result;
+            }
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return result;
+}
+
+// Bounds the expression while var ranges over [lo, hi], see MP_Interval. All
+// backends walk the same program or tree as mp_evaluate.
+MP_Result mp_evaluate_interval(MP_Env *env, char var, double lo, double hi,
+                               MP_Interval *y)
+{
+    MP_Result result = {0};
+
+    if (env == NULL || y == NULL) {
+        result.error = true;
+        return result;
+    }
+
+    MP_Interval x = mp_interval(lo, hi);
+
+    switch (env->mode) {
+        case MP_MODE_INTERPRET: {
+            if (env->interpreter.tree.root == NULL) {
+                result.error = true;
+                result.error_type = MP_ERROR_EMPTY_EXPRESSION;
+                return result;
+            }
+
+            result = mp_interpret_interval(&env->interpreter,
+                    env->interpreter.tree.root, var, x, y);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            if (!mp_vm_run_interval(&env->vm, var, x, y)) {
+                result.error = true;
+                return result;
+            }
+        } break;
+
+        case MP_MODE_JIT: {
+            if (!mp_vm_run_interval(&env->jit.vm, var, x, y)) {
+                result.error = true;
+                return result;
+            }
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return result;
+}
+
+// Evaluates the expression and its derivative with respect to var at x, in a
+// single pass. The value is the one mp_evaluate computes, and var keeps the
+// value it was set to with mp_variable.
+MP_Result mp_evaluate_dual(MP_Env *env, char var, double x, MP_Dual *y)
+{
+    MP_Result result = {0};
+
+    if (env == NULL || y == NULL) {
+        result.error = true;
+        return result;
+    }
+
+    switch (env->mode) {
+        case MP_MODE_INTERPRET: {
+            if (env->interpreter.tree.root == NULL) {
+                result.error = true;
+                result.error_type = MP_ERROR_EMPTY_EXPRESSION;
+                return result;
+            }
+
+            result = mp_interpret_dual(&env->interpreter,
+                    env->interpreter.tree.root, var, x, y);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            if (!mp_vm_run_dual(&env->vm, var, x, y)) {
+                result.error = true;
+                return result;
+            }
+        } break;
+
+        case MP_MODE_JIT: {
+            if (!mp_vm_run_dual(&env->jit.vm, var, x, y)) {
+                result.error = true;
+                return result;
+            }
+        } break;
+
         default: {
             assert(false && "Unreachable MP_MODE");
         } break;
     }
 
+    if (!result.error)
+        result.value = y->value;
     return result;
 }
 
+// The variables the expression reads after optimization, see
+// MP_VARIABLE_BIT. Setting any other variable does not change its value.
+uint32_t mp_variables(const MP_Env *env)
+{
+    if (env == NULL)
+        return 0;
+
+    switch (env->mode) {
+        case MP_MODE_INTERPRET: {
+            return mp_node_variables(env->interpreter.tree.root);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            return env->vm.program.reads;
+        } break;
+
+        case MP_MODE_JIT: {
+            return env->jit.vm.program.reads;
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return 0;
+}
+
 void mp_free(MP_Env *env)
 {
     if (env == NULL)
@@ -1527,12 +4591,16 @@ void mp_free(MP_Env *env)
             mp_vm_free(&env->vm);
         } break;
 
+        case MP_MODE_JIT: {
+            mp_jit_free(&env->jit);
+        } break;
+
         default: {
             assert(false && "Unreachable MP_MODE");
         } break;
     }
 
-    free(env);
+    MP_FREE(env);
 }
 
 #endif // MP_IMPLEMENTATION
@@ -1540,6 +4608,21 @@ void mp_free(MP_Env *env)
 /*
     Revision history:
 
+        3.5.1 (2026-10-16) Intervals that reach out of the domain of sqrt or a^b are partly undefined but no longer discontinuous
+        3.5.0 (2026-10-16) Track the variables an expression reads, with mp_variables and mp_node_variables
+        3.4.0 (2026-10-16) Add mp_differentiate, mp_init_derivative and dual-number evaluation with mp_evaluate_dual
+        3.3.0 (2026-10-16) Add interval evaluation with mp_evaluate_interval, tracking where an expression is defined and continuous
+        3.2.0 (2026-10-16) Route allocations through overridable MP_MALLOC, MP_REALLOC, MP_ALIGNED_ALLOC and MP_FREE
+        3.1.0 (2026-10-16) Add mp_init_ex and mp_init_batch for compiling expressions that are not NUL-terminated
+        3.0.0 (2026-10-16) Parse from a streaming MP_Lexer; mp_parse takes the expression string instead of a token list
+        2.5.0 (2026-10-16) Growable, aligned MP_Arena with mark/rewind and mp_init_arena for caller-owned arenas
+        2.4.0 (2026-10-16) Add mp_clone for evaluating copies of an expression on several threads
+        2.3.0 (2026-10-16) Add MP_MODE_JIT: native x86-64 code for mp_evaluate with a VM fallback
+        2.2.0 (2026-10-16) Add SSE2/AVX2/AVX-512 kernels with runtime dispatch to the batch VM
+        2.1.0 (2026-10-16) Add an optimizer pass (constant folding, algebraic simplification) run by mp_init
+        2.0.0 (2026-10-16) New program format: fixed stack slots computed at compile time, separate constant pool, verification at load time
+        1.6.0 (2026-10-16) Add function opcodes (ln, log, sin, cos, tan, sqrt) to the compiler and the VM
+        1.5.0 (2026-10-16) Add batch evaluation (mp_evaluate_batch) to the interpreter and the VM
         1.4.0 (2025-06-01) Add functions log(), cos(), tan(), sqrt()
         1.3.0 (2025-06-01) Add function support (ln, sin) to the interpreter
         1.2.0 (2025-06-01) Now interpreter supports variables. Various fixes. Improved modularity
@@ -0,0 +1,467 @@
+// Tests of the mp.h backends against the tree-walking interpreter, of the
+// error positions reported by the parser, of the interval bounds and of the
+// derivatives
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MP_IMPLEMENTATION
+#include "mp.h"
+
+/* Macros */
+
+#define POINT_COUNT 129
+#define RANGE_BEGIN -4.0
+#define RANGE_END 4.0
+#define TOLERANCE 1e-9
+#define INTERVAL_COUNT 200
+#define INTERVAL_SAMPLES 16
+#define MAX_INTERVAL_WIDTH 2.0
+#define PARAMETER_A 1.5
+#define PARAMETER_B -0.25
+
+/* Declarations */
+
+typedef struct {
+    const char *expr;
+    MP_Error_Type error_type;
+    size_t error_position;
+} Error_Case;
+
+bool close_enough(double a, double b);
+bool close_enough_pole(double a, double b, bool pole);
+double reference(MP_Interpreter *interpreter, double x, bool *pole);
+void set_parameters(MP_Env *env);
+void fail(const char *test, const char *expr, const char *fmt, ...);
+void test_parity(const char *expr);
+void test_errors(void);
+void test_interval(const char *expr);
+void test_continuous(const char *expr);
+void test_derivative(const char *expr);
+double random_double(double lo, double hi);
+
+/* Globals */
+
+// Uses every opcode: the arithmetic ones, integer and real powers, negation
+// and all the functions, plus constants, parameters and poles on the grid
+const char *corpus[] = {
+    "x + 2",
+    "x - 3",
+    "2*x",
+    "1 / x",
+    "x^2",
+    "x^3 - 3*x^2 + 4",
+    "x^64",
+    "x^65",
+    "x^-2",
+    "x^0.5",
+    "2^x",
+    "x^x",
+    "-x",
+    "+x",
+    "-x^2",
+    "(-x)^3",
+    "ln(x)",
+    "log(x)",
+    "sin(x)",
+    "cos(x)",
+    "tan(x)",
+    "sqrt(x)",
+    "p*x",
+    "e^x",
+    "a*x + b",
+    "x / (x - x)",
+    "(2*x + 1) / (x^2 - 4)",
+    "(x^2 + 1) / ((x^2 - 1) * (x - 3))",
+    "sin(x) * cos(x) + tan(x / 2)",
+    "ln(x^2 + 1) + sqrt(log(x^2 + 2))",
+    "sqrt(ln(x)) - cos(a / x)",
+    "2",
+};
+
+// Continuous wherever they are defined, also at the ends of their domain,
+// which only leave the intervals that reach past them partly undefined
+const char *continuous_corpus[] = {
+    "sqrt(1 - x^2)",
+    "sqrt(x - 1)",
+    "sqrt(x^2 - 1)",
+    "sqrt(4 - x^2) * x",
+    "sqrt(sqrt(x))",
+    "sin(sqrt(x + 3))",
+    "x^0.5",
+    "x^1.5 + 1",
+    "2^x",
+    "x^3 - 3*x",
+};
+
+// Positions of the errors as reported by the parser before the tokenizer was
+// merged into it, which are kept identical
+Error_Case error_cases[] = {
+    {"", MP_ERROR_EMPTY_EXPRESSION, 0},
+    {" ", MP_ERROR_EMPTY_EXPRESSION, 0},
+    {"x +", MP_ERROR_INVALID_EXPRESSION, 2},
+    {"+", MP_ERROR_INVALID_EXPRESSION, 0},
+    {"*x", MP_ERROR_INVALID_EXPRESSION, 0},
+    {"x *", MP_ERROR_INVALID_EXPRESSION, 2},
+    {"(x", MP_ERROR_INVALID_EXPRESSION, 1},
+    {"x)", MP_ERROR_INVALID_EXPRESSION, 1},
+    {"()", MP_ERROR_INVALID_EXPRESSION, 1},
+    {"(x + 1))", MP_ERROR_INVALID_EXPRESSION, 7},
+    {"((x)", MP_ERROR_INVALID_EXPRESSION, 3},
+    {"sin", MP_ERROR_INVALID_EXPRESSION, 0},
+    {"sin(", MP_ERROR_INVALID_EXPRESSION, 3},
+    {"sin()", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"sin x", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"x $ 1", MP_ERROR_INVALID_TOKEN, 2},
+    {"1 + @", MP_ERROR_INVALID_TOKEN, 4},
+    {"x + 1 #", MP_ERROR_INVALID_TOKEN, 6},
+    {"2..3", MP_ERROR_INVALID_TOKEN, 2},
+    {"1.2.3", MP_ERROR_INVALID_TOKEN, 3},
+    {"x y", MP_ERROR_INVALID_EXPRESSION, 2},
+    {"2 3", MP_ERROR_INVALID_EXPRESSION, 2},
+    {"x ^", MP_ERROR_INVALID_EXPRESSION, 2},
+    {"^2", MP_ERROR_INVALID_EXPRESSION, 0},
+    {"ln(x", MP_ERROR_INVALID_EXPRESSION, 3},
+    {"log(x))", MP_ERROR_INVALID_EXPRESSION, 6},
+    {"sqrt(x,1)", MP_ERROR_INVALID_TOKEN, 6},
+    {"x + (", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"x + )", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"x / / 2", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"(((", MP_ERROR_INVALID_EXPRESSION, 2},
+    {")))", MP_ERROR_INVALID_EXPRESSION, 0},
+    {"x ^ ^ 2", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"tan(x) cos(x)", MP_ERROR_INVALID_EXPRESSION, 7},
+    {"1e", MP_ERROR_INVALID_EXPRESSION, 1},
+    {"1e+", MP_ERROR_INVALID_EXPRESSION, 1},
+    {".", MP_ERROR_INVALID_TOKEN, 0},
+    {"x + .", MP_ERROR_INVALID_TOKEN, 4},
+    {"abc", MP_ERROR_INVALID_EXPRESSION, 0},
+    {"x + 1 + $", MP_ERROR_INVALID_TOKEN, 8},
+    {"$", MP_ERROR_INVALID_TOKEN, 0},
+    {"(x + 1) $ 2", MP_ERROR_INVALID_TOKEN, 8},
+    {"sin(x $)", MP_ERROR_INVALID_TOKEN, 6},
+    {"x,", MP_ERROR_INVALID_TOKEN, 1},
+    {",x", MP_ERROR_INVALID_TOKEN, 0},
+    {"3 * (4 + )", MP_ERROR_INVALID_EXPRESSION, 9},
+    {"-", MP_ERROR_INVALID_EXPRESSION, 0},
+    {"--x +", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"x + -", MP_ERROR_INVALID_EXPRESSION, 4},
+    {"x_1", MP_ERROR_INVALID_TOKEN, 1},
+};
+
+double xs[POINT_COUNT];
+size_t failure_count = 0;
+size_t check_count = 0;
+uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+int main(void)
+{
+    // Exact binary fractions, so that the poles of the corpus are hit
+    for (size_t i = 0; i < POINT_COUNT; ++i) {
+        xs[i] = RANGE_BEGIN + (RANGE_END - RANGE_BEGIN) * i / (POINT_COUNT - 1);
+    }
+
+    printf("SIMD: %s\n", mp_simd_level_to_string(mp_simd_kernels()->level));
+
+    size_t corpus_count = sizeof(corpus)/sizeof(corpus[0]);
+    for (size_t i = 0; i < corpus_count; ++i) {
+        test_parity(corpus[i]);
+        test_interval(corpus[i]);
+        test_derivative(corpus[i]);
+    }
+    size_t continuous_count = sizeof(continuous_corpus)/sizeof(continuous_corpus[0]);
+    for (size_t i = 0; i < continuous_count; ++i) {
+        test_interval(continuous_corpus[i]);
+        test_continuous(continuous_corpus[i]);
+    }
+    test_errors();
+
+    printf("%zu checks, %zu failures\n", check_count, failure_count);
+    return failure_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// NAN matches NAN, so that the inputs where an expression is not defined
+// have to agree as well
+bool close_enough(double a, double b)
+{
+    if (isnan(a) || isnan(b))
+        return isnan(a) && isnan(b);
+    if (isinf(a) || isinf(b))
+        return a == b;
+    double scale = fmax(1.0, fmax(fabs(a), fabs(b)));
+    return fabs(a - b) <= TOLERANCE * scale;
+}
+
+// The interpreter reports a division by zero as an error, while the compiled
+// backends and the dual numbers carry on with the IEEE result. At such a pole
+// any value that is not finite is accepted.
+bool close_enough_pole(double a, double b, bool pole)
+{
+    if (pole)
+        return !isfinite(a);
+    return close_enough(a, b);
+}
+
+// The tree-walking interpreter on the tree straight from the parser, before
+// any optimization folds the constants. Errors are NAN, like in the batch
+// functions.
+double reference(MP_Interpreter *interpreter, double x, bool *pole)
+{
+    mp_interpreter_var(interpreter, 'x', x);
+    MP_Result r = mp_interpret_node(interpreter, interpreter->tree.root);
+    *pole = r.error && r.error_type == MP_ERROR_ZERO_DIVISION;
+    return r.error ? NAN : r.value;
+}
+
+void set_parameters(MP_Env *env)
+{
+    mp_variable(env, 'a', PARAMETER_A);
+    mp_variable(env, 'b', PARAMETER_B);
+}
+
+void fail(const char *test, const char *expr, const char *fmt, ...)
+{
+    failure_count++;
+    printf("FAIL %s '%s': ", test, expr);
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+}
+
+// Every mode, scalar and batch, and the batch kernels with and without SIMD
+void test_parity(const char *expr)
+{
+    MP_Arena arena = {0};
+    MP_Parse_Tree tree = {0};
+    MP_Result r = mp_parse(&arena, &tree, expr);
+    if (r.error) {
+        fail("parity", expr, "could not parse");
+        mp_arena_free(&arena);
+        return;
+    }
+    MP_Interpreter interpreter = mp_interpreter_init(tree, arena);
+    mp_interpreter_var(&interpreter, 'a', PARAMETER_A);
+    mp_interpreter_var(&interpreter, 'b', PARAMETER_B);
+    mp_interpreter_var(&interpreter, 'e', M_E);
+    mp_interpreter_var(&interpreter, 'p', M_PI);
+
+    double expected[POINT_COUNT];
+    bool poles[POINT_COUNT];
+    for (size_t i = 0; i < POINT_COUNT; ++i) {
+        expected[i] = reference(&interpreter, xs[i], &poles[i]);
+    }
+
+    for (MP_Mode mode = 0; mode < MP_MODE_COUNT; ++mode) {
+        MP_Env *env = mp_init_mode(expr, mode);
+        if (env == NULL) {
+            fail("parity", expr, "could not compile in mode %d", mode);
+            continue;
+        }
+        set_parameters(env);
+
+        for (size_t i = 0; i < POINT_COUNT; ++i) {
+            mp_variable(env, 'x', xs[i]);
+            MP_Result s = mp_evaluate(env);
+            double y = s.error ? NAN : s.value;
+            check_count++;
+            if (!close_enough_pole(y, expected[i], poles[i] && mode != MP_MODE_INTERPRET)) {
+                fail("parity", expr, "mode %d scalar at x = %g: %.17g, expected %.17g",
+                     mode, xs[i], y, expected[i]);
+            }
+        }
+
+        size_t kernel_count = mode == MP_MODE_INTERPRET ? 1 : 2;
+        for (size_t k = 0; k < kernel_count; ++k) {
+            if (k == 1) env->vm.simd = mp_simd_kernels_for(MP_SIMD_NONE);
+
+            double ys[POINT_COUNT];
+            mp_evaluate_batch(env, 'x', xs, ys, POINT_COUNT);
+            for (size_t i = 0; i < POINT_COUNT; ++i) {
+                check_count++;
+                if (!close_enough_pole(ys[i], expected[i], poles[i] && mode != MP_MODE_INTERPRET)) {
+                    fail("parity", expr, "mode %d batch%s at x = %g: %.17g, expected %.17g",
+                         mode, k == 1 ? " scalar" : "", xs[i], ys[i], expected[i]);
+                }
+            }
+        }
+
+        mp_free(env);
+    }
+
+    mp_interpreter_free(&interpreter);
+}
+
+// Both through the parser and through mp_init_ex, which has to report the
+// same error without an environment
+void test_errors(void)
+{
+    for (size_t i = 0; i < sizeof(error_cases)/sizeof(error_cases[0]); ++i) {
+        Error_Case c = error_cases[i];
+
+        MP_Arena arena = {0};
+        MP_Parse_Tree tree = {0};
+        MP_Result r = mp_parse(&arena, &tree, c.expr);
+        mp_arena_free(&arena);
+        check_count++;
+        if (!r.error || r.error_type != c.error_type
+                || r.error_position != c.error_position) {
+            fail("errors", c.expr, "parse gave %s at %zu, expected %s at %zu",
+                 mp_error_to_string(r.error_type), r.error_position,
+                 mp_error_to_string(c.error_type), c.error_position);
+        }
+
+        MP_Result ri = {0};
+        MP_Env *env = mp_init_ex(c.expr, strlen(c.expr), MP_MODE_COMPILE, NULL, &ri);
+        check_count++;
+        if (env != NULL || ri.error_type != c.error_type
+                || ri.error_position != c.error_position) {
+            fail("errors", c.expr, "init gave %s at %zu, expected %s at %zu",
+                 mp_error_to_string(ri.error_type), ri.error_position,
+                 mp_error_to_string(c.error_type), c.error_position);
+        }
+        mp_free(env);
+    }
+}
+
+// The bounds of an interval have to contain the value at every point of it,
+// an interval that is said to be defined can not contain a NAN and one that
+// is said to be continuous is bounded and can not contain a pole. Every other
+// interval is on the grid, so that the poles of the corpus are hit.
+void test_interval(const char *expr)
+{
+    double step = (RANGE_END - RANGE_BEGIN) / (POINT_COUNT - 1);
+
+    for (MP_Mode mode = 0; mode < MP_MODE_COUNT; ++mode) {
+        MP_Env *env = mp_init_mode(expr, mode);
+        if (env == NULL) {
+            fail("interval", expr, "could not compile in mode %d", mode);
+            continue;
+        }
+        set_parameters(env);
+
+        for (size_t n = 0; n < INTERVAL_COUNT; ++n) {
+            double lo = random_double(RANGE_BEGIN, RANGE_END);
+            double hi = lo + random_double(0.0, MAX_INTERVAL_WIDTH);
+            if (n % 2 == 1) {
+                lo = xs[(size_t)random_double(0.0, POINT_COUNT)];
+                hi = lo + step * ceil(random_double(0.0, MAX_INTERVAL_WIDTH / step));
+            }
+            MP_Interval y;
+            MP_Result r = mp_evaluate_interval(env, 'x', lo, hi, &y);
+            if (r.error) continue;
+
+            check_count++;
+            if (y.continuous && !(isfinite(y.lo) && isfinite(y.hi))) {
+                fail("interval", expr, "mode %d [%g, %g] is continuous but gave [%g, %g]",
+                     mode, lo, hi, y.lo, y.hi);
+            }
+
+            for (size_t i = 0; i <= INTERVAL_SAMPLES; ++i) {
+                double x = lo + (hi - lo) * i / INTERVAL_SAMPLES;
+                mp_variable(env, 'x', x);
+                MP_Result s = mp_evaluate(env);
+                double v = s.error ? NAN : s.value;
+                bool pole = s.error ? s.error_type == MP_ERROR_ZERO_DIVISION : isinf(v);
+
+                check_count++;
+                if (pole && y.continuous) {
+                    fail("interval", expr, "mode %d [%g, %g] is continuous but x = %g is a pole",
+                         mode, lo, hi, x);
+                }
+                if (isnan(v)) {
+                    if (y.defined) {
+                        fail("interval", expr, "mode %d [%g, %g] is defined but x = %g is not",
+                             mode, lo, hi, x);
+                    }
+                    continue;
+                }
+                double slack = TOLERANCE * fmax(1.0, fabs(v));
+                if (!(y.lo - slack <= v && v <= y.hi + slack)) {
+                    fail("interval", expr, "mode %d [%g, %g] gave [%g, %g], x = %g is %.17g",
+                         mode, lo, hi, y.lo, y.hi, x, v);
+                }
+            }
+        }
+
+        mp_free(env);
+    }
+}
+
+// Every interval of an expression from continuous_corpus that is not
+// undefined everywhere has to be continuous
+void test_continuous(const char *expr)
+{
+    for (MP_Mode mode = 0; mode < MP_MODE_COUNT; ++mode) {
+        MP_Env *env = mp_init_mode(expr, mode);
+        if (env == NULL) {
+            fail("continuous", expr, "could not compile in mode %d", mode);
+            continue;
+        }
+
+        for (size_t n = 0; n < INTERVAL_COUNT; ++n) {
+            double lo = random_double(RANGE_BEGIN, RANGE_END);
+            double hi = lo + random_double(0.0, MAX_INTERVAL_WIDTH);
+            MP_Interval y;
+            MP_Result r = mp_evaluate_interval(env, 'x', lo, hi, &y);
+            if (r.error || mp_interval_is_empty(y)) continue;
+
+            check_count++;
+            if (!y.continuous) {
+                fail("continuous", expr, "mode %d [%g, %g] is not continuous",
+                     mode, lo, hi);
+            }
+        }
+
+        mp_free(env);
+    }
+}
+
+// The derivative as an expression of its own against the dual numbers
+void test_derivative(const char *expr)
+{
+    for (MP_Mode mode = 0; mode < MP_MODE_COUNT; ++mode) {
+        MP_Env *env = mp_init_mode(expr, mode);
+        MP_Env *derivative = mp_init_derivative(expr, 'x', mode);
+        if (env == NULL || derivative == NULL) {
+            fail("derivative", expr, "could not compile in mode %d", mode);
+            mp_free(env);
+            mp_free(derivative);
+            continue;
+        }
+        set_parameters(env);
+        set_parameters(derivative);
+
+        for (size_t i = 0; i < POINT_COUNT; ++i) {
+            MP_Dual dual;
+            MP_Result rd = mp_evaluate_dual(env, 'x', xs[i], &dual);
+            mp_variable(derivative, 'x', xs[i]);
+            MP_Result r = mp_evaluate(derivative);
+
+            double expected = rd.error ? NAN : dual.derivative;
+            double actual = r.error ? NAN : r.value;
+            check_count++;
+            if (!close_enough_pole(actual, expected, !isfinite(expected))) {
+                fail("derivative", expr, "mode %d at x = %g: %.17g, dual %.17g",
+                     mode, xs[i], actual, expected);
+            }
+        }
+
+        mp_free(env);
+        mp_free(derivative);
+    }
+}
+
+// xorshift64*, so that the runs are reproducible
+double random_double(double lo, double hi)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    uint64_t bits = rng_state * 0x2545F4914F6CDD1Dull;
+    return lo + (hi - lo) * (double)(bits >> 11) / (double)(1ull << 53);
+}